@@ -0,0 +1,415 @@
+// Benchmark.cpp : Reproducible performance sweep of minPath, optimalMin and meetInTheMiddleMin (Linux).
+// Every instance comes from a seeded generator, so the same command line benchmarks exactly the same matrices on
+// every machine and every release. There are three families of symmetric instances:
+// - uniform:   every weight uniform in [0, 1000)
+// - euclidean: every node a uniform random point in a 1000 x 1000 square, weights are straight line distances
+// - clustered: like euclidean but the points are scattered (normally) around a handful of cluster centres, which is
+//              where greedy choices tend to go wrong
+// The random numbers are made straight from the raw 64 bit generator output rather than the std:: distributions,
+// whose output isn't specified by the standard and differs between standard libraries.
+//
+// For every (solver, family, n, seed) we record the best wall time over the repeats, the number of states expanded
+// (and so states per second), the peak resident memory during the solve, the weight found and, whenever n is small
+// enough for optimalMin, the gap to the optimal weight. Results go out as CSV or JSON for comparing between releases.
+//
+// "States" are counted from the sizes of the searches rather than with counters inside the solvers, so timing them
+// costs nothing: optimalMin fills in (numNodes / 2) * 2^(numNodes / 2) (pair mask, head) states, meetInTheMiddleMin
+// the states of the layers up to the middle from both ends, and minPath looks at 2 * numNodes edges to pick its start
+// plus one candidate node per unvisited pair per step. The mitm solver runs on the optimal sizes, which are capped at
+// kMaxOptimalNodes like the command line's exact solvers.
+//
+// Usage: VergeBenchmark [--solvers greedy,optimal,mitm] [--families uniform,euclidean,clustered]
+//                       [--greedy-sizes 16,64,...] [--optimal-sizes 8,12,...] [--seeds N] [--seed S]
+//                       [--repeats R] [--threads N] [--format csv|json] [--output FILE]
+#define VERGEPROJECT_NO_MAIN
+#include "../VergeProject/VergeProject.cpp"
+
+#include <cmath>
+#include <cstdio>
+#include <map>
+
+enum class InstanceFamily
+{
+    Uniform,
+    Euclidean,
+    Clustered,
+};
+
+const char* familyName(InstanceFamily family)
+{
+    switch (family)
+    {
+    case InstanceFamily::Uniform: return "uniform";
+    case InstanceFamily::Euclidean: return "euclidean";
+    default: return "clustered";
+    }
+}
+
+// A double in [0, 1) from the top 53 bits of the generator
+double unitRandom(std::mt19937_64& rng)
+{
+    return static_cast<double>(rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Standard normal (Box-Muller)
+double normalRandom(std::mt19937_64& rng)
+{
+    double u1 = 1.0 - unitRandom(rng);
+    double u2 = unitRandom(rng);
+    return std::sqrt(-2.0 * std::log(u1)) * std::cos(6.283185307179586 * u2);
+}
+
+DistanceMatrix<double> makeInstance(InstanceFamily family, int numNodes, std::uint64_t iSeed)
+{
+    std::mt19937_64 rng(iSeed * 1000003 + static_cast<std::uint64_t>(family) * 7919 + static_cast<std::uint64_t>(numNodes));
+    DistanceMatrix<double> matrix(numNodes);
+
+    if (family == InstanceFamily::Uniform)
+    {
+        for (int i = 0; i < numNodes; i++)
+        {
+            for (int j = i + 1; j < numNodes; j++)
+            {
+                double dWeight = 1000.0 * unitRandom(rng);
+                matrix.set(i, j, dWeight);
+                matrix.set(j, i, dWeight);
+            }
+        }
+        return matrix;
+    }
+
+    std::vector<double> vX(numNodes), vY(numNodes);
+    if (family == InstanceFamily::Euclidean)
+    {
+        for (int i = 0; i < numNodes; i++)
+        {
+            vX[i] = 1000.0 * unitRandom(rng);
+            vY[i] = 1000.0 * unitRandom(rng);
+        }
+    }
+    else
+    {
+        int iNumClusters = std::max(2, numNodes / 16);
+        std::vector<double> vCentreX(iNumClusters), vCentreY(iNumClusters);
+        for (int c = 0; c < iNumClusters; c++)
+        {
+            vCentreX[c] = 1000.0 * unitRandom(rng);
+            vCentreY[c] = 1000.0 * unitRandom(rng);
+        }
+        for (int i = 0; i < numNodes; i++)
+        {
+            int c = static_cast<int>(rng() % static_cast<std::uint64_t>(iNumClusters));
+            vX[i] = vCentreX[c] + 20.0 * normalRandom(rng);
+            vY[i] = vCentreY[c] + 20.0 * normalRandom(rng);
+        }
+    }
+
+    for (int i = 0; i < numNodes; i++)
+    {
+        for (int j = 0; j < numNodes; j++)
+        {
+            matrix.set(i, j, std::hypot(vX[i] - vX[j], vY[i] - vY[j]));
+        }
+    }
+    return matrix;
+}
+
+// Peak resident memory. Linux keeps the high water mark in /proc/self/status (VmHWM) and lets us reset it to the
+// current size through /proc/self/clear_refs, so we can measure each solve on its own
+void resetPeakRss()
+{
+    if (std::FILE* pFile = std::fopen("/proc/self/clear_refs", "w"))
+    {
+        std::fputs("5", pFile);
+        std::fclose(pFile);
+    }
+}
+
+long peakRssKb()
+{
+    std::ifstream status("/proc/self/status");
+    std::string sLine;
+    while (std::getline(status, sLine))
+    {
+        if (sLine.rfind("VmHWM:", 0) == 0) return std::stol(sLine.substr(6));
+    }
+    return 0;
+}
+
+double optimalStates(int numNodes)
+{
+    int iNumPairs = numNodes / 2;
+    return static_cast<double>(iNumPairs) * std::ldexp(1.0, iNumPairs);
+}
+
+double meetInTheMiddleStates(int numNodes)
+{
+    int iNumPairs = numNodes / 2;
+    double dStates = 0.0;
+    for (int iLayer = 1; iLayer <= iNumPairs - iNumPairs / 2; iLayer++)
+    {
+        double dLayer = static_cast<double>(binomial(iNumPairs, iLayer)) * 2 * iLayer;
+        dStates += iLayer <= iNumPairs / 2 ? 2 * dLayer : dLayer;
+    }
+    return dStates;
+}
+
+double greedyStates(int numNodes)
+{
+    double dNumPairs = numNodes / 2;
+    return 2.0 * numNodes + dNumPairs * (dNumPairs - 1.0);
+}
+
+struct BenchmarkResult
+{
+    std::string sSolver;
+    InstanceFamily family;
+    int numNodes;
+    std::uint64_t iSeed;
+    double dWallMs;
+    double dStates;
+    long iPeakRssKb;
+    double dWeight;
+    double dOptimalWeight;  // NaN when n is too big to solve exactly
+};
+
+struct BenchmarkOptions
+{
+    std::vector<std::string> vSolvers{ "greedy", "optimal" };
+    std::vector<InstanceFamily> vFamilies{ InstanceFamily::Uniform, InstanceFamily::Euclidean, InstanceFamily::Clustered };
+    std::vector<int> vGreedySizes{ 16, 64, 256, 1024, 4096 };
+    std::vector<int> vOptimalSizes{ 8, 12, 16, 20, 24, 28 };
+    int numSeeds = 3;
+    std::uint64_t iFirstSeed = 1;
+    int numRepeats = 3;
+    unsigned numThreads = 1;
+    std::string sFormat = "csv";
+    std::string sOutput;
+};
+
+// Best of numRepeats runs of solve(). Peak memory is taken from the first run
+template <typename Solve>
+void timeSolve(const BenchmarkOptions& options, Solve solve, BenchmarkResult& result)
+{
+    result.dWallMs = std::numeric_limits<double>::infinity();
+    for (int iRepeat = 0; iRepeat < options.numRepeats; iRepeat++)
+    {
+        if (iRepeat == 0) resetPeakRss();
+        auto start = std::chrono::steady_clock::now();
+        result.dWeight = solve();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        if (iRepeat == 0) result.iPeakRssKb = peakRssKb();
+        result.dWallMs = std::min(result.dWallMs, elapsed.count());
+    }
+}
+
+std::vector<BenchmarkResult> runBenchmark(const BenchmarkOptions& options)
+{
+    const double dNaN = std::numeric_limits<double>::quiet_NaN();
+    bool bGreedy = std::find(options.vSolvers.begin(), options.vSolvers.end(), "greedy") != options.vSolvers.end();
+    bool bOptimal = std::find(options.vSolvers.begin(), options.vSolvers.end(), "optimal") != options.vSolvers.end();
+    bool bMitm = std::find(options.vSolvers.begin(), options.vSolvers.end(), "mitm") != options.vSolvers.end();
+    int iMaxOptimalNodes = options.vOptimalSizes.empty() ? 0 : *std::max_element(options.vOptimalSizes.begin(), options.vOptimalSizes.end());
+
+    ExactSolverOptions exactOptions;
+    exactOptions.m_numThreads = options.numThreads;
+
+    // Every size either solver needs, so each instance is only generated (and solved exactly) once
+    std::vector<int> vSizes;
+    if (bGreedy) vSizes.insert(vSizes.end(), options.vGreedySizes.begin(), options.vGreedySizes.end());
+    if (bOptimal || bMitm) vSizes.insert(vSizes.end(), options.vOptimalSizes.begin(), options.vOptimalSizes.end());
+    std::sort(vSizes.begin(), vSizes.end());
+    vSizes.erase(std::unique(vSizes.begin(), vSizes.end()), vSizes.end());
+
+    std::vector<BenchmarkResult> vResults;
+    for (InstanceFamily family : options.vFamilies)
+    {
+        for (int numNodes : vSizes)
+        {
+            bool bRunGreedy = bGreedy && std::count(options.vGreedySizes.begin(), options.vGreedySizes.end(), numNodes);
+            bool bRunOptimal = bOptimal && std::count(options.vOptimalSizes.begin(), options.vOptimalSizes.end(), numNodes);
+            bool bRunMitm = bMitm && std::count(options.vOptimalSizes.begin(), options.vOptimalSizes.end(), numNodes);
+
+            for (int iSeedIndex = 0; iSeedIndex < options.numSeeds; iSeedIndex++)
+            {
+                std::uint64_t iSeed = options.iFirstSeed + iSeedIndex;
+                DistanceMatrix<double> matrix = makeInstance(family, numNodes, iSeed);
+
+                BenchmarkResult optimal{ "optimal", family, numNodes, iSeed, 0.0, optimalStates(numNodes), 0, dNaN, dNaN };
+                if (bRunOptimal)
+                {
+                    timeSolve(options, [&] { return optimalMin(matrix, exactOptions).first; }, optimal);
+                    optimal.dOptimalWeight = optimal.dWeight;
+                }
+                else if (numNodes <= iMaxOptimalNodes)
+                {
+                    optimal.dOptimalWeight = optimalMin(matrix, exactOptions).first;
+                }
+
+                if (bRunGreedy)
+                {
+                    BenchmarkResult greedy{ "greedy", family, numNodes, iSeed, 0.0, greedyStates(numNodes), 0, dNaN, optimal.dOptimalWeight };
+                    timeSolve(options, [&] { return minPath(matrix).first; }, greedy);
+                    vResults.push_back(greedy);
+                }
+                if (bRunOptimal) vResults.push_back(optimal);
+
+                if (bRunMitm)
+                {
+                    BenchmarkResult mitm{ "mitm", family, numNodes, iSeed, 0.0, meetInTheMiddleStates(numNodes), 0, dNaN, optimal.dOptimalWeight };
+                    timeSolve(options, [&] { return meetInTheMiddleMin(matrix, exactOptions).first; }, mitm);
+                    vResults.push_back(mitm);
+                }
+            }
+        }
+    }
+    return vResults;
+}
+
+void writeResults(std::ostream& out, const BenchmarkOptions& options, const std::vector<BenchmarkResult>& vResults)
+{
+    const char* aSimdNames[] = { "scalar", "avx2", "avx512" };
+    const char* sSimd = aSimdNames[static_cast<int>(detectSimdLevel())];
+    out.precision(10);
+
+    auto gap = [](const BenchmarkResult& result)
+    {
+        if (std::isnan(result.dOptimalWeight)) return std::numeric_limits<double>::quiet_NaN();
+        return result.dOptimalWeight > 0.0 ? (result.dWeight - result.dOptimalWeight) / result.dOptimalWeight : 0.0;
+    };
+
+    if (options.sFormat == "json")
+    {
+        out << "{\n  \"simd\": \"" << sSimd << "\",\n  \"threads\": " << options.numThreads << ",\n  \"repeats\": " << options.numRepeats
+            << ",\n  \"results\": [";
+        for (std::size_t i = 0; i < vResults.size(); i++)
+        {
+            const BenchmarkResult& result = vResults[i];
+            out << (i ? "," : "") << "\n    { \"solver\": \"" << result.sSolver << "\", \"family\": \"" << familyName(result.family)
+                << "\", \"n\": " << result.numNodes << ", \"seed\": " << result.iSeed << ", \"wall_ms\": " << result.dWallMs
+                << ", \"states\": " << result.dStates << ", \"states_per_sec\": " << result.dStates / (result.dWallMs / 1000.0)
+                << ", \"peak_rss_kb\": " << result.iPeakRssKb << ", \"weight\": " << result.dWeight << ", \"gap\": ";
+            if (std::isnan(gap(result))) out << "null";
+            else out << gap(result);
+            out << " }";
+        }
+        out << "\n  ]\n}\n";
+        return;
+    }
+
+    out << "solver,family,n,seed,wall_ms,states,states_per_sec,peak_rss_kb,weight,gap,simd,threads\n";
+    for (const BenchmarkResult& result : vResults)
+    {
+        out << result.sSolver << "," << familyName(result.family) << "," << result.numNodes << "," << result.iSeed << ","
+            << result.dWallMs << "," << result.dStates << "," << result.dStates / (result.dWallMs / 1000.0) << ","
+            << result.iPeakRssKb << "," << result.dWeight << ",";
+        if (!std::isnan(gap(result))) out << gap(result);
+        out << "," << sSimd << "," << options.numThreads << "\n";
+    }
+}
+
+std::vector<std::string> splitList(const std::string& sList)
+{
+    std::vector<std::string> vItems;
+    std::istringstream in(sList);
+    for (std::string sItem; std::getline(in, sItem, ','); )
+    {
+        if (!sItem.empty()) vItems.push_back(sItem);
+    }
+    return vItems;
+}
+
+int printUsage()
+{
+    std::cerr << "usage: VergeBenchmark [--solvers greedy,optimal,mitm] [--families uniform,euclidean,clustered]\n"
+        << "                      [--greedy-sizes 16,64,...] [--optimal-sizes 8,12,...] [--seeds N] [--seed S]\n"
+        << "                      [--repeats R] [--threads N] [--format csv|json] [--output FILE]" << std::endl;
+    return 2;
+}
+
+int main(int argc, char* argv[])
+{
+    BenchmarkOptions options;
+    const std::map<std::string, InstanceFamily> families{
+        { "uniform", InstanceFamily::Uniform }, { "euclidean", InstanceFamily::Euclidean }, { "clustered", InstanceFamily::Clustered } };
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string sArg = argv[i];
+        if (i + 1 >= argc)
+        {
+            std::cerr << "missing value for " << sArg << std::endl;
+            return 2;
+        }
+        std::string sValue = argv[++i];
+
+        if (sArg == "--solvers") options.vSolvers = splitList(sValue);
+        else if (sArg == "--families")
+        {
+            options.vFamilies.clear();
+            for (const std::string& sName : splitList(sValue))
+            {
+                auto it = families.find(sName);
+                if (it == families.end())
+                {
+                    std::cerr << "unknown family " << sName << std::endl;
+                    return 2;
+                }
+                options.vFamilies.push_back(it->second);
+            }
+        }
+        else if (sArg == "--greedy-sizes" || sArg == "--optimal-sizes")
+        {
+            std::vector<int>& vSizes = sArg == "--greedy-sizes" ? options.vGreedySizes : options.vOptimalSizes;
+            vSizes.clear();
+            for (const std::string& sSize : splitList(sValue))
+            {
+                // Sizes have to be even for the solvers to give anything but an error value back. The exact solvers
+                // get the same cap as on the command line, past it they can't finish (or even allocate their tables)
+                const int iMaxNodes = sArg == "--greedy-sizes" ? std::numeric_limits<int>::max() : static_cast<int>(kMaxOptimalNodes);
+                int numNodes = 0;
+                if (!parseWholeNumber(sSize, 2, iMaxNodes, numNodes) || numNodes % 2 != 0) return printUsage();
+                vSizes.push_back(numNodes);
+            }
+        }
+        else if (sArg == "--seeds")
+        {
+            if (!parseWholeNumber(sValue, 0, std::numeric_limits<int>::max(), options.numSeeds)) return printUsage();
+        }
+        else if (sArg == "--seed")
+        {
+            if (!parseWholeNumber(sValue, std::uint64_t{ 0 }, std::numeric_limits<std::uint64_t>::max(), options.iFirstSeed)) return printUsage();
+        }
+        else if (sArg == "--repeats")
+        {
+            if (!parseWholeNumber(sValue, 1, std::numeric_limits<int>::max(), options.numRepeats)) return printUsage();
+        }
+        else if (sArg == "--threads")
+        {
+            if (!parseWholeNumber(sValue, 0u, std::numeric_limits<unsigned>::max(), options.numThreads)) return printUsage();
+        }
+        else if (sArg == "--format")
+        {
+            if (sValue != "csv" && sValue != "json") return printUsage();
+            options.sFormat = sValue;
+        }
+        else if (sArg == "--output") options.sOutput = sValue;
+        else
+        {
+            std::cerr << "unknown option " << sArg << std::endl;
+            return 2;
+        }
+    }
+
+    std::vector<BenchmarkResult> vResults = runBenchmark(options);
+
+    if (options.sOutput.empty())
+    {
+        writeResults(std::cout, options, vResults);
+        return 0;
+    }
+
+    std::ofstream out(options.sOutput);
+    writeResults(out, options, vResults);
+    return out ? 0 : 1;
+}
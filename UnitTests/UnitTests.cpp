@@ -1,6 +1,8 @@
 #include "pch.h"
 #include "CppUnitTest.h"
 
+#include <set>
+
 #include "../VergeProject/VergeProject.cpp"
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
@@ -29,6 +31,10 @@ namespace UnitTests
 			std::vector<int> expected = { 1, 3 };
 			Assert::IsTrue(min.second == expected, L"Expected result is {1, 3}");
 			Assert::IsTrue(opt.second == expected, L"Expected result is {1, 3}");
+
+			auto bnb = branchAndBoundMin(test);
+			Assert::AreEqual(bnb.first, opt.first);
+			Assert::IsTrue(bnb.second == opt.second, L"branchAndBoundMin should match optimalMin");
 		}
 
 		TEST_METHOD(AllZeros)
@@ -50,6 +56,10 @@ namespace UnitTests
 			std::vector<int> expected = { 0, 2, 4 };
 			Assert::IsTrue(min.second == expected, L"Expected result is {0, 2, 4}");
 			Assert::IsTrue(opt.second == expected, L"Expected result is {0, 2, 4}");
+
+			auto bnb = branchAndBoundMin(test);
+			Assert::AreEqual(bnb.first, opt.first);
+			Assert::IsTrue(bnb.second == opt.second, L"branchAndBoundMin should match optimalMin");
 		}
 
 		TEST_METHOD(TwoByTwo)
@@ -68,6 +78,10 @@ namespace UnitTests
 			std::vector<int> expected = { 0 };
 			Assert::IsTrue(min.second == expected, L"Expected result is {0}");
 			Assert::IsTrue(opt.second == expected, L"Expected result is {0}");
+
+			auto bnb = branchAndBoundMin(test);
+			Assert::AreEqual(bnb.first, opt.first);
+			Assert::IsTrue(bnb.second == opt.second, L"branchAndBoundMin should match optimalMin");
 		}
 
 		TEST_METHOD(ZeroNodes)
@@ -87,6 +101,10 @@ namespace UnitTests
 			std::vector<int> expected = { };
 			Assert::IsTrue(min.second == expected, L"Expected result is { }");
 			Assert::IsTrue(opt.second == expected, L"Expected result is { }");
+
+			auto bnb = branchAndBoundMin(test);
+			Assert::AreEqual(bnb.first, opt.first);
+			Assert::IsTrue(bnb.second == expected, L"Expected result is { }");
 		}
 
 		TEST_METHOD(OddNumberOfNodes)
@@ -106,6 +124,10 @@ namespace UnitTests
 			std::vector<int> expected = { };
 			Assert::IsTrue(min.second == expected, L"Expected result is { }");
 			Assert::IsTrue(opt.second == expected, L"Expected result is { }");
+
+			auto bnb = branchAndBoundMin(test);
+			Assert::AreEqual(bnb.first, opt.first);
+			Assert::IsTrue(bnb.second == expected, L"Expected result is { }");
 		}
 
 		TEST_METHOD(SixBySix)
@@ -133,6 +155,11 @@ namespace UnitTests
 			std::vector<int> optExpected = { 2, 0, 4 };
 			Assert::IsTrue(min.second == expected, L"Expected result is {0, 2 ,4}");
 			Assert::IsTrue(opt.second == optExpected, L"Expected result is {2, 0, 4}");
+
+			// branchAndBoundMin starts from the greedy (0, 4, 2) path and has to find its way to (2, 0, 4)
+			auto bnb = branchAndBoundMin(test);
+			Assert::AreEqual(bnb.first, opt.first);
+			Assert::IsTrue(bnb.second == optExpected, L"Expected result is {2, 0, 4}");
 		}
 
 		TEST_METHOD(TenByTen)
@@ -181,6 +208,10 @@ namespace UnitTests
 
 			std::vector<int> expected = { 1, 3, 8, 4, 7 };
 			Assert::IsTrue(opt.second == expected, L"Expected result is {1, 3, 8, 4, 7}");
+
+			auto bnb = branchAndBoundMin(test);
+			Assert::AreEqual(bnb.first, opt.first);
+			Assert::IsTrue(bnb.second == expected, L"Expected result is {1, 3, 8, 4, 7}");
 		}
 
 		TEST_METHOD(ModifiedTenByTen)
@@ -235,6 +266,10 @@ namespace UnitTests
 
 			std::vector<int> expected = { 6, 5, 1, 3, 9 };
 			Assert::IsTrue(opt.second == expected, L"Expected result is {6, 5, 1, 3, 9}");
+
+			auto bnb = branchAndBoundMin(test);
+			Assert::AreEqual(bnb.first, opt.first);
+			Assert::IsTrue(bnb.second == expected, L"Expected result is {6, 5, 1, 3, 9}");
 		}
 
 		TEST_METHOD(TwentyByTwenty)
@@ -272,11 +307,10 @@ namespace UnitTests
 
 		TEST_METHOD(OptimalTwentyByTwenty)
 		{
-			// optimalMin will find a better result over minPath, but it is a lot slower. Note that there are likely to be
-			// some optimizations that could speed up the algorithm (maybe even some fairly large and clever ones)
-			// In general the algorithm intends to store all possible valid paths (which is a lot for n = 20) and starts to 
-			// consider their weight once the correct number of nodes have been visited, so it's going to be slower than minPath
-			// The path is (5, 16, 12, 2, 14, 9, 18, 6, 0, 11)
+			// optimalMin will find a better result over minPath.
+			// The old queue based version of optimalMin returned (5, 16, 12, 2, 14, 9, 18, 6, 0, 11) with a weight of 9.7 here,
+			// but it shared a single weight between every end node of a bitmask and so could drop cheaper paths.
+			// The pair DP finds the true optimum (8, 18, 6, 0, 2, 14, 5, 16, 12, 10) with a weight of 8.5
 			std::vector<std::vector<double>> test{
 				{ 0.0, 1.7, 0.5, 5.7, 4.2, 2.0, 0.5, 8.6, 9.2, 6.3, 3.5, 2.9, 7.7, 1.9, 4.3, 6.6, 7.1, 1.7, 9.9, 3.3, }, // 0
 				{ 1.7, 0.0, 9.2, 8.1, 3.1, 4.3, 2.2, 9.1, 6.1, 7.1, 2.1, 1.9, 4.8, 8.1, 5.8, 6.1, 4.9, 5.3, 4.8, 2.7, }, // 1
@@ -301,10 +335,1086 @@ namespace UnitTests
 
 			auto opt = optimalMin(test);
 
-			Assert::IsTrue(std::abs(opt.first - 9.7) < thresh);
+			Assert::IsTrue(std::abs(opt.first - 8.5) < thresh);
+
+			std::vector<int> expected = { 8, 18, 6, 0, 2, 14, 5, 16, 12, 10 };
+			Assert::IsTrue(opt.second == expected, L"Expected result is {8, 18, 6, 0, 2, 14, 5, 16, 12, 10}");
+
+			auto bnb = branchAndBoundMin(test);
+			Assert::AreEqual(bnb.first, opt.first);
+			Assert::IsTrue(bnb.second == expected, L"Expected result is {8, 18, 6, 0, 2, 14, 5, 16, 12, 10}");
+		}
+
+		TEST_METHOD(OptimalThirtyTwoByThirtyTwo)
+		{
+			// Too big for the old queue based optimalMin (2^32 bitmasks) but only 2^16 pair masks for the pair DP.
+			// Every edge costs 10 except a chain 0 - 2 - 4 - ... - 30 of weight 1 edges, so the best path walks the chain
+			int numNodes = 32;
+			std::vector<std::vector<double>> test(numNodes, std::vector<double>(numNodes, 10.0));
+			for (int i = 0; i < numNodes; i++)
+			{
+				test[i][i] = 0.0;
+			}
+			for (int i = 0; i + 2 < numNodes; i += 2)
+			{
+				test[i][i + 2] = 1.0;
+				test[i + 2][i] = 1.0;
+			}
+
+			auto opt = optimalMin(test);
+
+			Assert::IsTrue(std::abs(opt.first - 15.0) < thresh);
+
+			std::vector<int> expected;
+			for (int i = 0; i < numNodes; i += 2)
+			{
+				expected.push_back(i);
+			}
+			Assert::IsTrue(opt.second == expected, L"Expected result is {0, 2, 4, ..., 30}");
+		}
+
+		TEST_METHOD(ParallelOptimalThirtyTwoByThirtyTwo)
+		{
+			// Same chain as above but with the layers of the DP swept by 4 threads. Ties are broken the same way
+			// as the single threaded sweep so we expect exactly the same path back
+			int numNodes = 32;
+			std::vector<std::vector<double>> test(numNodes, std::vector<double>(numNodes, 10.0));
+			for (int i = 0; i < numNodes; i++)
+			{
+				test[i][i] = 0.0;
+				test[i][(i + 5) % numNodes] = 3.0;
+			}
+			for (int i = 0; i + 2 < numNodes; i += 2)
+			{
+				test[i][i + 2] = 1.0;
+				test[i + 2][i] = 1.0;
+			}
+
+			ExactSolverOptions options;
+			options.m_numThreads = 4;
+
+			auto serial = optimalMin(test);
+			auto parallel = optimalMin(test, options);
+
+			Assert::AreEqual(serial.first, parallel.first);
+			Assert::IsTrue(serial.second == parallel.second, L"Expected the same path from the serial and parallel sweeps");
+		}
+
+		TEST_METHOD(SimdKernelsMatchScalar)
+		{
+			// Every kernel this CPU can run should pick the same min and the same (first) index as the scalar loop,
+			// including rows full of ties and rows where only a few entries are reachable
+			std::vector<double> dist(24), cost(24);
+			for (int iCase = 0; iCase < 3; iCase++)
+			{
+				for (int i = 0; i < 24; i++)
+				{
+					dist[i] = iCase == 1 ? 1.0 : static_cast<double>((i * 7 + iCase * 3) % 11);
+					cost[i] = (iCase == 2 && i % 5 != 3) ? std::numeric_limits<double>::infinity() : static_cast<double>((i * 5) % 13);
+				}
+
+				RowMin expected = minPlusRowScalar(dist.data(), cost.data(), dist.size());
+				for (int iLevel = 0; iLevel <= static_cast<int>(detectSimdLevel()); iLevel++)
+				{
+					RowMin actual = minPlusRowKernel(static_cast<SimdLevel>(iLevel))(dist.data(), cost.data(), dist.size());
+					Assert::AreEqual(expected.m_dValue, actual.m_dValue);
+					Assert::AreEqual(expected.m_iIndex, actual.m_iIndex);
+				}
+
+				// Same rows in float, which runs twice the lanes per register
+				std::vector<float> distF(dist.begin(), dist.end()), costF(cost.begin(), cost.end());
+				distF.resize(32, 0.0f);
+				costF.resize(32, std::numeric_limits<float>::infinity());
+				RowMin expectedF = minPlusRowScalar(distF.data(), costF.data(), distF.size());
+				Assert::AreEqual(expected.m_dValue, expectedF.m_dValue);
+				for (int iLevel = 0; iLevel <= static_cast<int>(detectSimdLevel()); iLevel++)
+				{
+					RowMin actual = minPlusRowKernel<float>(static_cast<SimdLevel>(iLevel))(distF.data(), costF.data(), distF.size());
+					Assert::AreEqual(expectedF.m_dValue, actual.m_dValue);
+					Assert::AreEqual(expectedF.m_iIndex, actual.m_iIndex);
+				}
+			}
+		}
+
+		TEST_METHOD(DistanceMatrixLayouts)
+		{
+			// Same modified 10x10 as ModifiedTenByTen. Stored flat or as just the upper triangle it should give exactly
+			// the same answers as the vector of vectors
+			std::vector<std::vector<double>> test{
+				{ 0.0, 8.1, 9.2, 7.7, 9.3, 2.3, 5.1, 10.2, 6.1, 7.0},
+				{ 8.1, 0.0, 12.0, 0.9, 12.0, 1.2, 10.1, 12.8, 2.0, 1.0 },
+				{ 9.2, 12.0, 0.0, 11.2, 0.7, 11.1, 8.1, 1.1, 10.5, 11.5 },
+				{ 7.7, 0.9, 11.2, 0.0, 11.2, 9.2, 9.5, 12.0, 1.6, 1.1 },
+				{ 9.3, 12.0, 0.7, 11.2, 0.0, 11.2, 8.5, 1.0, 10.6, 11.6 },
+				{ 2.3, 1.2, 11.1, 9.2, 11.2, 0.0, 5.6, 12.1, 7.7, 8.5 },
+				{ 5.1, 10.1, 8.1, 9.5, 8.5, 5.6, 0.0, 9.1, 8.3, 9.3 },
+				{ 10.2, 12.8, 1.1, 12.0, 1.0, 12.1, 9.1, 0.0, 11.4, 12.4 },
+				{ 6.1, 2.0, 10.5, 1.6, 10.6, 7.7, 8.3, 11.4, 0.0, 1.1 },
+				{ 7.0, 1.0, 11.5, 1.1, 11.6, 8.5, 9.3, 12.4, 1.1, 0.0 } };
+
+			auto min = minPath(test);
+			auto opt = optimalMin(test);
+
+			for (MatrixLayout layout : { MatrixLayout::Full, MatrixLayout::PackedUpper })
+			{
+				auto matrix = DistanceMatrix<double>::fromRows(test, layout);
+				for (std::size_t i = 0; i < test.size(); i++)
+				{
+					for (std::size_t j = 0; j < test.size(); j++)
+					{
+						Assert::AreEqual(test[i][j], matrix[i][j]);
+					}
+				}
+
+				auto matrixMin = minPath(matrix);
+				auto matrixOpt = optimalMin(matrix);
+				Assert::AreEqual(min.first, matrixMin.first);
+				Assert::IsTrue(min.second == matrixMin.second, L"Expected the same greedy path from the DistanceMatrix");
+				Assert::AreEqual(opt.first, matrixOpt.first);
+				Assert::IsTrue(opt.second == matrixOpt.second, L"Expected the same optimal path from the DistanceMatrix");
+			}
+		}
+
+		TEST_METHOD(FloatOptimalThirtyTwoByThirtyTwo)
+		{
+			// Same chain as OptimalThirtyTwoByThirtyTwo run in float. Every weight and sum is a small whole number so
+			// float holds them exactly and we expect the same answer as the double version
+			int numNodes = 32;
+			DistanceMatrix<float> test(numNodes);
+			for (int i = 0; i < numNodes; i++)
+			{
+				for (int j = 0; j < numNodes; j++)
+				{
+					test.set(i, j, i == j ? 0.0f : 10.0f);
+				}
+				test.set(i, (i + 5) % numNodes, 3.0f);
+			}
+			for (int i = 0; i + 2 < numNodes; i += 2)
+			{
+				test.set(i, i + 2, 1.0f);
+				test.set(i + 2, i, 1.0f);
+			}
+
+			auto opt = optimalMin(test);
+
+			Assert::AreEqual(opt.first, 15.0);
+
+			std::vector<int> expected;
+			for (int i = 0; i < numNodes; i += 2)
+			{
+				expected.push_back(i);
+			}
+			Assert::IsTrue(opt.second == expected, L"Expected result is {0, 2, 4, ..., 30}");
+		}
+
+		TEST_METHOD(ImprovedSixBySix)
+		{
+			// Same 6x6 as SixBySix. Greedy gets stuck on (0, 4, 2) with a weight of 2.0 but reversing the (0, 4) stretch
+			// gives (4, 0, 2), which is as good as the optimal (2, 0, 4)
+			std::vector<std::vector<double>> test{
+				{ 0.0, 2.0, 1.0, 2.0, 0.5, 2.0 },
+				{ 2.0, 0.0, 2.0, 2.0, 2.0, 2.0 },
+				{ 1.0, 2.0, 0.0, 2.0, 1.5, 2.0 },
+				{ 2.0, 2.0, 2.0, 0.0, 2.0, 2.0 },
+				{ 0.5, 2.0, 1.5, 2.0, 0.0, 2.0 },
+				{ 2.0, 2.0, 2.0, 2.0, 2.0, 0.0 }, };
+
+			auto improved = improvePath(test, minPath(test));
+
+			Assert::AreEqual(improved.first, 1.5);
+
+			std::vector<int> expected = { 4, 0, 2 };
+			Assert::IsTrue(improved.second == expected, L"Expected result is {4, 0, 2}");
+		}
+
+		TEST_METHOD(ImprovedModifiedTenByTen)
+		{
+			// Same modified 10x10 as ModifiedTenByTen. Greedy returns (1, 3, 9, 5, 6) for 16.1 and local search gets
+			// all the way to the optimal weight of 8.8 (the reverse of the path optimalMin finds)
+			std::vector<std::vector<double>> test{
+				{ 0.0, 8.1, 9.2, 7.7, 9.3, 2.3, 5.1, 10.2, 6.1, 7.0},
+				{ 8.1, 0.0, 12.0, 0.9, 12.0, 1.2, 10.1, 12.8, 2.0, 1.0 },
+				{ 9.2, 12.0, 0.0, 11.2, 0.7, 11.1, 8.1, 1.1, 10.5, 11.5 },
+				{ 7.7, 0.9, 11.2, 0.0, 11.2, 9.2, 9.5, 12.0, 1.6, 1.1 },
+				{ 9.3, 12.0, 0.7, 11.2, 0.0, 11.2, 8.5, 1.0, 10.6, 11.6 },
+				{ 2.3, 1.2, 11.1, 9.2, 11.2, 0.0, 5.6, 12.1, 7.7, 8.5 },
+				{ 5.1, 10.1, 8.1, 9.5, 8.5, 5.6, 0.0, 9.1, 8.3, 9.3 },
+				{ 10.2, 12.8, 1.1, 12.0, 1.0, 12.1, 9.1, 0.0, 11.4, 12.4 },
+				{ 6.1, 2.0, 10.5, 1.6, 10.6, 7.7, 8.3, 11.4, 0.0, 1.1 },
+				{ 7.0, 1.0, 11.5, 1.1, 11.6, 8.5, 9.3, 12.4, 1.1, 0.0 } };
+
+			auto improved = improvePath(test, minPath(test));
+
+			Assert::IsTrue(std::abs(improved.first - 8.8) < thresh);
+
+			std::vector<int> expected = { 9, 3, 1, 5, 6 };
+			Assert::IsTrue(improved.second == expected, L"Expected result is {9, 3, 1, 5, 6}");
+		}
+
+		TEST_METHOD(MultiStartSixBySix)
+		{
+			// Same 6x6 as SixBySix. Greedy from the {0,1} pair gets (0, 4, 2) but starting from the {2,3} pair leads
+			// greedy straight down the optimal (2, 0, 4). The answer shouldn't depend on how many threads we use
+			std::vector<std::vector<double>> test{
+				{ 0.0, 2.0, 1.0, 2.0, 0.5, 2.0 },
+				{ 2.0, 0.0, 2.0, 2.0, 2.0, 2.0 },
+				{ 1.0, 2.0, 0.0, 2.0, 1.5, 2.0 },
+				{ 2.0, 2.0, 2.0, 0.0, 2.0, 2.0 },
+				{ 0.5, 2.0, 1.5, 2.0, 0.0, 2.0 },
+				{ 2.0, 2.0, 2.0, 2.0, 2.0, 0.0 }, };
+
+			MultiStartOptions serialOptions;
+			serialOptions.m_numThreads = 1;
+			MultiStartOptions parallelOptions;
+			parallelOptions.m_numThreads = 3;
+
+			auto serial = multiStartMinPath(test, serialOptions);
+			auto parallel = multiStartMinPath(test, parallelOptions);
+
+			Assert::AreEqual(serial.first, 1.5);
+			Assert::AreEqual(parallel.first, 1.5);
+
+			std::vector<int> expected = { 2, 0, 4 };
+			Assert::IsTrue(serial.second == expected, L"Expected result is {2, 0, 4}");
+			Assert::IsTrue(parallel.second == expected, L"Expected result is {2, 0, 4}");
+		}
+
+		TEST_METHOD(BatchMatchesSingleSolves)
+		{
+			// A batch of instances of different sizes (including the error cases) solved across 3 threads should give
+			// exactly what solving them one at a time does. Results are written over whatever was in the array
+			std::vector<std::vector<std::vector<double>>> batch;
+			batch.push_back({
+				{ 0.0, 1.5, 2.7, 1.2 },
+				{ 1.5, 0.0, 4.6, 1.1 },
+				{ 2.7, 4.6, 0.0, 1.0 },
+				{ 1.2, 1.1, 1.0, 0.0 }, });
+			batch.push_back({ { 0.0, 1.0, 2.0 }, { 1.0, 0.0, 3.0 }, { 2.0, 3.0, 0.0 } });
+			batch.push_back({});
+
+			std::mt19937 rng(7);
+			for (int iInstance = 0; iInstance < 200; iInstance++)
+			{
+				int numNodes = 4 + 2 * static_cast<int>(rng() % 7);
+				std::vector<std::vector<double>> test(numNodes, std::vector<double>(numNodes, 0.0));
+				for (int i = 0; i < numNodes; i++)
+				{
+					for (int j = 0; j < i; j++)
+					{
+						test[i][j] = test[j][i] = static_cast<double>(rng() % 100) / 10.0;
+					}
+				}
+				batch.push_back(test);
+			}
+
+			for (BatchMethod method : { BatchMethod::Greedy, BatchMethod::Optimal })
+			{
+				BatchOptions options;
+				options.m_numThreads = 3;
+				options.m_method = method;
+				options.m_iGrain = 4;
+
+				std::vector<std::pair<double, std::vector<int>>> results(batch.size(), { 123.0, { 1, 2, 3 } });
+				solveBatch(batch.data(), batch.size(), results.data(), options);
+
+				for (std::size_t i = 0; i < batch.size(); i++)
+				{
+					auto expected = method == BatchMethod::Greedy ? minPath(batch[i]) : optimalMin(batch[i]);
+					Assert::AreEqual(expected.first, results[i].first);
+					Assert::IsTrue(expected.second == results[i].second, L"Expected the same path as a single solve");
+				}
+			}
+		}
+
+		TEST_METHOD(InstanceFileRoundTrip)
+		{
+			// Two instances written back to back (a full double one and a packed float one) should read back as views
+			// of the same weights and solve the same way. Cutting the data short should be reported, not read past
+			std::vector<std::vector<double>> test{
+				{ 0.0, 2.0, 1.0, 2.0, 0.5, 2.0 },
+				{ 2.0, 0.0, 2.0, 2.0, 2.0, 2.0 },
+				{ 1.0, 2.0, 0.0, 2.0, 1.5, 2.0 },
+				{ 2.0, 2.0, 2.0, 0.0, 2.0, 2.0 },
+				{ 0.5, 2.0, 1.5, 2.0, 0.0, 2.0 },
+				{ 2.0, 2.0, 2.0, 2.0, 2.0, 0.0 }, };
+
+			std::ostringstream out(std::ios::binary);
+			Assert::IsTrue(writeInstance(out, DistanceMatrix<double>::fromRows(test)));
+			Assert::IsTrue(writeInstance(out, DistanceMatrix<float>::fromRows(test, MatrixLayout::PackedUpper)));
+
+			// Copied into aligned memory like a mapped file would be
+			std::string sBytes = out.str();
+			Assert::AreEqual(sBytes.size() % 64, std::size_t{ 0 });
+			AlignedVector<unsigned char> vFile(sBytes.begin(), sBytes.end());
+
+			InstanceReader reader(vFile.data(), vFile.size());
+			InstanceView instance;
+
+			Assert::IsTrue(reader.next(instance));
+			Assert::IsTrue(instance.m_weightType == WeightType::Double);
+			auto full = instance.matrix<double>();
+			Assert::IsTrue(full.data() == reinterpret_cast<const double*>(vFile.data() + sizeof(InstanceHeader)), L"Expected a view of the file, not a copy");
+
+			Assert::IsTrue(reader.next(instance));
+			Assert::IsTrue(instance.m_weightType == WeightType::Float);
+			Assert::IsTrue(instance.m_layout == MatrixLayout::PackedUpper);
+			auto packed = instance.matrix<float>();
+
+			Assert::IsFalse(reader.next(instance));
+			Assert::IsTrue(reader.error().empty());
+
+			for (std::size_t i = 0; i < test.size(); i++)
+			{
+				for (std::size_t j = 0; j < test.size(); j++)
+				{
+					Assert::AreEqual(test[i][j], full[i][j]);
+					Assert::AreEqual(test[i][j], static_cast<double>(packed[i][j]));
+				}
+			}
+
+			auto opt = optimalMin(test);
+			Assert::IsTrue(optimalMin(full) == opt, L"Expected the same result from the mapped double instance");
+			Assert::IsTrue(optimalMin(packed) == opt, L"Expected the same result from the mapped float instance");
+
+			InstanceReader truncated(vFile.data(), vFile.size() - 64);
+			Assert::IsTrue(truncated.next(instance));
+			Assert::IsFalse(truncated.next(instance));
+			Assert::IsFalse(truncated.error().empty());
+		}
+
+		TEST_METHOD(SolverStatsSixBySix)
+		{
+			// Same 6x6 as SixBySix. With 3 pairs the DP works out 6 single node states, 3 * 4 states with two pairs
+			// and 6 with all three. Each of those heads looks at 2 nodes per other pair and skips its own pair (2) and
+			// any pair outside its mask. Greedy looks at 4 nodes from each node of the start pair, then 2 more.
+			// Filling in stats mustn't change the answer, and the counts shouldn't depend on the thread count
+			std::vector<std::vector<double>> test{
+				{ 0.0, 2.0, 1.0, 2.0, 0.5, 2.0 },
+				{ 2.0, 0.0, 2.0, 2.0, 2.0, 2.0 },
+				{ 1.0, 2.0, 0.0, 2.0, 1.5, 2.0 },
+				{ 2.0, 2.0, 2.0, 0.0, 2.0, 2.0 },
+				{ 0.5, 2.0, 1.5, 2.0, 0.0, 2.0 },
+				{ 2.0, 2.0, 2.0, 2.0, 2.0, 0.0 }, };
+
+			for (unsigned numThreads : { 1u, 3u })
+			{
+				ExactSolverOptions options;
+				options.m_numThreads = numThreads;
+				SolverStats stats;
+				auto opt = optimalMin(test, options, stats);
+
+				Assert::IsTrue(opt == optimalMin(test), L"Stats shouldn't change the result");
+				Assert::AreEqual(stats.m_iStatesExpanded, std::uint64_t{ 24 });
+				Assert::AreEqual(stats.m_iTransitionsEvaluated, std::uint64_t{ 48 });
+				Assert::AreEqual(stats.m_iPrunedSamePair, std::uint64_t{ 36 });
+				Assert::AreEqual(stats.m_iPrunedPairVisited, std::uint64_t{ 24 });
+				Assert::AreEqual(stats.m_iPeakLayerStates, std::uint64_t{ 12 });
+				Assert::IsTrue(stats.m_iBytesAllocated > 0);
+			}
+
+			SolverStats stats;
+			auto min = minPath(test, stats);
+			Assert::IsTrue(min == minPath(test), L"Stats shouldn't change the result");
+			Assert::AreEqual(stats.m_iStatesExpanded, std::uint64_t{ 3 });
+			Assert::AreEqual(stats.m_iTransitionsEvaluated, std::uint64_t{ 10 });
+			Assert::AreEqual(stats.m_iPrunedSamePair, std::uint64_t{ 4 });
+			Assert::AreEqual(stats.m_iPrunedPairVisited, std::uint64_t{ 10 });
+		}
+
+		TEST_METHOD(IncrementalMatchesFreshSolve)
+		{
+			// Random 16 node matrices with small integer weights (lots of ties) change a few entries at a time, with
+			// the odd whole row rewritten. Every resolve has to give exactly what a fresh optimalMin does, path
+			// included, and a single changed entry should never need the whole table redone
+			std::mt19937 rng(11);
+			const int numNodes = 16;
+			std::vector<std::vector<double>> test(numNodes, std::vector<double>(numNodes, 0.0));
+			for (int i = 0; i < numNodes; i++)
+			{
+				for (int j = 0; j < numNodes; j++)
+				{
+					if (i != j) test[i][j] = static_cast<double>(1 + rng() % 20);
+				}
+			}
+
+			IncrementalExactSolver<double> solver;
+			Assert::IsTrue(solver.solve(test) == optimalMin(test));
+
+			std::uint64_t iAllStates = 0;
+			for (int iLayer = 2; iLayer <= numNodes / 2; iLayer++)
+			{
+				iAllStates += binomial(numNodes / 2, iLayer) * 2 * iLayer;
+			}
+
+			for (int iStep = 0; iStep < 100; iStep++)
+			{
+				std::vector<DistanceChange<double>> vChanges;
+				int numChanges = iStep % 10 == 9 ? 2 * numNodes : 1 + static_cast<int>(rng() % 3);
+				int iRow = static_cast<int>(rng() % numNodes);
+				for (int iChange = 0; iChange < numChanges; iChange++)
+				{
+					int i = iStep % 10 == 9 ? iRow : static_cast<int>(rng() % numNodes);
+					int j = static_cast<int>(rng() % numNodes);
+					double dWeight = static_cast<double>(1 + rng() % 20);
+					test[i][j] = dWeight;
+					vChanges.push_back({ i, j, dWeight });
+				}
+
+				Assert::IsTrue(solver.resolve(vChanges) == optimalMin(test), L"Expected the same result as solving from scratch");
+				if (numChanges == 1) Assert::IsTrue(solver.statesRelaxed() < iAllStates);
+			}
+
+			IncrementalExactSolver<double> odd;
+			Assert::AreEqual(odd.solve(std::vector<std::vector<double>>{ { 0.0 } }).first, -2.0);
+			Assert::AreEqual(odd.resolve({}).first, -2.0);
+
+			// Whatever size optimalMin turns away, not just the ones past 128 nodes
+			IncrementalExactSolver<double> tooBig;
+			for (int numNodes : { 78, 124, 130 })
+			{
+				Assert::AreEqual(tooBig.solve(std::vector<std::vector<double>>(numNodes, std::vector<double>(numNodes, 1.0))).first, -3.0);
+				Assert::AreEqual(tooBig.resolve({ { 0, 2, 5.0 } }).first, -3.0);
+			}
+
+			// A stopped solve leaves half built tables, so resolve mustn't patch them
+			SolveProgress progress;
+			progress.cancel();
+			ExactSolverOptions stopOptions;
+			stopOptions.m_pProgress = &progress;
+			IncrementalExactSolver<double> stopped(stopOptions);
+			Assert::AreEqual(stopped.solve(test).first, -4.0);
+			Assert::AreEqual(stopped.resolve({ { 0, 2, 5.0 } }).first, -4.0);
+			Assert::AreEqual(stopped.statesRelaxed(), std::uint64_t{ 0 });
+		}
+
+		// optimalMin<N> against the general DP (optimalMin itself now hands these sizes to optimalMin<N>)
+		template <std::size_t N>
+		void checkFixedSize(std::mt19937& rng)
+		{
+			for (int iInstance = 0; iInstance < 200; iInstance++)
+			{
+				std::array<std::array<double, N>, N> fixed{};
+				std::vector<std::vector<double>> test(N, std::vector<double>(N, 0.0));
+				for (std::size_t i = 0; i < N; i++)
+				{
+					for (std::size_t j = 0; j < N; j++)
+					{
+						if (i != j) fixed[i][j] = test[i][j] = static_cast<double>(rng() % 5);
+					}
+				}
+
+				PairDpTables<double> tables;
+				std::vector<int> vMinPath;
+				double dMinWeight = optimalMinWith(test, ExactSolverOptions{}, tables, vMinPath);
+
+				auto opt = optimalMin(fixed);
+				Assert::AreEqual(opt.first, dMinWeight);
+				Assert::IsTrue(std::vector<int>(opt.second.begin(), opt.second.end()) == vMinPath, L"Expected the same path as the general DP");
+				Assert::IsTrue(optimalMin(test) == std::make_pair(dMinWeight, vMinPath));
+			}
+		}
+
+		TEST_METHOD(FixedSizeMatchesGeneral)
+		{
+			// Small integer weights so there are plenty of ties to break the same way
+			std::mt19937 rng(13);
+			checkFixedSize<2>(rng);
+			checkFixedSize<4>(rng);
+			checkFixedSize<6>(rng);
+			checkFixedSize<8>(rng);
+			checkFixedSize<10>(rng);
+
+			// Same as SimpleFourByFour, worked out by the compiler
+			constexpr std::array<std::array<double, 4>, 4> test{ {
+				{ 0.0, 1.5, 2.7, 1.2 },
+				{ 1.5, 0.0, 4.6, 1.1 },
+				{ 2.7, 4.6, 0.0, 1.0 },
+				{ 1.2, 1.1, 1.0, 0.0 }, } };
+			constexpr auto opt = optimalMin(test);
+			static_assert(opt.first == 1.1 && opt.second[0] == 1 && opt.second[1] == 3, "Expected result is {1, 3}");
+
+			Assert::AreEqual(optimalMin(std::array<std::array<double, 3>, 3>{}).first, -2.0);
+
+			// An already stopped solve gives -4.0 whether the size goes to optimalMin<N> or not
+			SolveProgress progress;
+			progress.cancel();
+			ExactSolverOptions stopOptions;
+			stopOptions.m_pProgress = &progress;
+			for (int numNodes = 2; numNodes <= 14; numNodes += 2)
+			{
+				Assert::AreEqual(optimalMin(std::vector<std::vector<double>>(numNodes, std::vector<double>(numNodes, 1.0)), stopOptions).first, -4.0);
+			}
+
+			// Past the table cap nothing gets allocated, including the sizes whose tables would wrap round in 64 bits
+			// (124) or whose pair masks don't fit in 64 bits (130)
+			Assert::IsTrue(PairDpTables<double>::fits(76));
+			Assert::IsFalse(PairDpTables<double>::fits(78));
+			Assert::IsTrue(PairDpTables<float>::fits(78));
+			Assert::IsFalse(PairDpTables<float>::fits(80));
+			for (int numNodes : { 78, 100, 124, 128, 130 })
+			{
+				Assert::AreEqual(optimalMin(std::vector<std::vector<double>>(numNodes, std::vector<double>(numNodes, 1.0))).first, -3.0);
+			}
+			Assert::AreEqual(optimalMin(DistanceMatrix<float>(80)).first, -3.0);
+		}
+
+		TEST_METHOD(MeetInTheMiddleMatchesOptimal)
+		{
+			// Whole number weights add up exactly whichever end of the path they're added from, so the weights have
+			// to match optimalMin's exactly. Paths can differ between ties, so check the path is a real one with that
+			// weight. Also in float and across threads, and with the same error values
+			std::mt19937 rng(17);
+			for (int iInstance = 0; iInstance < 200; iInstance++)
+			{
+				int numNodes = 2 + 2 * static_cast<int>(rng() % 11);
+				std::vector<std::vector<double>> test(numNodes, std::vector<double>(numNodes, 0.0));
+				for (int i = 0; i < numNodes; i++)
+				{
+					for (int j = 0; j < numNodes; j++)
+					{
+						if (i != j) test[i][j] = static_cast<double>(rng() % (iInstance % 2 == 0 ? 5 : 1000));
+					}
+				}
+
+				ExactSolverOptions options;
+				options.m_numThreads = 1 + iInstance % 3;
+				auto opt = optimalMin(test);
+				auto mitm = meetInTheMiddleMin(test, options);
+				Assert::AreEqual(mitm.first, opt.first);
+				Assert::AreEqual(mitm.second.size(), opt.second.size());
+
+				std::vector<bool> vVisited(numNodes / 2, false);
+				double dWeight = 0.0;
+				for (std::size_t i = 0; i < mitm.second.size(); i++)
+				{
+					Assert::IsFalse(vVisited[mitm.second[i] / 2], L"Every pair should be visited once");
+					vVisited[mitm.second[i] / 2] = true;
+					if (i > 0) dWeight += test[mitm.second[i - 1]][mitm.second[i]];
+				}
+				Assert::AreEqual(dWeight, mitm.first);
+
+				auto floatMatrix = DistanceMatrix<float>::fromRows(test, MatrixLayout::PackedUpper);
+				Assert::AreEqual(meetInTheMiddleMin(floatMatrix).first, optimalMin(floatMatrix).first);
+			}
+
+			Assert::AreEqual(meetInTheMiddleMin(std::vector<std::vector<double>>{ { 0.0 } }).first, -2.0);
+			Assert::AreEqual(meetInTheMiddleMin(std::vector<std::vector<double>>{}).first, -1.0);
+		}
+
+		TEST_METHOD(SolvePicksEngineWithinBudget)
+		{
+			// Squeezing the memory budget should move solve() from optimalMin to meeting in the middle (both proven)
+			// and then, with no room for branch and bound's table either, to the heuristic
+			std::mt19937 rng(19);
+			auto randomMatrix = [&](int numNodes)
+			{
+				std::vector<std::vector<double>> test(numNodes, std::vector<double>(numNodes, 0.0));
+				for (int i = 0; i < numNodes; i++)
+				{
+					for (int j = 0; j < i; j++)
+					{
+						test[i][j] = test[j][i] = static_cast<double>(1 + rng() % 100);
+					}
+				}
+				return test;
+			};
+			using Matrix = std::vector<std::vector<double>>;
+
+			auto test = randomMatrix(24);
+			auto opt = optimalMin(test);
+
+			SolveOptions options;
+			SolveResult result = solve(test, options);
+			Assert::IsTrue(result.m_engine == SolveEngine::Optimal && result.m_bProvenOptimal);
+			Assert::IsTrue(result.m_vPath == opt.second);
+
+			options.m_iMemoryBudget = static_cast<std::size_t>(PairDpTables<double>::memoryBytes(24)) - 1;
+			Assert::IsTrue(MeetInTheMiddleSearch<Matrix>::peakBytes(24) <= options.m_iMemoryBudget);
+			result = solve(test, options);
+			Assert::IsTrue(result.m_engine == SolveEngine::MeetInTheMiddle && result.m_bProvenOptimal);
+			Assert::AreEqual(result.m_dWeight, opt.first);
+
+			options.m_iMemoryBudget = static_cast<std::size_t>(MeetInTheMiddleSearch<Matrix>::peakBytes(24)) - 1;
+			Assert::IsTrue(BranchAndBoundSearch<Matrix>::memoryBytes(24) > options.m_iMemoryBudget);
+			result = solve(test, options);
+			Assert::IsTrue(result.m_engine == SolveEngine::Heuristic && !result.m_bProvenOptimal);
+			Assert::IsTrue(result.m_dWeight >= opt.first && result.m_vPath.size() == opt.second.size());
+
+			// 40 nodes would take optimalMin longer than the time budget, so it is down to branch and bound. Nodes sat
+			// along a line (each pair a step apart) are easy for it: the best path walks down the line one pair at a time
+			Matrix line(40, std::vector<double>(40, 0.0));
+			for (int i = 0; i < 40; i++)
+			{
+				for (int j = 0; j < 40; j++)
+				{
+					line[i][j] = std::abs((10 * (i / 2) + i % 2) - (10 * (j / 2) + j % 2));
+				}
+			}
+			options = SolveOptions();
+			options.m_timeBudget = std::chrono::milliseconds(2000);
+			Assert::IsTrue(exactSolveMs(40, 1) > 2000.0);
+			auto start = std::chrono::steady_clock::now();
+			result = solve(line, options);
+			Assert::IsTrue(result.m_engine == SolveEngine::BranchAndBound);
+			Assert::IsTrue(result.m_bProvenOptimal || std::chrono::steady_clock::now() - start >= options.m_timeBudget);
+			Assert::AreEqual(result.m_dWeight, 189.0);
+
+			// A deadline that has already passed still gets a valid path back
+			options.m_timeBudget = std::chrono::milliseconds(0);
+			result = solve(randomMatrix(200), options);
+			Assert::IsTrue(result.m_engine == SolveEngine::Heuristic && !result.m_bProvenOptimal);
+			Assert::AreEqual(result.m_vPath.size(), std::size_t{ 100 });
+
+			Assert::AreEqual(solve(Matrix{ { 0.0 } }).m_dWeight, -2.0);
+			Assert::IsTrue(solve(Matrix{}).m_engine == SolveEngine::None);
+		}
+
+		TEST_METHOD(SparseMatchesOptimal)
+		{
+			// The sparse search breaks ties like optimalMin and adds the weights up the same way, so it should return
+			// exactly the same path, in float too
+			std::mt19937 rng(23);
+			for (int iInstance = 0; iInstance < 200; iInstance++)
+			{
+				int numNodes = 2 + 2 * static_cast<int>(rng() % 10);
+				std::vector<std::vector<double>> test(numNodes, std::vector<double>(numNodes, 0.0));
+				for (int i = 0; i < numNodes; i++)
+				{
+					for (int j = 0; j < numNodes; j++)
+					{
+						if (i != j) test[i][j] = iInstance % 2 == 0 ? static_cast<double>(rng() % 5) : std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+					}
+				}
+				Assert::IsTrue(sparseExactMin(test) == optimalMin(test));
+
+				auto floatMatrix = DistanceMatrix<float>::fromRows(test, MatrixLayout::Full);
+				Assert::IsTrue(sparseExactMin(floatMatrix) == optimalMin(floatMatrix));
+			}
+
+			// Pairs along a line, with a step between the first and second nodes of two pairs costing one more. The
+			// bounds are tight enough that even 256 nodes (128 bit masks) only keep a few states. The best path walks
+			// down the line on the first nodes
+			for (int numNodes : { 140, 256 })
+			{
+				std::vector<std::vector<double>> line(numNodes, std::vector<double>(numNodes, 0.0));
+				for (int i = 0; i < numNodes; i++)
+				{
+					for (int j = 0; j < numNodes; j++)
+					{
+						line[i][j] = std::abs(10 * (i / 2) - 10 * (j / 2)) + (i % 2 != j % 2 ? 1.0 : 0.0);
+					}
+				}
+				auto best = sparseExactMin(line);
+				Assert::AreEqual(best.first, 10.0 * (numNodes / 2 - 1));
+				for (int i = 0; i < numNodes / 2; i++)
+				{
+					Assert::AreEqual(best.second[i], 2 * i);
+				}
+			}
+
+			// Out of room for states
+			std::vector<std::vector<double>> test(28, std::vector<double>(28, 0.0));
+			for (int i = 0; i < 28; i++)
+			{
+				for (int j = 0; j < i; j++)
+				{
+					test[i][j] = test[j][i] = static_cast<double>(1 + rng() % 100);
+				}
+			}
+			SparseSearchOptions options;
+			options.m_iMaxStates = 1000;
+			Assert::AreEqual(sparseExactMin(test, options).first, -4.0);
+
+			Assert::AreEqual(sparseExactMin(std::vector<std::vector<double>>{ { 0.0 } }).first, -2.0);
+			Assert::AreEqual(sparseExactMin(std::vector<std::vector<double>>{}).first, -1.0);
+			Assert::AreEqual(sparseExactMin(std::vector<std::vector<double>>(258, std::vector<double>(258, 1.0))).first, -3.0);
+		}
+
+		TEST_METHOD(AsyncSolveCanBeCancelled)
+		{
+			std::mt19937 rng(29);
+			auto randomMatrix = [&](int numNodes)
+			{
+				std::vector<std::vector<double>> test(numNodes, std::vector<double>(numNodes, 0.0));
+				for (int i = 0; i < numNodes; i++)
+				{
+					for (int j = 0; j < i; j++)
+					{
+						test[i][j] = test[j][i] = static_cast<double>(1 + rng() % 100);
+					}
+				}
+				return test;
+			};
+
+			// Left to finish, it is solve(), and the lower bound ends up at the optimal weight
+			auto small = randomMatrix(24);
+			SolveHandle handle = solveAsync(small);
+			SolveResult result = handle.get();
+			Assert::IsTrue(result.m_bProvenOptimal);
+			Assert::IsTrue(result.m_vPath == optimalMin(small).second);
+			Assert::AreEqual(handle.lowerBound(), result.m_dWeight);
+			Assert::AreEqual(handle.incumbent().first, result.m_dWeight);
+
+			// Branch and bound won't finish 60 random nodes any time soon. There should be a path almost at once,
+			// and cancelling gets back the best one found by then
+			int numImproved = 0;
+			SolveHandle big = solveAsync(randomMatrix(60), SolveOptions(), [&](double, const std::vector<int>&) { numImproved++; });
+			while (big.incumbent().second.empty())
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			Assert::IsFalse(big.waitFor(std::chrono::milliseconds(50)));
+			big.cancel();
+			result = big.get();
+			Assert::IsFalse(result.m_bProvenOptimal);
+			Assert::AreEqual(result.m_vPath.size(), std::size_t{ 30 });
+			Assert::AreEqual(result.m_dWeight, big.incumbent().first);
+			Assert::IsTrue(big.lowerBound() > 0.0 && big.lowerBound() <= result.m_dWeight);
+			Assert::IsTrue(numImproved >= 1);
+
+			// Same again with a deadline instead
+			SolveOptions options;
+			options.m_timeBudget = std::chrono::milliseconds(50);
+			result = solveAsync(randomMatrix(60), options).get();
+			Assert::IsTrue(result.m_engine == SolveEngine::BranchAndBound && !result.m_bProvenOptimal);
+
+			// Dropping the handle stops the solve rather than leaving it running
+			{
+				SolveHandle dropped = solveAsync(randomMatrix(60));
+			}
+
+			// 3000 nodes is straight to the heuristic, which takes seconds to finish its starts and local search
+			// passes. Cancelling has to get through to both, not just the exact solvers. A single greedy start is
+			// about the longest it should have to wait
+			const int numEuclidean = 3000;
+			std::vector<double> vX(numEuclidean);
+			std::vector<double> vY(numEuclidean);
+			for (int i = 0; i < numEuclidean; i++)
+			{
+				vX[i] = static_cast<double>(rng() % 100000);
+				vY[i] = static_cast<double>(rng() % 100000);
+			}
+			std::vector<std::vector<double>> euclidean(numEuclidean, std::vector<double>(numEuclidean, 0.0));
+			for (int i = 0; i < numEuclidean; i++)
+			{
+				for (int j = 0; j < numEuclidean; j++)
+				{
+					euclidean[i][j] = std::hypot(vX[i] - vX[j], vY[i] - vY[j]);
+				}
+			}
+			for (int iWaitMs : { 20, 200 })
+			{
+				SolveHandle heuristic = solveAsync(euclidean);
+				std::this_thread::sleep_for(std::chrono::milliseconds(iWaitMs));
+				auto cancelled = std::chrono::steady_clock::now();
+				heuristic.cancel();
+				result = heuristic.get();
+				Assert::IsTrue(std::chrono::steady_clock::now() - cancelled < std::chrono::milliseconds(1000), L"Cancelling should stop the heuristic stage");
+				Assert::IsTrue(result.m_engine == SolveEngine::Heuristic && !result.m_bProvenOptimal);
+				Assert::AreEqual(result.m_vPath.size(), std::size_t{ numEuclidean / 2 });
+			}
+		}
+
+		TEST_METHOD(TopKMatchesAllPaths)
+		{
+			// Small enough to weigh every path there is (added up from the back like the DP does), sort them and check
+			// the first k weights. The paths have to be real, different and weigh what they say
+			std::mt19937 rng(31);
+			for (int iInstance = 0; iInstance < 200; iInstance++)
+			{
+				int numNodes = 2 + 2 * (iInstance % 4);
+				std::vector<std::vector<double>> test(numNodes, std::vector<double>(numNodes, 0.0));
+				for (int i = 0; i < numNodes; i++)
+				{
+					for (int j = 0; j < numNodes; j++)
+					{
+						if (i != j) test[i][j] = iInstance % 2 == 0 ? static_cast<double>(rng() % 4) : std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+					}
+				}
+
+				std::vector<double> vAllWeights;
+				std::vector<int> vPath;
+				std::vector<bool> vVisited(numNodes / 2, false);
+				std::function<void()> allPaths = [&]()
+				{
+					if (static_cast<int>(vPath.size()) == numNodes / 2)
+					{
+						double dWeight = 0.0;
+						for (std::size_t i = vPath.size(); i-- > 1; ) dWeight = test[vPath[i - 1]][vPath[i]] + dWeight;
+						vAllWeights.push_back(dWeight);
+						return;
+					}
+					for (int iNode = 0; iNode < numNodes; iNode++)
+					{
+						if (vVisited[iNode / 2]) continue;
+						vVisited[iNode / 2] = true;
+						vPath.push_back(iNode);
+						allPaths();
+						vPath.pop_back();
+						vVisited[iNode / 2] = false;
+					}
+				};
+				allPaths();
+				std::sort(vAllWeights.begin(), vAllWeights.end());
+
+				int k = 1 + static_cast<int>(rng() % 60);
+				ExactSolverOptions options;
+				options.m_numThreads = 1 + iInstance % 3;
+				auto vBest = optimalTopK(test, k, options);
+				Assert::AreEqual(vBest.size(), std::min<std::size_t>(k, vAllWeights.size()));
+				Assert::IsTrue(vBest[0] == optimalMin(test));
+
+				std::set<std::vector<int>> seen;
+				for (std::size_t iPath = 0; iPath < vBest.size(); iPath++)
+				{
+					Assert::AreEqual(vBest[iPath].first, vAllWeights[iPath]);
+					Assert::AreEqual(vBest[iPath].second.size(), std::size_t(numNodes / 2));
+					double dWeight = 0.0;
+					for (std::size_t i = vBest[iPath].second.size(); i-- > 1; ) dWeight = test[vBest[iPath].second[i - 1]][vBest[iPath].second[i]] + dWeight;
+					Assert::AreEqual(dWeight, vBest[iPath].first);
+					seen.insert(vBest[iPath].second);
+				}
+				Assert::AreEqual(seen.size(), vBest.size(), L"Every path should be different");
+
+				auto floatMatrix = DistanceMatrix<float>::fromRows(test, MatrixLayout::PackedUpper);
+				Assert::IsTrue(optimalTopK(floatMatrix, k)[0] == optimalMin(floatMatrix));
+			}
+
+			Assert::AreEqual(optimalTopK(std::vector<std::vector<double>>{ { 0.0 } }, 3)[0].first, -2.0);
+			Assert::AreEqual(optimalTopK(std::vector<std::vector<double>>{}, 3)[0].first, -1.0);
+			Assert::AreEqual(optimalTopK(std::vector<std::vector<double>>(4, std::vector<double>(4, 1.0)), 0)[0].first, -3.0);
+			for (int numNodes : { 124, 128, 130 })
+			{
+				Assert::AreEqual(optimalTopK(std::vector<std::vector<double>>(numNodes, std::vector<double>(numNodes, 1.0)), 2)[0].first, -3.0);
+			}
+
+			// k labels a state make the tables k times bigger, so a big k turns away instances optimalMin takes
+			Assert::IsTrue(PairDpTables<double>::fits(64));
+			Assert::AreEqual(optimalTopK(std::vector<std::vector<double>>(64, std::vector<double>(64, 1.0)), kMaxTopK)[0].first, -3.0);
+		}
+
+		TEST_METHOD(MultiQueryMatchesAllPaths)
+		{
+			// Weigh every path there is and check each answer is a real path that meets the query and weighs as
+			// little as the lightest one that does. Whole number weights, so the sums are exact either way round
+			std::mt19937 rng(37);
+			for (int iInstance = 0; iInstance < 100; iInstance++)
+			{
+				int numNodes = 2 + 2 * (iInstance % 5);
+				std::vector<std::vector<double>> test(numNodes, std::vector<double>(numNodes, 0.0));
+				for (int i = 0; i < numNodes; i++)
+				{
+					for (int j = 0; j < numNodes; j++)
+					{
+						if (i != j) test[i][j] = static_cast<double>(rng() % 10);
+					}
+				}
+				auto weigh = [&](const std::vector<int>& vPath)
+				{
+					double dWeight = 0.0;
+					for (std::size_t i = 1; i < vPath.size(); i++) dWeight += test[vPath[i - 1]][vPath[i]];
+					return dWeight;
+				};
+
+				std::vector<std::vector<int>> vAllPaths;
+				std::vector<int> vPath;
+				std::vector<bool> vVisited(numNodes / 2, false);
+				std::function<void()> allPaths = [&]()
+				{
+					if (static_cast<int>(vPath.size()) == numNodes / 2)
+					{
+						vAllPaths.push_back(vPath);
+						return;
+					}
+					for (int iNode = 0; iNode < numNodes; iNode++)
+					{
+						if (vVisited[iNode / 2]) continue;
+						vVisited[iNode / 2] = true;
+						vPath.push_back(iNode);
+						allPaths();
+						vPath.pop_back();
+						vVisited[iNode / 2] = false;
+					}
+				};
+				allPaths();
+
+				auto check = [&](const std::pair<double, std::vector<int>>& answer, const std::function<bool(const std::vector<int>&)>& meetsQuery)
+				{
+					double dBest = std::numeric_limits<double>::infinity();
+					for (const std::vector<int>& vCandidate : vAllPaths)
+					{
+						if (meetsQuery(vCandidate)) dBest = std::min(dBest, weigh(vCandidate));
+					}
+					Assert::AreEqual(answer.first, dBest);
+					Assert::AreEqual(weigh(answer.second), dBest);
+					Assert::AreEqual(answer.second.size(), std::size_t(numNodes / 2));
+					Assert::IsTrue(meetsQuery(answer.second));
+				};
+
+				MultiQuerySolver<> solver;
+				Assert::IsTrue(solver.solve(test) == optimalMin(test));
+				for (int iPair = 0; iPair < numNodes / 2; iPair++)
+				{
+					check(solver.bestStartingIn(iPair), [&](const std::vector<int>& v) { return v.front() / 2 == iPair; });
+					check(solver.bestEndingIn(iPair), [&](const std::vector<int>& v) { return v.back() / 2 == iPair; });
+				}
+				for (int iNode = 0; iNode < numNodes; iNode++)
+				{
+					check(solver.bestAvoiding(iNode), [&](const std::vector<int>& v) { return std::find(v.begin(), v.end(), iNode) == v.end(); });
+				}
+				Assert::AreEqual(solver.bestStartingIn(numNodes / 2).first, -3.0);
+				Assert::AreEqual(solver.bestAvoiding(-1).first, -3.0);
+			}
+
+			MultiQuerySolver<> solver;
+			Assert::AreEqual(solver.solve(std::vector<std::vector<double>>{ { 0.0 } }).first, -2.0);
+			Assert::AreEqual(solver.bestEndingIn(0).first, -2.0);
+
+			// Too big for the tables, straight after a good solve so there are stale tables it mustn't read
+			Assert::IsTrue(solver.solve(std::vector<std::vector<double>>(6, std::vector<double>(6, 1.0))).first >= 0.0);
+			for (int numNodes : { 124, 128 })
+			{
+				Assert::AreEqual(solver.solve(std::vector<std::vector<double>>(numNodes, std::vector<double>(numNodes, 1.0))).first, -3.0);
+				Assert::AreEqual(solver.bestStartingIn(1).first, -3.0);
+				Assert::AreEqual(solver.bestEndingIn(1).first, -3.0);
+				Assert::AreEqual(solver.bestAvoiding(3).first, -3.0);
+			}
+
+			// Stopped before the reverse tables are built: the queries that need them say so rather than reading them
+			SolveProgress progress;
+			ExactSolverOptions stopOptions;
+			stopOptions.m_pProgress = &progress;
+			MultiQuerySolver<> stopped(stopOptions);
+			std::vector<std::vector<double>> square(12, std::vector<double>(12, 1.0));
+			Assert::IsTrue(stopped.solve(square).first >= 0.0);
+			progress.cancel();
+			Assert::IsTrue(stopped.bestStartingIn(1).first >= 0.0);
+			Assert::AreEqual(stopped.bestEndingIn(1).first, -4.0);
+			Assert::AreEqual(stopped.bestAvoiding(3).first, -4.0);
+		}
+
+		TEST_METHOD(CandidateListsKeepGreedyPaths)
+		{
+			// The lists come in the greedy scan's order, so stepping through them has to give exactly the same paths.
+			// Small whole number weights give lots of ties to get wrong. Local search with them only has to keep the
+			// path valid and no heavier. Every third instance is Euclidean, so symmetric, which is the only time local
+			// search runs 2-opt (and keeps the node positions up to date through the reversals)
+			std::mt19937 rng(41);
+			for (int iInstance = 0; iInstance < 90; iInstance++)
+			{
+				int numNodes = 2 + 2 * (iInstance % 30) * (1 + iInstance / 30);
+				std::vector<std::vector<double>> test(numNodes, std::vector<double>(numNodes, 0.0));
+				std::vector<double> vX(numNodes);
+				std::vector<double> vY(numNodes);
+				for (int i = 0; i < numNodes; i++)
+				{
+					vX[i] = static_cast<double>(rng() % 1000);
+					vY[i] = static_cast<double>(rng() % 1000);
+				}
+				for (int i = 0; i < numNodes; i++)
+				{
+					for (int j = 0; j < numNodes; j++)
+					{
+						if (i == j) continue;
+						if (iInstance % 3 == 0) test[i][j] = static_cast<double>(rng() % 6);
+						else if (iInstance % 3 == 1) test[i][j] = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+						else test[i][j] = std::hypot(vX[i] - vX[j], vY[i] - vY[j]);
+					}
+				}
+
+				for (int k : { 1, 3, kDefaultCandidates })
+				{
+					CandidateLists candidates = buildCandidateLists(test, k, 1 + iInstance % 3);
+					Assert::AreEqual(candidates.size(), numNodes);
+					for (int iNode = 0; iNode < numNodes; iNode++)
+					{
+						std::vector<int> vList(candidates.neighbours(iNode).begin(), candidates.neighbours(iNode).end());
+						Assert::AreEqual(static_cast<int>(vList.size()), std::min(k, numNodes - 2));
+						for (std::size_t i = 0; i < vList.size(); i++)
+						{
+							Assert::IsTrue(vList[i] / 2 != iNode / 2);
+							if (i > 0) Assert::IsTrue(test[iNode][vList[i - 1]] < test[iNode][vList[i]] || (test[iNode][vList[i - 1]] == test[iNode][vList[i]] && vList[i - 1] < vList[i]));
+						}
+					}
+
+					auto greedy = minPath(test);
+					Assert::IsTrue(minPath(test, candidates) == greedy);
+
+					MultiStartOptions multiStartOptions;
+					multiStartOptions.m_numThreads = 2;
+					auto multiStart = multiStartMinPath(test, multiStartOptions);
+					multiStartOptions.m_pCandidates = &candidates;
+					Assert::IsTrue(multiStartMinPath(test, multiStartOptions) == multiStart);
+
+					auto improved = improvePath(test, greedy, std::chrono::milliseconds::max(), &candidates);
+					Assert::IsTrue(improved.first <= greedy.first + 1e-9);
+					Assert::AreEqual(improved.second.size(), std::size_t(numNodes / 2));
+					std::set<int> pairs;
+					double dWeight = 0.0;
+					for (std::size_t i = 0; i < improved.second.size(); i++)
+					{
+						pairs.insert(improved.second[i] / 2);
+						if (i > 0) dWeight += test[improved.second[i - 1]][improved.second[i]];
+					}
+					Assert::AreEqual(pairs.size(), std::size_t(numNodes / 2));
+					Assert::AreEqual(improved.first, dWeight, 1e-9);
+
+					// Greedy leaves plenty of crossings on a big enough Euclidean instance for the moves to find
+					if (iInstance % 3 == 2 && numNodes >= 40) Assert::IsTrue(improved.first < greedy.first);
+				}
+			}
+		}
+
+		TEST_METHOD(OutOfCoreMatchesOptimal)
+		{
+			// Same DP, same kernel and same tie breaks, so the weight and path have to match optimalMin exactly, in
+			// doubles and floats and whatever the thread count. The scratch file has to be gone afterwards
+			std::filesystem::path scratchDir = std::filesystem::temp_directory_path() / "vergeproject-outofcore-test";
+			std::filesystem::create_directories(scratchDir);
+			OutOfCoreOptions outOfCoreOptions;
+			outOfCoreOptions.m_scratchDir = scratchDir;
+
+			std::mt19937 rng(43);
+			for (int iInstance = 0; iInstance < 40; iInstance++)
+			{
+				int numNodes = 2 + 2 * (iInstance % 12);
+				std::vector<std::vector<double>> test(numNodes, std::vector<double>(numNodes, 0.0));
+				for (int i = 0; i < numNodes; i++)
+				{
+					for (int j = 0; j < numNodes; j++)
+					{
+						if (i != j) test[i][j] = iInstance % 2 == 0 ? static_cast<double>(rng() % 5) : std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+					}
+				}
+
+				ExactSolverOptions options;
+				options.m_numThreads = 1 + iInstance % 3;
+				Assert::IsTrue(outOfCoreMin(test, options, outOfCoreOptions) == optimalMin(test, options));
+
+				auto floatMatrix = DistanceMatrix<float>::fromRows(test);
+				Assert::IsTrue(outOfCoreMin(floatMatrix, options, outOfCoreOptions) == optimalMin(floatMatrix, options));
+			}
+			Assert::IsTrue(std::filesystem::is_empty(scratchDir));
+
+			SolveProgress progress;
+			progress.cancel();
+			ExactSolverOptions stopOptions;
+			stopOptions.m_pProgress = &progress;
+			Assert::AreEqual(outOfCoreMin(std::vector<std::vector<double>>(8, std::vector<double>(8, 1.0)), stopOptions, outOfCoreOptions).first, -4.0);
+			Assert::AreEqual(outOfCoreMin(std::vector<std::vector<double>>(3, std::vector<double>(3, 1.0))).first, -2.0);
+			Assert::AreEqual(outOfCoreMin(std::vector<std::vector<double>>()).first, -1.0);
+
+			// Layers too big to hold are turned away before anything is allocated or written
+			Assert::IsTrue(OutOfCoreSearch<std::vector<std::vector<double>>>::memoryBytes(80) <= kMaxExactTableBytes);
+			for (int numNodes : { 82, 124, 128, 130 })
+			{
+				Assert::AreEqual(outOfCoreMin(std::vector<std::vector<double>>(numNodes, std::vector<double>(numNodes, 1.0)), {}, outOfCoreOptions).first, -3.0);
+			}
+			Assert::IsTrue(std::filesystem::is_empty(scratchDir));
 
-			std::vector<int> expected = { 5, 16, 12, 2, 14, 9, 18, 6, 0, 11 };
-			Assert::IsTrue(opt.second == expected, L"Expected result is {5, 16, 12, 2, 14, 9, 18, 0, 11}");
+			outOfCoreOptions.m_scratchDir = scratchDir / "missing";
+			Assert::AreEqual(outOfCoreMin(std::vector<std::vector<double>>(4, std::vector<double>(4, 1.0)), {}, outOfCoreOptions).first, -5.0);
+			std::filesystem::remove_all(scratchDir);
 		}
 	};
 }
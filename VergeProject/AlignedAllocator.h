@@ -0,0 +1,44 @@
+// AlignedAllocator.h : Allocator for std::vector that hands out cache line aligned storage.
+// The DP tables and distance rows are read a whole row at a time, so starting every buffer on a
+// cache line (and a SIMD register) boundary keeps those reads from straddling lines.
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+template <typename T, std::size_t Alignment = 64>
+struct AlignedAllocator
+{
+    using value_type = T;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() noexcept = default;
+
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept {}
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t{ Alignment }));
+    }
+
+    void deallocate(T* p, std::size_t) noexcept
+    {
+        ::operator delete(p, std::align_val_t{ Alignment });
+    }
+};
+
+template <typename T, typename U, std::size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&) noexcept { return true; }
+
+template <typename T, typename U, std::size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&) noexcept { return false; }
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
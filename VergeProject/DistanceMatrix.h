@@ -0,0 +1,143 @@
+// DistanceMatrix.h : A distance matrix kept in a single block of memory.
+// A std::vector<std::vector<double>> puts every row in its own allocation, so reading an entry means chasing a
+// pointer to the row first and the rows end up wherever the heap put them. DistanceMatrix stores the whole thing in
+// one aligned buffer, in one of two layouts:
+// - Full: row major, every row padded to a whole number of cache lines (with zeros). The exact solver can run its
+//   SIMD kernels straight over these rows without making its own padded copy.
+// - PackedUpper: only the upper triangle (diagonal included) is stored, one row after the other. The matrices we get
+//   are symmetric so this holds everything we need in about half the memory. m[i][j] and m[j][i] read the same entry.
+// It is templated on the weight type so a solve can run in float, which fits twice as many weights in a cache line
+// and a SIMD register as double.
+// A DistanceMatrix either owns its weights or is a view of weights that already sit in memory in one of the layouts
+// above (e.g. a memory mapped instance file, see InstanceFile.h), in which case nothing is copied.
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "AlignedAllocator.h"
+
+enum class MatrixLayout
+{
+    Full,
+    PackedUpper,
+};
+
+template <typename T>
+class DistanceMatrix
+{
+public:
+    using value_type = T;
+
+    // Full rows are padded to this many weights, i.e. a 64 byte cache line
+    static constexpr std::size_t kRowAlignment = 64 / sizeof(T);
+
+    // What m[i] hands back, so m[i][j] works the same as it does on a vector of vectors
+    class Row
+    {
+    public:
+        Row(const DistanceMatrix& matrix, std::size_t iRow)
+            : m_pMatrix(&matrix), m_iRow(iRow), m_pRow(matrix.m_layout == MatrixLayout::Full ? matrix.rowData(iRow) : nullptr)
+        {
+        }
+
+        T operator[](std::size_t iCol) const { return m_pRow ? m_pRow[iCol] : m_pMatrix->packedAt(m_iRow, iCol); }
+
+    private:
+        const DistanceMatrix* m_pMatrix;
+        std::size_t m_iRow;
+        const T* m_pRow;
+    };
+
+    DistanceMatrix() = default;
+
+    // A numNodes x numNodes matrix of zeros
+    explicit DistanceMatrix(std::size_t numNodes, MatrixLayout layout = MatrixLayout::Full)
+        : m_numNodes(numNodes), m_layout(layout), m_iStride(paddedStride(numNodes))
+    {
+        m_vData.assign(storageSize(numNodes, layout), T{});
+    }
+
+    // A read only view of numNodes x numNodes weights already laid out as layout describes (storageSize(...) of
+    // them, rows padded to kRowAlignment for Full). pData must stay alive, and 64 byte aligned for the exact solver
+    static DistanceMatrix view(const T* pData, std::size_t numNodes, MatrixLayout layout)
+    {
+        DistanceMatrix matrix;
+        matrix.m_numNodes = numNodes;
+        matrix.m_layout = layout;
+        matrix.m_iStride = paddedStride(numNodes);
+        matrix.m_pView = pData;
+        return matrix;
+    }
+
+    // Copy a vector of vectors in. The packed layout only reads the upper triangle, so the rows should be symmetric
+    template <typename U>
+    static DistanceMatrix fromRows(const std::vector<std::vector<U>>& rows, MatrixLayout layout = MatrixLayout::Full)
+    {
+        DistanceMatrix matrix(rows.size(), layout);
+        for (std::size_t i = 0; i < rows.size(); i++)
+        {
+            for (std::size_t j = layout == MatrixLayout::Full ? 0 : i; j < rows.size(); j++)
+            {
+                matrix.set(i, j, static_cast<T>(rows[i][j]));
+            }
+        }
+        return matrix;
+    }
+
+    std::size_t size() const { return m_numNodes; }
+    MatrixLayout layout() const { return m_layout; }
+
+    // Distance between two weights in a row of the Full layout
+    std::size_t stride() const { return m_iStride; }
+
+    Row operator[](std::size_t iRow) const { return Row(*this, iRow); }
+
+    T operator()(std::size_t iRow, std::size_t iCol) const
+    {
+        return m_layout == MatrixLayout::Full ? data()[iRow * m_iStride + iCol] : packedAt(iRow, iCol);
+    }
+
+    // In the packed layout this sets both (iRow, iCol) and (iCol, iRow). Not for views
+    void set(std::size_t iRow, std::size_t iCol, T weight)
+    {
+        m_vData[m_layout == MatrixLayout::Full ? iRow * m_iStride + iCol : packedIndex(iRow, iCol)] = weight;
+    }
+
+    // The start of a padded, cache line aligned row. Full layout only
+    const T* rowData(std::size_t iRow) const { return data() + iRow * m_iStride; }
+
+    // All of the weights in layout order
+    const T* data() const { return m_pView ? m_pView : m_vData.data(); }
+
+    static std::size_t paddedStride(std::size_t numNodes) { return (numNodes + kRowAlignment - 1) / kRowAlignment * kRowAlignment; }
+
+    // How many weights a numNodes matrix takes up in a layout, padding included
+    static std::size_t storageSize(std::size_t numNodes, MatrixLayout layout)
+    {
+        return layout == MatrixLayout::Full ? numNodes * paddedStride(numNodes) : numNodes * (numNodes + 1) / 2;
+    }
+
+private:
+    // Row i of the upper triangle holds columns i..n-1 and starts after the n + (n - 1) + ... + (n - i + 1) weights
+    // of the rows before it
+    std::size_t packedIndex(std::size_t iRow, std::size_t iCol) const
+    {
+        if (iCol < iRow) std::swap(iRow, iCol);
+        return iRow * (2 * m_numNodes - iRow + 1) / 2 + (iCol - iRow);
+    }
+
+    T packedAt(std::size_t iRow, std::size_t iCol) const { return data()[packedIndex(iRow, iCol)]; }
+
+    std::size_t m_numNodes = 0;
+    MatrixLayout m_layout = MatrixLayout::Full;
+    std::size_t m_iStride = 0;
+    AlignedVector<T> m_vData;
+    const T* m_pView = nullptr;
+};
+
+// The weight type of anything the solvers accept as a matrix (a vector of vectors or a DistanceMatrix)
+template <typename Matrix>
+using MatrixWeight = std::decay_t<decltype(std::declval<const Matrix&>()[0][0])>;
@@ -0,0 +1,164 @@
+// InstanceFile.h : The binary file format for problem instances.
+// A file holds one or more instances back to back (so files can simply be concatenated). Each instance is a 64 byte
+// header followed by its weights:
+//   offset  0  char[8]   magic "VERGEMTX"
+//           8  uint32    format version (1)
+//          12  uint32    weight type: 0 = double, 1 = float
+//          16  uint32    layout: 0 = full, 1 = packed upper triangle (see MatrixLayout)
+//          20  uint32    reserved, 0
+//          24  uint64    number of nodes
+//          32  uint64    size of the weights in bytes, padding included (a multiple of 64)
+//          40  byte[24]  reserved, 0
+// The weights are stored exactly the way DistanceMatrix lays them out in memory (full rows padded to a whole cache
+// line) and padded to a multiple of 64 bytes, so every header and every block of weights starts 64 byte aligned.
+// A memory mapped file (see MappedFile.h) can then be handed to the solvers as DistanceMatrix views without parsing
+// or copying a single weight, however big the instance is. Everything is little endian, like every machine we run on.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+
+#include "DistanceMatrix.h"
+
+enum class WeightType : std::uint32_t
+{
+    Double = 0,
+    Float = 1,
+};
+
+template <typename T>
+struct WeightTypeOf;
+
+template <>
+struct WeightTypeOf<double>
+{
+    static constexpr WeightType value = WeightType::Double;
+};
+
+template <>
+struct WeightTypeOf<float>
+{
+    static constexpr WeightType value = WeightType::Float;
+};
+
+struct InstanceHeader
+{
+    char m_aMagic[8];
+    std::uint32_t m_iVersion;
+    std::uint32_t m_iWeightType;
+    std::uint32_t m_iLayout;
+    std::uint32_t m_iReserved;
+    std::uint64_t m_numNodes;
+    std::uint64_t m_iWeightBytes;
+    std::uint8_t m_aReserved[24];
+};
+static_assert(sizeof(InstanceHeader) == 64, "The instance header has to be exactly one cache line");
+
+constexpr char kInstanceMagic[8] = { 'V', 'E', 'R', 'G', 'E', 'M', 'T', 'X' };
+constexpr std::uint32_t kInstanceVersion = 1;
+
+// Bytes of weights (padding included) a numNodes instance takes up
+template <typename T>
+std::uint64_t instanceWeightBytes(std::uint64_t numNodes, MatrixLayout layout)
+{
+    std::uint64_t iBytes = DistanceMatrix<T>::storageSize(static_cast<std::size_t>(numNodes), layout) * sizeof(T);
+    return (iBytes + 63) & ~std::uint64_t{ 63 };
+}
+
+// Append one instance to a binary stream. Returns false if the stream went bad
+template <typename T>
+bool writeInstance(std::ostream& out, const DistanceMatrix<T>& matrix)
+{
+    InstanceHeader header{};
+    std::memcpy(header.m_aMagic, kInstanceMagic, sizeof(kInstanceMagic));
+    header.m_iVersion = kInstanceVersion;
+    header.m_iWeightType = static_cast<std::uint32_t>(WeightTypeOf<T>::value);
+    header.m_iLayout = static_cast<std::uint32_t>(matrix.layout());
+    header.m_numNodes = matrix.size();
+    header.m_iWeightBytes = instanceWeightBytes<T>(matrix.size(), matrix.layout());
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    std::size_t iBytes = DistanceMatrix<T>::storageSize(matrix.size(), matrix.layout()) * sizeof(T);
+    out.write(reinterpret_cast<const char*>(matrix.data()), static_cast<std::streamsize>(iBytes));
+
+    const char aZeros[64] = {};
+    out.write(aZeros, static_cast<std::streamsize>(header.m_iWeightBytes - iBytes));
+    return static_cast<bool>(out);
+}
+
+// One instance inside a mapped file. The weights still live in the file
+struct InstanceView
+{
+    WeightType m_weightType = WeightType::Double;
+    MatrixLayout m_layout = MatrixLayout::Full;
+    std::size_t m_numNodes = 0;
+    const void* m_pWeights = nullptr;
+
+    // T has to match m_weightType
+    template <typename T>
+    DistanceMatrix<T> matrix() const
+    {
+        return DistanceMatrix<T>::view(static_cast<const T*>(m_pWeights), m_numNodes, m_layout);
+    }
+};
+
+// Walks the instances in a block of memory (normally a MappedFile) from front to back. Only the headers are read,
+// so getting to the next instance costs the same whatever its size
+class InstanceReader
+{
+public:
+    InstanceReader(const unsigned char* pData, std::size_t iSize) : m_pData(pData), m_iSize(iSize) {}
+
+    // Returns false at the end of the data, or if the next header is bad, in which case error() says why
+    bool next(InstanceView& instance)
+    {
+        if (m_iOffset == m_iSize || !m_sError.empty()) return false;
+
+        if (m_iSize - m_iOffset < sizeof(InstanceHeader)) return fail("truncated header");
+
+        InstanceHeader header;
+        std::memcpy(&header, m_pData + m_iOffset, sizeof(header));
+        if (std::memcmp(header.m_aMagic, kInstanceMagic, sizeof(kInstanceMagic)) != 0) return fail("not an instance (bad magic)");
+        if (header.m_iVersion != kInstanceVersion) return fail("unsupported version " + std::to_string(header.m_iVersion));
+        if (header.m_iWeightType > static_cast<std::uint32_t>(WeightType::Float)) return fail("unknown weight type");
+        if (header.m_iLayout > static_cast<std::uint32_t>(MatrixLayout::PackedUpper)) return fail("unknown layout");
+
+        // 2^28 nodes would already be petabytes of weights. Capping it there means the size sums below can't overflow
+        if (header.m_numNodes > (std::uint64_t{ 1 } << 28)) return fail("too many nodes");
+
+        WeightType weightType = static_cast<WeightType>(header.m_iWeightType);
+        MatrixLayout layout = static_cast<MatrixLayout>(header.m_iLayout);
+        std::uint64_t iExpectedBytes = weightType == WeightType::Double ? instanceWeightBytes<double>(header.m_numNodes, layout)
+            : instanceWeightBytes<float>(header.m_numNodes, layout);
+        if (header.m_iWeightBytes != iExpectedBytes) return fail("weight size doesn't match the node count");
+        if (m_iSize - m_iOffset - sizeof(InstanceHeader) < header.m_iWeightBytes) return fail("truncated weights");
+
+        instance.m_weightType = weightType;
+        instance.m_layout = layout;
+        instance.m_numNodes = static_cast<std::size_t>(header.m_numNodes);
+        instance.m_pWeights = m_pData + m_iOffset + sizeof(InstanceHeader);
+
+        m_iOffset += sizeof(InstanceHeader) + static_cast<std::size_t>(header.m_iWeightBytes);
+        return true;
+    }
+
+    const std::string& error() const { return m_sError; }
+
+    // Where the next header starts
+    std::size_t offset() const { return m_iOffset; }
+
+private:
+    bool fail(const std::string& sError)
+    {
+        m_sError = sError + " at byte " + std::to_string(m_iOffset);
+        return false;
+    }
+
+    const unsigned char* m_pData;
+    std::size_t m_iSize;
+    std::size_t m_iOffset = 0;
+    std::string m_sError;
+};
@@ -0,0 +1,104 @@
+// MappedFile.h : A read only memory mapping of a whole file.
+// Mapping the file rather than reading it means opening even a huge instance file costs next to nothing: the OS only
+// pages in the parts of it a solver actually touches, and the weights are used straight out of the page cache
+// without being copied anywhere. The mapping starts on a page boundary, so anything at a 64 byte aligned offset in
+// the file is 64 byte aligned in memory too.
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+class MappedFile
+{
+public:
+    MappedFile() = default;
+
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Returns false (and leaves the object empty) if the file can't be opened or mapped
+    bool open(const std::string& path)
+    {
+        close();
+#if defined(_WIN32)
+        HANDLE hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (hFile == INVALID_HANDLE_VALUE) return false;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(hFile, &size))
+        {
+            CloseHandle(hFile);
+            return false;
+        }
+        m_iSize = static_cast<std::size_t>(size.QuadPart);
+
+        // An empty file can't be mapped but is still a perfectly good (empty) file
+        if (m_iSize > 0)
+        {
+            HANDLE hMapping = CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (hMapping) m_pData = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+            if (hMapping) CloseHandle(hMapping);
+        }
+        CloseHandle(hFile);
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        m_iSize = static_cast<std::size_t>(info.st_size);
+
+        if (m_iSize > 0)
+        {
+            void* pData = mmap(nullptr, m_iSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (pData != MAP_FAILED) m_pData = pData;
+        }
+        ::close(fd);
+#endif
+        if (m_iSize > 0 && !m_pData)
+        {
+            m_iSize = 0;
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (m_pData)
+        {
+#if defined(_WIN32)
+            UnmapViewOfFile(m_pData);
+#else
+            munmap(m_pData, m_iSize);
+#endif
+        }
+        m_pData = nullptr;
+        m_iSize = 0;
+    }
+
+    const unsigned char* data() const { return static_cast<const unsigned char*>(m_pData); }
+    std::size_t size() const { return m_iSize; }
+
+private:
+    void* m_pData = nullptr;
+    std::size_t m_iSize = 0;
+};
@@ -0,0 +1,73 @@
+// PathArena.h : Lots of paths that share their tails, stored as one node each plus a link to the rest of the path.
+// A search that grows paths one node at a time would otherwise copy the whole path (a vector of nodes) into every
+// state it makes. Here adding a node to the front of a path is one 8 byte entry, whatever the length of the path,
+// and only the path that wins is ever turned into a vector.
+// Entries are bump allocated out of big blocks that never move, so indexes stay good while it grows, nothing is ever
+// freed on its own and the whole arena goes in one go when it is cleared or destroyed.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class PathArena
+{
+public:
+    using Index = std::uint32_t;
+    static constexpr Index kNone = 0xFFFFFFFF;
+
+    // A path of iNode followed by the path at iRest (kNone if iNode is the last node). Returns the new path
+    Index add(int iNode, Index iRest)
+    {
+        if (m_iSize == m_vBlocks.size() * kBlockSize) m_vBlocks.push_back(std::make_unique<Entry[]>(kBlockSize));
+        entry(m_iSize) = Entry{ static_cast<std::int32_t>(iNode), iRest };
+        return static_cast<Index>(m_iSize++);
+    }
+
+    int node(Index iPath) const { return entry(iPath).m_iNode; }
+    Index rest(Index iPath) const { return entry(iPath).m_iRest; }
+
+    // Swap in a different rest of the path after iPath's first node
+    void setRest(Index iPath, Index iRest) { entry(iPath).m_iRest = iRest; }
+
+    // The nodes of the path at iPath, first node first
+    std::vector<int> path(Index iPath) const
+    {
+        std::vector<int> vPath;
+        for (; iPath != kNone; iPath = rest(iPath))
+        {
+            vPath.push_back(node(iPath));
+        }
+        return vPath;
+    }
+
+    void clear()
+    {
+        m_vBlocks.clear();
+        m_iSize = 0;
+    }
+
+    std::size_t size() const { return m_iSize; }
+    std::size_t memoryBytes() const { return m_vBlocks.size() * kBlockSize * sizeof(Entry); }
+
+    // Indexes are 32 bits, with kNone taken
+    static constexpr std::size_t kMaxSize = kNone;
+
+private:
+    struct Entry
+    {
+        std::int32_t m_iNode;
+        Index m_iRest;
+    };
+
+    // 64k entries, half a megabyte a block
+    static constexpr std::size_t kBlockBits = 16;
+    static constexpr std::size_t kBlockSize = std::size_t{ 1 } << kBlockBits;
+
+    Entry& entry(std::size_t i) { return m_vBlocks[i >> kBlockBits][i & (kBlockSize - 1)]; }
+    const Entry& entry(std::size_t i) const { return m_vBlocks[i >> kBlockBits][i & (kBlockSize - 1)]; }
+
+    std::vector<std::unique_ptr<Entry[]>> m_vBlocks;
+    std::size_t m_iSize = 0;
+};
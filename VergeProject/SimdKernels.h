@@ -0,0 +1,253 @@
+// SimdKernels.h : Vectorised versions of the exact solver's inner loop.
+// Relaxing a DP state means computing dist[iHead][iNode] + cost[iRestMask][iNode] for every node and keeping the
+// smallest one (and the first node that reaches it). Both rows are contiguous, padded to a whole number of 64 byte
+// cache lines and 64 byte aligned (see PairDpTables) so we can run over them a whole register at a time with no tail
+// handling.
+// Nodes we aren't allowed to step to (already visited pairs, the head's own pair and the padding) hold an infinite
+// cost, so they fall out of the min on their own without a branch.
+//
+// There is a scalar, an AVX2 and an AVX-512 version, each for double and float weights (float fits twice as many
+// lanes in a register). Which one is used is decided once at run time from what the CPU (and OS) supports, so the
+// same binary runs everywhere.
+#pragma once
+
+#include <cstddef>
+#include <limits>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define VERGE_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only let us use AVX intrinsics inside functions marked for that target. MSVC allows them anywhere
+#if defined(VERGE_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define VERGE_TARGET_AVX2 __attribute__((target("avx2")))
+#define VERGE_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define VERGE_TARGET_AVX2
+#define VERGE_TARGET_AVX512
+#endif
+
+enum class SimdLevel
+{
+    Scalar = 0,
+    Avx2 = 1,
+    Avx512 = 2,
+};
+
+struct RowMin
+{
+    double m_dValue;
+    int m_iIndex;
+};
+
+// iLength must fill whole 64 byte lines, i.e. be a multiple of 8 doubles or 16 floats
+template <typename T>
+using MinPlusRowFn = RowMin (*)(const T* pDist, const T* pCost, std::size_t iLength);
+
+template <typename T>
+RowMin minPlusRowScalar(const T* pDist, const T* pCost, std::size_t iLength)
+{
+    RowMin best{ std::numeric_limits<double>::infinity(), -1 };
+    for (std::size_t i = 0; i < iLength; i++)
+    {
+        T candidate = pDist[i] + pCost[i];
+        if (candidate < best.m_dValue)
+        {
+            best.m_dValue = candidate;
+            best.m_iIndex = static_cast<int>(i);
+        }
+    }
+    return best;
+}
+
+#if defined(VERGE_SIMD_X86)
+
+// Each lane keeps its own best value and the index it came from. A strict less than compare picks which lanes take
+// the new candidate (a blend, not a branch), so each lane keeps the first index that hit its min. At the end we take
+// the smallest value over the lanes and the smallest index among the lanes holding it, which is exactly what the
+// scalar loop returns.
+VERGE_TARGET_AVX2 inline RowMin minPlusRowAvx2(const double* pDist, const double* pCost, std::size_t iLength)
+{
+    __m256d vBest = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+    __m256d vBestIndex = _mm256_set1_pd(-1.0);
+    __m256d vIndex = _mm256_setr_pd(0.0, 1.0, 2.0, 3.0);
+    const __m256d vStep = _mm256_set1_pd(4.0);
+
+    for (std::size_t i = 0; i < iLength; i += 4)
+    {
+        __m256d vCandidate = _mm256_add_pd(_mm256_loadu_pd(pDist + i), _mm256_loadu_pd(pCost + i));
+        __m256d vLess = _mm256_cmp_pd(vCandidate, vBest, _CMP_LT_OQ);
+        vBest = _mm256_blendv_pd(vBest, vCandidate, vLess);
+        vBestIndex = _mm256_blendv_pd(vBestIndex, vIndex, vLess);
+        vIndex = _mm256_add_pd(vIndex, vStep);
+    }
+
+    alignas(32) double aBest[4];
+    alignas(32) double aIndex[4];
+    _mm256_store_pd(aBest, vBest);
+    _mm256_store_pd(aIndex, vBestIndex);
+
+    RowMin best{ std::numeric_limits<double>::infinity(), -1 };
+    for (int iLane = 0; iLane < 4; iLane++)
+    {
+        int iLaneIndex = static_cast<int>(aIndex[iLane]);
+        if (aBest[iLane] < best.m_dValue || (aBest[iLane] == best.m_dValue && iLaneIndex < best.m_iIndex))
+        {
+            best.m_dValue = aBest[iLane];
+            best.m_iIndex = iLaneIndex;
+        }
+    }
+    return best;
+}
+
+VERGE_TARGET_AVX512 inline RowMin minPlusRowAvx512(const double* pDist, const double* pCost, std::size_t iLength)
+{
+    __m512d vBest = _mm512_set1_pd(std::numeric_limits<double>::infinity());
+    __m512d vBestIndex = _mm512_set1_pd(-1.0);
+    __m512d vIndex = _mm512_setr_pd(0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0);
+    const __m512d vStep = _mm512_set1_pd(8.0);
+
+    for (std::size_t i = 0; i < iLength; i += 8)
+    {
+        __m512d vCandidate = _mm512_add_pd(_mm512_loadu_pd(pDist + i), _mm512_loadu_pd(pCost + i));
+        __mmask8 iLess = _mm512_cmp_pd_mask(vCandidate, vBest, _CMP_LT_OQ);
+        vBest = _mm512_mask_blend_pd(iLess, vBest, vCandidate);
+        vBestIndex = _mm512_mask_blend_pd(iLess, vBestIndex, vIndex);
+        vIndex = _mm512_add_pd(vIndex, vStep);
+    }
+
+    double dBest = _mm512_reduce_min_pd(vBest);
+    if (!(dBest < std::numeric_limits<double>::infinity())) return { dBest, -1 };
+
+    __mmask8 iIsBest = _mm512_cmp_pd_mask(vBest, _mm512_set1_pd(dBest), _CMP_EQ_OQ);
+    double dIndex = _mm512_mask_reduce_min_pd(iIsBest, vBestIndex);
+    return { dBest, static_cast<int>(dIndex) };
+}
+
+// The float versions are the same with twice the lanes. The lane indices are kept as floats too, which is exact far
+// beyond any row length we can get
+VERGE_TARGET_AVX2 inline RowMin minPlusRowAvx2(const float* pDist, const float* pCost, std::size_t iLength)
+{
+    __m256 vBest = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    __m256 vBestIndex = _mm256_set1_ps(-1.0f);
+    __m256 vIndex = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+    const __m256 vStep = _mm256_set1_ps(8.0f);
+
+    for (std::size_t i = 0; i < iLength; i += 8)
+    {
+        __m256 vCandidate = _mm256_add_ps(_mm256_loadu_ps(pDist + i), _mm256_loadu_ps(pCost + i));
+        __m256 vLess = _mm256_cmp_ps(vCandidate, vBest, _CMP_LT_OQ);
+        vBest = _mm256_blendv_ps(vBest, vCandidate, vLess);
+        vBestIndex = _mm256_blendv_ps(vBestIndex, vIndex, vLess);
+        vIndex = _mm256_add_ps(vIndex, vStep);
+    }
+
+    alignas(32) float aBest[8];
+    alignas(32) float aIndex[8];
+    _mm256_store_ps(aBest, vBest);
+    _mm256_store_ps(aIndex, vBestIndex);
+
+    RowMin best{ std::numeric_limits<double>::infinity(), -1 };
+    for (int iLane = 0; iLane < 8; iLane++)
+    {
+        int iLaneIndex = static_cast<int>(aIndex[iLane]);
+        if (aBest[iLane] < best.m_dValue || (aBest[iLane] == best.m_dValue && iLaneIndex < best.m_iIndex))
+        {
+            best.m_dValue = aBest[iLane];
+            best.m_iIndex = iLaneIndex;
+        }
+    }
+    return best;
+}
+
+VERGE_TARGET_AVX512 inline RowMin minPlusRowAvx512(const float* pDist, const float* pCost, std::size_t iLength)
+{
+    __m512 vBest = _mm512_set1_ps(std::numeric_limits<float>::infinity());
+    __m512 vBestIndex = _mm512_set1_ps(-1.0f);
+    __m512 vIndex = _mm512_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f, 9.0f, 10.0f, 11.0f, 12.0f, 13.0f, 14.0f, 15.0f);
+    const __m512 vStep = _mm512_set1_ps(16.0f);
+
+    for (std::size_t i = 0; i < iLength; i += 16)
+    {
+        __m512 vCandidate = _mm512_add_ps(_mm512_loadu_ps(pDist + i), _mm512_loadu_ps(pCost + i));
+        __mmask16 iLess = _mm512_cmp_ps_mask(vCandidate, vBest, _CMP_LT_OQ);
+        vBest = _mm512_mask_blend_ps(iLess, vBest, vCandidate);
+        vBestIndex = _mm512_mask_blend_ps(iLess, vBestIndex, vIndex);
+        vIndex = _mm512_add_ps(vIndex, vStep);
+    }
+
+    float fBest = _mm512_reduce_min_ps(vBest);
+    if (!(fBest < std::numeric_limits<float>::infinity())) return { fBest, -1 };
+
+    __mmask16 iIsBest = _mm512_cmp_ps_mask(vBest, _mm512_set1_ps(fBest), _CMP_EQ_OQ);
+    float fIndex = _mm512_mask_reduce_min_ps(iIsBest, vBestIndex);
+    return { fBest, static_cast<int>(fIndex) };
+}
+
+inline SimdLevel detectSimdLevel()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int aInfo[4];
+    __cpuid(aInfo, 0);
+    if (aInfo[0] < 7) return SimdLevel::Scalar;
+
+    __cpuid(aInfo, 1);
+    bool bOsXsave = (aInfo[2] & (1 << 27)) != 0;
+    bool bAvx = (aInfo[2] & (1 << 28)) != 0;
+    if (!bOsXsave || !bAvx) return SimdLevel::Scalar;
+
+    // The OS has to save the wider registers on a context switch or we can't use them
+    unsigned long long iXcr0 = _xgetbv(0);
+    bool bOsAvx = (iXcr0 & 0x6) == 0x6;
+    bool bOsAvx512 = (iXcr0 & 0xE6) == 0xE6;
+
+    __cpuidex(aInfo, 7, 0);
+    bool bAvx2 = (aInfo[1] & (1 << 5)) != 0;
+    bool bAvx512 = (aInfo[1] & (1 << 16)) != 0;
+
+    if (bAvx512 && bOsAvx512) return SimdLevel::Avx512;
+    if (bAvx2 && bOsAvx) return SimdLevel::Avx2;
+    return SimdLevel::Scalar;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SimdLevel::Avx512;
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::Avx2;
+    return SimdLevel::Scalar;
+#endif
+}
+
+#else
+
+inline SimdLevel detectSimdLevel() { return SimdLevel::Scalar; }
+
+#endif
+
+// The kernel for a given level and weight type (double or float). Asking for a level the CPU doesn't have is the
+// caller's problem
+template <typename T = double>
+MinPlusRowFn<T> minPlusRowKernel(SimdLevel level)
+{
+#if defined(VERGE_SIMD_X86)
+    switch (level)
+    {
+    case SimdLevel::Avx512: return &minPlusRowAvx512;
+    case SimdLevel::Avx2: return &minPlusRowAvx2;
+    default: break;
+    }
+#else
+    (void)level;
+#endif
+    return &minPlusRowScalar<T>;
+}
+
+// The best kernel for this machine, picked the first time it's asked for
+template <typename T = double>
+MinPlusRowFn<T> minPlusRow()
+{
+    static const MinPlusRowFn<T> pfnKernel = minPlusRowKernel<T>(detectSimdLevel());
+    return pfnKernel;
+}
@@ -0,0 +1,82 @@
+// SolveProgress.h : What a solve running on one thread shares with whoever is waiting for it on another.
+// The solver hands over every better path it finds and checks stopRequested() every so often, between DP layers or
+// every few thousand branch and bound calls. The other side can read the best path so far and a lower bound on the
+// optimal weight at any time, and can ask the solver to stop. See solveAsync for the usual way to get one.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+class SolveProgress
+{
+public:
+    // Called on the solver's thread for every better path, so it should be quick
+    using Callback = std::function<void(double dWeight, const std::vector<int>& vPath)>;
+
+    explicit SolveProgress(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max(), Callback onImproved = {}) :
+        m_deadline{ deadline }, m_onImproved{ std::move(onImproved) }
+    {
+    }
+
+    SolveProgress(const SolveProgress&) = delete;
+    SolveProgress& operator=(const SolveProgress&) = delete;
+
+    // The solver stops at its next check and returns the best path it has
+    void cancel() { m_bCancelled.store(true, std::memory_order_relaxed); }
+    bool cancelled() const { return m_bCancelled.load(std::memory_order_relaxed); }
+
+    // Cancelled or past the deadline. This reads the clock, so don't call it in an inner loop
+    bool stopRequested() const { return cancelled() || std::chrono::steady_clock::now() >= m_deadline; }
+
+    std::chrono::steady_clock::time_point deadline() const { return m_deadline; }
+
+    // Keeps the path if it is lighter than the best one so far. Returns true if it was kept
+    bool offer(double dWeight, const std::vector<int>& vPath)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!(dWeight < m_dBestWeight)) return false;
+            m_dBestWeight = dWeight;
+            m_vBestPath = vPath;
+        }
+        if (m_onImproved) m_onImproved(dWeight, vPath);
+        return true;
+    }
+
+    // The optimal weight is known to be at least dBound
+    void raiseLowerBound(double dBound)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_dLowerBound = std::max(m_dLowerBound, dBound);
+    }
+
+    // The best path so far, or { -1.0, {} } if there isn't one yet
+    std::pair<double, std::vector<int>> incumbent() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_vBestPath.empty()) return { -1.0, {} };
+        return { m_dBestWeight, m_vBestPath };
+    }
+
+    // -infinity until a solver has worked one out. Equal to the incumbent's weight once it is proven optimal
+    double lowerBound() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_dLowerBound;
+    }
+
+private:
+    std::atomic<bool> m_bCancelled{ false };
+    const std::chrono::steady_clock::time_point m_deadline;
+    const Callback m_onImproved;
+
+    mutable std::mutex m_mutex;
+    double m_dBestWeight = std::numeric_limits<double>::infinity();
+    std::vector<int> m_vBestPath;
+    double m_dLowerBound = -std::numeric_limits<double>::infinity();
+};
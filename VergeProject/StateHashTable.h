@@ -0,0 +1,175 @@
+// StateHashTable.h : A hash table of (pair mask, node) search states that only takes memory for the states reached.
+// optimalMin keeps a row for every one of the 2^(numNodes/2) masks, which is the right thing when it is going to fill
+// them all in. A search that prunes most of them (see SparseExactSearch) wants memory in proportion to what it keeps
+// instead, so it stores its states here.
+// - Open addressing with linear probing, a cache line of slots at a time. A bucket is one 64 byte aligned line
+//   holding as many (mask, node, value) slots as fit, split into arrays of masks, values and nodes so a lookup
+//   usually reads a single line. There are no deletes, so an empty slot ends a probe.
+// - The table doubles (and rehashes) once it is 7/8 full, so it never holds more than about twice the lines it needs.
+// - Masks are either a std::uint64_t (up to 64 pairs, 128 nodes) or a PairMask128 (up to 128 pairs, 256 nodes). The
+//   few things the search needs to do with a mask are overloaded for both below.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+
+#include "AlignedAllocator.h"
+
+struct PairMask128
+{
+    std::uint64_t m_iLow = 0;  // Pairs 0 to 63
+    std::uint64_t m_iHigh = 0; // Pairs 64 to 127
+};
+
+inline bool operator==(const PairMask128& a, const PairMask128& b) { return a.m_iLow == b.m_iLow && a.m_iHigh == b.m_iHigh; }
+inline bool operator!=(const PairMask128& a, const PairMask128& b) { return !(a == b); }
+
+// Most pairs a mask type can hold
+template <typename Mask>
+constexpr int kMaxMaskPairs = static_cast<int>(sizeof(Mask) * 8);
+
+inline bool hasPair(std::uint64_t iMask, int iPair) { return (iMask >> iPair) & 1; }
+
+inline bool hasPair(const PairMask128& mask, int iPair)
+{
+    return iPair < 64 ? (mask.m_iLow >> iPair) & 1 : (mask.m_iHigh >> (iPair - 64)) & 1;
+}
+
+inline std::uint64_t withPair(std::uint64_t iMask, int iPair) { return iMask | (std::uint64_t{ 1 } << iPair); }
+
+inline PairMask128 withPair(PairMask128 mask, int iPair)
+{
+    if (iPair < 64) mask.m_iLow |= std::uint64_t{ 1 } << iPair;
+    else mask.m_iHigh |= std::uint64_t{ 1 } << (iPair - 64);
+    return mask;
+}
+
+inline std::uint64_t withoutPair(std::uint64_t iMask, int iPair) { return iMask & ~(std::uint64_t{ 1 } << iPair); }
+
+inline PairMask128 withoutPair(PairMask128 mask, int iPair)
+{
+    if (iPair < 64) mask.m_iLow &= ~(std::uint64_t{ 1 } << iPair);
+    else mask.m_iHigh &= ~(std::uint64_t{ 1 } << (iPair - 64));
+    return mask;
+}
+
+// The masks of one search differ in only a few bits from each other, so multiply them out over all 64 bits (bucketOf
+// mixes the top bits back down)
+inline std::uint64_t hashMask(std::uint64_t iMask) { return iMask * 0x9E3779B97F4A7C15ull; }
+inline std::uint64_t hashMask(const PairMask128& mask) { return (mask.m_iLow * 0x9E3779B97F4A7C15ull) ^ (mask.m_iHigh * 0xD6E8FEB86659FD93ull); }
+
+// Value has to be cheap to copy. The table holds copies of it and moves them about when it grows
+template <typename Mask, typename Value>
+class StateHashTable
+{
+public:
+    // Room for about iExpectedStates before the first time it grows
+    explicit StateHashTable(std::size_t iExpectedStates = 0)
+    {
+        std::size_t iNumBuckets = 1;
+        while (iNumBuckets * kSlotsPerBucket * 7 / 8 < iExpectedStates) iNumBuckets *= 2;
+        m_vBuckets.resize(iNumBuckets);
+    }
+
+    // The state's value if it is in the table, else nullptr
+    Value* find(const Mask& mask, int iNode)
+    {
+        for (std::size_t iBucket = bucketOf(mask, iNode); ; iBucket = (iBucket + 1) & (m_vBuckets.size() - 1))
+        {
+            Bucket& bucket = m_vBuckets[iBucket];
+            for (std::size_t iSlot = 0; iSlot < kSlotsPerBucket; iSlot++)
+            {
+                if (bucket.m_aNode[iSlot] == kEmpty) return nullptr;
+                if (bucket.m_aNode[iSlot] == iNode && bucket.m_aMask[iSlot] == mask) return &bucket.m_aValue[iSlot];
+            }
+        }
+    }
+
+    const Value* find(const Mask& mask, int iNode) const { return const_cast<StateHashTable*>(this)->find(mask, iNode); }
+
+    // Like std::unordered_map::try_emplace: adds the state with value if it isn't there yet. Returns the state's value
+    // and true if it was just added. The pointer stays good until the next state is added
+    std::pair<Value*, bool> tryEmplace(const Mask& mask, int iNode, const Value& value)
+    {
+        if ((m_iSize + 1) * 8 > m_vBuckets.size() * kSlotsPerBucket * 7) grow();
+
+        for (std::size_t iBucket = bucketOf(mask, iNode); ; iBucket = (iBucket + 1) & (m_vBuckets.size() - 1))
+        {
+            Bucket& bucket = m_vBuckets[iBucket];
+            for (std::size_t iSlot = 0; iSlot < kSlotsPerBucket; iSlot++)
+            {
+                if (bucket.m_aNode[iSlot] == kEmpty)
+                {
+                    bucket.m_aMask[iSlot] = mask;
+                    bucket.m_aNode[iSlot] = iNode;
+                    bucket.m_aValue[iSlot] = value;
+                    m_iSize++;
+                    return { &bucket.m_aValue[iSlot], true };
+                }
+                if (bucket.m_aNode[iSlot] == iNode && bucket.m_aMask[iSlot] == mask) return { &bucket.m_aValue[iSlot], false };
+            }
+        }
+    }
+
+    // func(mask, node, value) for every state, in no particular order
+    template <typename Func>
+    void forEach(Func func) const
+    {
+        for (const Bucket& bucket : m_vBuckets)
+        {
+            for (std::size_t iSlot = 0; iSlot < kSlotsPerBucket && bucket.m_aNode[iSlot] != kEmpty; iSlot++)
+            {
+                func(bucket.m_aMask[iSlot], static_cast<int>(bucket.m_aNode[iSlot]), bucket.m_aValue[iSlot]);
+            }
+        }
+    }
+
+    std::size_t size() const { return m_iSize; }
+    std::size_t memoryBytes() const { return m_vBuckets.size() * sizeof(Bucket); }
+
+    // Bytes per state a table needs on average, from just after it has grown (7/16 full) to just before (7/8 full)
+    static double bytesPerState() { return sizeof(Bucket) / (kSlotsPerBucket * 0.65625); }
+
+private:
+    static constexpr std::int32_t kEmpty = -1;
+    static constexpr std::size_t kSlotsPerBucket = std::max<std::size_t>(1, 64 / (sizeof(Mask) + sizeof(Value) + sizeof(std::int32_t)));
+
+    struct alignas(64) Bucket
+    {
+        Bucket() { std::fill(std::begin(m_aNode), std::end(m_aNode), kEmpty); }
+
+        Mask m_aMask[kSlotsPerBucket];
+        Value m_aValue[kSlotsPerBucket];
+        std::int32_t m_aNode[kSlotsPerBucket];
+    };
+
+    std::size_t bucketOf(const Mask& mask, int iNode) const
+    {
+        std::uint64_t iHash = hashMask(mask) ^ (static_cast<std::uint64_t>(iNode) * 0xC2B2AE3D27D4EB4Full);
+        iHash ^= iHash >> 33;
+        iHash *= 0xFF51AFD7ED558CCDull;
+        iHash ^= iHash >> 33;
+        return static_cast<std::size_t>(iHash) & (m_vBuckets.size() - 1);
+    }
+
+    // Buckets only ever fill from the front, so every filled slot is before the first empty one
+    void grow()
+    {
+        AlignedVector<Bucket> vOld(m_vBuckets.size() * 2);
+        vOld.swap(m_vBuckets);
+        m_iSize = 0;
+        for (const Bucket& bucket : vOld)
+        {
+            for (std::size_t iSlot = 0; iSlot < kSlotsPerBucket && bucket.m_aNode[iSlot] != kEmpty; iSlot++)
+            {
+                tryEmplace(bucket.m_aMask[iSlot], bucket.m_aNode[iSlot], bucket.m_aValue[iSlot]);
+            }
+        }
+    }
+
+    AlignedVector<Bucket> m_vBuckets;
+    std::size_t m_iSize = 0;
+};
@@ -0,0 +1,200 @@
+// ThreadPool.h : A small fixed size pool of worker threads.
+// Work is handed out in rounds: runOnAll(...) wakes every worker, runs the job on each of them (the calling thread
+// joins in as worker 0) and only returns once they have all finished. That return doubles as a barrier, which is
+// exactly what the layer by layer DP needs, and the workers stay alive between rounds so we don't pay for
+// creating threads on every layer.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    // numThreads counts the calling thread, so a pool of 1 never starts a thread. 0 means one per hardware thread
+    explicit ThreadPool(unsigned numThreads)
+    {
+        if (numThreads == 0) numThreads = std::max(1u, std::thread::hardware_concurrency());
+        m_numThreads = numThreads;
+
+        for (unsigned iWorker = 1; iWorker < m_numThreads; iWorker++)
+        {
+            m_vThreads.emplace_back([this, iWorker] { workerLoop(iWorker); });
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_bStop = true;
+        }
+        m_cvStart.notify_all();
+        for (auto& thread : m_vThreads)
+        {
+            thread.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned size() const { return m_numThreads; }
+
+    // Run job(iWorker) once on every worker and wait for all of them to finish
+    void runOnAll(const std::function<void(unsigned)>& job)
+    {
+        if (m_numThreads == 1)
+        {
+            job(0);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pJob = &job;
+            m_numBusy = m_numThreads - 1;
+            m_iGeneration++;
+        }
+        m_cvStart.notify_all();
+
+        job(0);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cvDone.wait(lock, [this] { return m_numBusy == 0; });
+        m_pJob = nullptr;
+    }
+
+    // Split [0, count) into blocks of iGrain items which the workers claim from a shared counter until there are none
+    // left. func(iBegin, iEnd, iWorker) is called once per block. Returns once every block is done
+    template <typename Func>
+    void parallelFor(std::size_t count, std::size_t iGrain, Func func)
+    {
+        iGrain = std::max<std::size_t>(iGrain, 1);
+        std::atomic<std::size_t> iNextBlock{ 0 };
+        std::size_t numBlocks = (count + iGrain - 1) / iGrain;
+
+        runOnAll([&](unsigned iWorker)
+        {
+            for (std::size_t iBlock = iNextBlock++; iBlock < numBlocks; iBlock = iNextBlock++)
+            {
+                std::size_t iBegin = iBlock * iGrain;
+                func(iBegin, std::min(iBegin + iGrain, count), iWorker);
+            }
+        });
+    }
+
+    // Same contract as parallelFor, but for lots of tiny items where fighting over one shared counter would cost
+    // more than the items themselves. [0, count) starts out split evenly between the workers and each worker takes
+    // iGrain items at a time off the front of its own range. A worker that runs out steals the back half of what is
+    // left of someone else's range and carries on with that. Returns once every item is done
+    template <typename Func>
+    void stealingFor(std::size_t count, std::size_t iGrain, Func func)
+    {
+        iGrain = std::max<std::size_t>(iGrain, 1);
+
+        // A range is packed into one word (begin in the low half, end in the high half) so that taking from the
+        // front and stealing from the back are each a single compare and swap. That limits a round to 2^32 - 1 items
+        const std::size_t kMaxRound = 0xFFFFFFFFu;
+        auto pack = [](std::uint64_t iBegin, std::uint64_t iEnd) { return (iEnd << 32) | iBegin; };
+
+        struct alignas(64) StealRange
+        {
+            std::atomic<std::uint64_t> m_iRange;
+        };
+        std::vector<StealRange> vRanges(m_numThreads);
+
+        for (std::size_t iOffset = 0; iOffset < count; iOffset += kMaxRound)
+        {
+            const std::uint64_t iRoundSize = std::min(count - iOffset, kMaxRound);
+            for (unsigned iWorker = 0; iWorker < m_numThreads; iWorker++)
+            {
+                vRanges[iWorker].m_iRange = pack(iRoundSize * iWorker / m_numThreads, iRoundSize * (iWorker + 1) / m_numThreads);
+            }
+
+            runOnAll([&](unsigned iWorker)
+            {
+                std::atomic<std::uint64_t>& ownRange = vRanges[iWorker].m_iRange;
+                for (;;)
+                {
+                    std::uint64_t iRange = ownRange.load();
+                    while ((iRange & 0xFFFFFFFFu) < (iRange >> 32))
+                    {
+                        std::uint64_t iBegin = iRange & 0xFFFFFFFFu;
+                        std::uint64_t iEnd = std::min<std::uint64_t>(iBegin + iGrain, iRange >> 32);
+                        if (ownRange.compare_exchange_weak(iRange, pack(iEnd, iRange >> 32)))
+                        {
+                            func(iOffset + iBegin, iOffset + iEnd, iWorker);
+                            iRange = ownRange.load();
+                        }
+                    }
+
+                    // Nothing left here. Nobody steals from an empty range, so once we have taken half of someone
+                    // else's we can just store it as our own
+                    bool bStole = false;
+                    for (unsigned iStep = 1; iStep < m_numThreads && !bStole; iStep++)
+                    {
+                        std::atomic<std::uint64_t>& victimRange = vRanges[(iWorker + iStep) % m_numThreads].m_iRange;
+                        std::uint64_t iVictim = victimRange.load();
+                        while ((iVictim & 0xFFFFFFFFu) < (iVictim >> 32))
+                        {
+                            std::uint64_t iBegin = iVictim & 0xFFFFFFFFu;
+                            std::uint64_t iMiddle = iBegin + ((iVictim >> 32) - iBegin) / 2;
+                            if (victimRange.compare_exchange_weak(iVictim, pack(iBegin, iMiddle)))
+                            {
+                                ownRange.store(pack(iMiddle, iVictim >> 32));
+                                bStole = true;
+                                break;
+                            }
+                        }
+                    }
+                    if (!bStole) return;
+                }
+            });
+        }
+    }
+
+private:
+    void workerLoop(unsigned iWorker)
+    {
+        std::uint64_t iSeenGeneration = 0;
+        for (;;)
+        {
+            const std::function<void(unsigned)>* pJob;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cvStart.wait(lock, [&] { return m_bStop || m_iGeneration != iSeenGeneration; });
+                if (m_bStop) return;
+                iSeenGeneration = m_iGeneration;
+                pJob = m_pJob;
+            }
+
+            (*pJob)(iWorker);
+
+            bool bLast;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                bLast = --m_numBusy == 0;
+            }
+            if (bLast) m_cvDone.notify_one();
+        }
+    }
+
+    unsigned m_numThreads = 1;
+    std::vector<std::thread> m_vThreads;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cvStart;
+    std::condition_variable m_cvDone;
+    const std::function<void(unsigned)>* m_pJob = nullptr;
+    std::uint64_t m_iGeneration = 0;
+    unsigned m_numBusy = 0;
+    bool m_bStop = false;
+};
@@ -1,8 +1,34 @@
 // VergeProject.cpp : This file contains the 'main' function. Program execution begins and ends there.
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
-#include <queue>
-#include <unordered_map>
+
+#include "AlignedAllocator.h"
+#include "DistanceMatrix.h"
+#include "InstanceFile.h"
+#include "MappedFile.h"
+#include "PathArena.h"
+#include "SimdKernels.h"
+#include "SolveProgress.h"
+#include "StateHashTable.h"
+#include "ThreadPool.h"
 
 // Shortest path problems are hard!
 // I present two methods:
@@ -12,276 +38,3735 @@
 // a BFS alg and I greedily choose the smallest weight edge from an arbitrary starting node pair.
 // The graph is complete so in theory starting from any node would give the same result (except
 // that the greedy nature of the alg may prevent that).
-// We keep track of where we've been with a vector of bools and use a priority queue to
-// always be able to easily access the "best greedily choosen" path from the front of the queue
+// We keep track of which pairs we've been to with a bitmap and at every step scan the row of the
+// node we're on for the lightest edge to a pair we haven't visited yet
 
 // The second method using a bitmask. I put this together having having a working greedy method
-// that always returns a feasible solution. I think this solution is optimal (though I cannot be
-// certain), but it is more costly.
-// The main idea is you can use a bitmask to track all possible paths, and by storing the correct
-// information (path weight, etc) and some tricky logic, you can compile all feasible paths
+// that always returns a feasible solution. It is optimal, but it is more costly.
+// The main idea is you can use a bitmask of the node pairs we've visited, and by storing the best
+// path weight for every (bitmask, node) combination you can build up all feasible paths
 // and from them determine which is shortest
 
 // An observation: this distanceMatrix graph is symmetric due to being complete. There may be
 // optimizations one can make from this structure but it's not something I considered in my
-// algorithms
+// algorithms. The one place it is used is storage: minPath and optimalMin take a DistanceMatrix
+// (see DistanceMatrix.h) as well as a vector of vectors, and it can keep just the upper triangle
 
 // A final note: I used a more common ("standard" ?) variable naming scheme (camelCase) for minPath(...)
 // For optimalPath(..) (mainly since I also used classes/structs) I decided to use Hungarian Notation
 // as this is what I used at my last job. E.g. dWeight denotes weight is a double.
 
-std::pair<double, std::vector<int>> minPath(const std::vector<std::vector<double>>& distanceMatrix)
+// Index of the lowest set bit. bits must not be 0
+inline int countTrailingZeros(std::uint64_t bits)
 {
-    int numNodes = static_cast<int>(distanceMatrix.size());
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
 
-    // We could assume this would never happen since the problem specifies that the graph
-    // will always be complete with an even number of nodes, but it is quick and easy to check for a
-    // odd number. We could also verify completeness by checking the size of each column to ensure
-    // we have a square matrix but I'll leave that out as an assumption of always true
-    if (numNodes % 2 != 0) return { -1.0, { } };
+// When a solve is slow it helps to know where the time went. minPath and optimalMin can fill in a SolverStats as they
+// go. They are templated on the stats type and every update is behind if constexpr (Stats::kEnabled), so the normal
+// overloads (which pass a NoStats) compile to exactly the same code as before and pay nothing for it.
+// A "transition" is one candidate next node looked at. Candidates that can't be taken are counted as pruned, either
+// because they are in the same pair as the node we are on (it or its other node is already in the path) or because
+// their pair has already been visited (for optimalMin: isn't in the rest of the state's mask).
+// Neither solver ever expands a state twice (the DP finishes each state before anything reads it and greedy never
+// goes back), so there is no count of re-expansions. The DP has no queue either; the widest layer is the closest
+// thing to a peak queue size since that is how many states can be worked on at once.
+struct SolverStats
+{
+    static constexpr bool kEnabled = true;
 
-    if (numNodes == 0) return { -2.0, { } };
+    // States whose best weight was worked out (optimalMin) or nodes added to the path (minPath)
+    std::uint64_t m_iStatesExpanded = 0;
+    std::uint64_t m_iTransitionsEvaluated = 0;
+    std::uint64_t m_iPrunedSamePair = 0;
+    std::uint64_t m_iPrunedPairVisited = 0;
+
+    // States in the widest layer of the DP
+    std::uint64_t m_iPeakLayerStates = 0;
+
+    // Memory the solve allocated for its tables and scratch
+    std::uint64_t m_iBytesAllocated = 0;
 
-    std::vector<bool> visited(numNodes, false);
+    // Allocating and filling in the tables, the search itself, and walking back the path
+    double m_dSetupMs = 0.0;
+    double m_dSearchMs = 0.0;
+    double m_dReconstructMs = 0.0;
 
-    // Build a map to keep track of node pairs
-    std::unordered_map<int, int> mapNodePairs;
-    for (int i = 0; i < numNodes; i += 2)
+    // Add the counters from another thread's stats (the timings are the caller's)
+    void addCounts(const SolverStats& other)
     {
-        mapNodePairs[i] = i + 1;
-        mapNodePairs[i + 1] = i;
+        m_iStatesExpanded += other.m_iStatesExpanded;
+        m_iTransitionsEvaluated += other.m_iTransitionsEvaluated;
+        m_iPrunedSamePair += other.m_iPrunedSamePair;
+        m_iPrunedPairVisited += other.m_iPrunedPairVisited;
     }
+};
 
-    typedef std::pair<double, std::pair<int, int>> weightNodes;
-    typedef std::vector <weightNodes> vecWeightNodes;
-    // Organize data by {weight, {toNode, fromNode}}
-    // By default a pq will put the largest weight first (pair.first). Use std::greater to make
-    // it by the lowest weight first (See cppreference.com page on priority queue)
-    std::priority_queue<weightNodes, vecWeightNodes, std::greater<weightNodes>> pq2;
+struct NoStats
+{
+    static constexpr bool kEnabled = false;
 
-    // We can arbitrarily start from the first node pair (0 & 1). Figure out which is best.
-    // Assuming the weights will never be negative in this loop
-    std::pair<double, std::pair<int, int>> startingNode{-1.0, { 0, 0 }};
-    for (int i = 0; i < 2; i++)
+    void addCounts(const NoStats&) {}
+};
+
+inline double millisecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The greedy construction and the local search both spend nearly all their time asking "which nodes are close to
+// this one?", and answer it by scanning a whole row of the matrix, which makes them O(n^2) per path or per pass. Once
+// the instance has tens of thousands of nodes the answer is almost always one of the few nearest nodes, so we work
+// those out once up front.
+// CandidateLists holds the k nearest nodes out of every node (not counting the node itself and the other node of its
+// pair), lightest edge first and the lowest numbered node on a tie. They are stored CSR style: the lists one after
+// the other in m_vNeighbours, with node i's list running from m_vOffsets[i] to m_vOffsets[i + 1].
+struct CandidateLists
+{
+    struct Range
     {
-        for (int j = 0; j < numNodes; j++)
+        const std::int32_t* m_pBegin;
+        const std::int32_t* m_pEnd;
+
+        const std::int32_t* begin() const { return m_pBegin; }
+        const std::int32_t* end() const { return m_pEnd; }
+        bool empty() const { return m_pBegin == m_pEnd; }
+    };
+
+    std::vector<std::size_t> m_vOffsets;
+    std::vector<std::int32_t> m_vNeighbours;
+
+    int size() const { return m_vOffsets.empty() ? 0 : static_cast<int>(m_vOffsets.size() - 1); }
+    Range neighbours(int node) const { return { m_vNeighbours.data() + m_vOffsets[node], m_vNeighbours.data() + m_vOffsets[node + 1] }; }
+    std::size_t memoryBytes() const { return m_vOffsets.size() * sizeof(std::size_t) + m_vNeighbours.size() * sizeof(std::int32_t); }
+};
+
+// 10 neighbours is the usual choice for TSP style local search. Past that the moves hardly ever find anything new
+constexpr int kDefaultCandidates = 10;
+
+// Below this many nodes a full row scan is cheap enough that the lists aren't worth building (see solve())
+constexpr int kCandidateListMinNodes = 4096;
+
+// Every row has to be read once, so this is still O(n^2), but it is spread over numThreads threads (0 means one per
+// hardware thread) and only done once however many greedy starts and local search passes use it
+template <typename Matrix>
+CandidateLists buildCandidateLists(const Matrix& distanceMatrix, int k = kDefaultCandidates, unsigned numThreads = 0)
+{
+    int numNodes = static_cast<int>(distanceMatrix.size());
+    int listSize = std::max(0, std::min(k, numNodes - 2));
+
+    CandidateLists candidates;
+    candidates.m_vOffsets.resize(numNodes + 1);
+    for (int node = 0; node <= numNodes; node++)
+    {
+        candidates.m_vOffsets[node] = static_cast<std::size_t>(node) * listSize;
+    }
+    candidates.m_vNeighbours.resize(static_cast<std::size_t>(numNodes) * listSize);
+    if (listSize == 0) return candidates;
+
+    ThreadPool pool(numThreads);
+    std::vector<std::vector<std::pair<double, int>>> rows(pool.size());
+    pool.parallelFor(numNodes, 64, [&](std::size_t begin, std::size_t end, unsigned worker)
+    {
+        std::vector<std::pair<double, int>>& row = rows[worker];
+        for (int node = static_cast<int>(begin); node < static_cast<int>(end); node++)
         {
-            if (i == j) continue;
-            if (mapNodePairs[i] == j) continue;
-            double weight = distanceMatrix[i][j];
+            row.clear();
+            for (int to = 0; to < numNodes; to++)
+            {
+                if (to / 2 == node / 2) continue;
+                row.push_back({ static_cast<double>(distanceMatrix[node][to]), to });
+            }
 
-            if (startingNode.first < 0 || weight < startingNode.first)
+            // Pairs sort by weight and then node, which is the greedy construction's tie break
+            std::nth_element(row.begin(), row.begin() + (listSize - 1), row.end());
+            std::sort(row.begin(), row.begin() + listSize);
+            std::int32_t* pList = candidates.m_vNeighbours.data() + candidates.m_vOffsets[node];
+            for (int i = 0; i < listSize; i++)
             {
-                startingNode.first = weight;
-                startingNode.second.first = j;
-                startingNode.second.second = i;
+                pList[i] = row[i].second;
             }
         }
+    });
+    return candidates;
+}
+
+// Everything the greedy construction needs to allocate. Keeping it outside greedyFromPair lets a caller that runs
+// the construction many times (see multiStartMinPath) reuse the same buffers instead of allocating them every time
+struct GreedyScratch
+{
+    std::vector<std::uint64_t> unvisitedPairs;
+    std::vector<int> path;
+};
+
+// The greedy construction starting from node pair startPair. Pairs are {0,1} {2,3} ... so node ^ 1 is the other node
+// of a pair. Returns the path weight and leaves the path itself in scratch.path
+//
+// This used to push every edge out of the current node onto a priority queue and pop until it found one that still
+// started at the last node we added, which left O(n^2) stale entries in the heap. The entry it ended up taking was
+// always the lightest edge out of the last node to an unvisited pair (the lowest numbered node on a tie), so now we
+// just scan that row for it directly. Same choices, O(n) per step and no heap.
+// With pCandidates (see CandidateLists) each step first looks down the last node's candidate list and only scans the
+// row when every candidate's pair has been visited. The lists are in the scan's order, so the path is the same.
+template <typename Matrix, typename Stats = NoStats>
+double greedyFromPair(const Matrix& distanceMatrix, int startPair, GreedyScratch& scratch, Stats& stats, const CandidateLists* pCandidates = nullptr)
+{
+    int numNodes = static_cast<int>(distanceMatrix.size());
+    int numPairs = numNodes / 2;
+
+    std::chrono::steady_clock::time_point phaseStart;
+    if constexpr (Stats::kEnabled)
+    {
+        phaseStart = std::chrono::steady_clock::now();
+        stats.m_iBytesAllocated += ((numPairs + 63) / 64) * sizeof(std::uint64_t) + numPairs * sizeof(int);
     }
-    visited[0] = true;
-    visited[1] = true;
 
+    // One bit per pair, set while the pair is still unvisited
+    std::vector<std::uint64_t>& unvisitedPairs = scratch.unvisitedPairs;
+    unvisitedPairs.assign((numPairs + 63) / 64, ~std::uint64_t{ 0 });
+    if (numPairs % 64 != 0) unvisitedPairs.back() = (std::uint64_t{ 1 } << (numPairs % 64)) - 1;
+    auto markVisited = [&unvisitedPairs](int pair) { unvisitedPairs[pair / 64] &= ~(std::uint64_t{ 1 } << (pair % 64)); };
+    auto isUnvisited = [&unvisitedPairs](int pair) { return ((unvisitedPairs[pair / 64] >> (pair % 64)) & 1) != 0; };
 
-    pq2.push(startingNode);
+    // Figure out which node of the starting pair is best to leave from.
+    // Assuming the weights will never be negative in this loop
+    int firstNode = 2 * startPair;
+    std::pair<double, std::pair<int, int>> startingNode{ -1.0, { firstNode, firstNode } };
+    auto considerStart = [&](int i, int j)
+    {
+        double weight = distanceMatrix[i][j];
+        if (startingNode.first < 0 || weight < startingNode.first)
+        {
+            startingNode.first = weight;
+            startingNode.second.first = j;
+            startingNode.second.second = i;
+        }
+    };
+    for (int i = firstNode; i < firstNode + 2; i++)
+    {
+        // Every other pair is unvisited, so the first candidate is the lightest edge out of i
+        if (pCandidates && !pCandidates->neighbours(i).empty())
+        {
+            considerStart(i, *pCandidates->neighbours(i).begin());
+            continue;
+        }
+
+        for (int j = 0; j < numNodes; j++)
+        {
+            if (i == j) continue;
+            if ((i ^ 1) == j) continue;
+            considerStart(i, j);
+        }
+    }
+    markVisited(startPair);
 
-    // We get the current node we are at (top of list).
-    // If we've already been there (or to its pair) then skip it.
-    // Also if the node leading to our current node (fromNode) is not the last node we visited skip it (we could
-    // get a spanning tree otherwise).
-    // Then we add the weight to our path total and then add all other edge weights leading to
-    // new nodes to our queue.
     int lastNode = startingNode.second.second;
-    double pathWeight = 0;
-    std::vector<int> vMinPath = {lastNode};
-    while (!pq2.empty())
+    std::vector<int>& vMinPath = scratch.path;
+    vMinPath.assign(1, lastNode);
+
+    if constexpr (Stats::kEnabled)
     {
-        auto curNodePair = pq2.top();
-        pq2.pop();
+        stats.m_iStatesExpanded++;
+        stats.m_iTransitionsEvaluated += 2 * (numNodes - 2);
+        stats.m_iPrunedSamePair += 4;
+        stats.m_dSetupMs += millisecondsSince(phaseStart);
+        phaseStart = std::chrono::steady_clock::now();
+    }
 
-        int curNode = curNodePair.second.first;
-        int fromNode = curNodePair.second.second;
-        double weight = curNodePair.first;
+    // With a single pair there is nowhere to go
+    if (numPairs == 1) return 0.0;
 
-        if (visited[curNode] || visited[mapNodePairs[curNode]]) continue;
-        if (fromNode != lastNode) continue;
+    [[maybe_unused]] int numUnvisited = numPairs - 1;
 
+    int curNode = startingNode.second.first;
+    double weight = startingNode.first;
+    double pathWeight = 0;
+    while (curNode >= 0)
+    {
         vMinPath.push_back(curNode);
         pathWeight += weight;
-        visited[curNode] = true;
-        visited[mapNodePairs[curNode]] = true;
+        markVisited(curNode / 2);
         lastNode = curNode;
 
-        for (int node = 0; node < numNodes; node++)
+        if constexpr (Stats::kEnabled)
+        {
+            numUnvisited--;
+            stats.m_iStatesExpanded++;
+        }
+
+        const auto& row = distanceMatrix[lastNode];
+        curNode = -1;
+        if (pCandidates)
+        {
+            for (int node : pCandidates->neighbours(lastNode))
+            {
+                if constexpr (Stats::kEnabled) stats.m_iTransitionsEvaluated++;
+                if (isUnvisited(node / 2))
+                {
+                    weight = row[node];
+                    curNode = node;
+                    break;
+                }
+                if constexpr (Stats::kEnabled) stats.m_iPrunedPairVisited++;
+            }
+            if (curNode >= 0) continue;
+        }
+
+        if constexpr (Stats::kEnabled)
+        {
+            stats.m_iTransitionsEvaluated += 2 * numUnvisited;
+            stats.m_iPrunedPairVisited += numNodes - 2 * numUnvisited;
+        }
+
+        // Lightest edge out of the last node to a pair we haven't been to. Pairs (and so nodes) are looked at in
+        // increasing order and only a strictly lighter edge replaces the current best
+        for (std::size_t word = 0; word < unvisitedPairs.size(); word++)
+        {
+            for (std::uint64_t bits = unvisitedPairs[word]; bits != 0; bits &= bits - 1)
+            {
+                int pair = static_cast<int>(word * 64) + countTrailingZeros(bits);
+                for (int node = 2 * pair; node < 2 * pair + 2; node++)
+                {
+                    if (curNode < 0 || row[node] < weight)
+                    {
+                        weight = row[node];
+                        curNode = node;
+                    }
+                }
+            }
+        }
+    }
+
+    if constexpr (Stats::kEnabled) stats.m_dSearchMs += millisecondsSince(phaseStart);
+    return pathWeight;
+}
+
+template <typename Matrix>
+double greedyFromPair(const Matrix& distanceMatrix, int startPair, GreedyScratch& scratch, const CandidateLists* pCandidates = nullptr)
+{
+    NoStats stats;
+    return greedyFromPair(distanceMatrix, startPair, scratch, stats, pCandidates);
+}
+
+// minPath using the caller's scratch. Returns the weight (or an error value) and leaves the path in scratch.path
+template <typename Matrix, typename Stats = NoStats>
+double minPathWith(const Matrix& distanceMatrix, GreedyScratch& scratch, Stats& stats)
+{
+    int numNodes = static_cast<int>(distanceMatrix.size());
+    scratch.path.clear();
+
+    // We could assume this would never happen since the problem specifies that the graph
+    // will always be complete with an even number of nodes, but it is quick and easy to check for a
+    // odd number. We could also verify completeness by checking the size of each column to ensure
+    // we have a square matrix but I'll leave that out as an assumption of always true
+    if (numNodes % 2 != 0) return -1.0;
+
+    if (numNodes == 0) return -2.0;
+
+    // We can arbitrarily start from the first node pair (0 & 1)
+    return greedyFromPair(distanceMatrix, 0, scratch, stats);
+}
+
+template <typename Matrix>
+double minPathWith(const Matrix& distanceMatrix, GreedyScratch& scratch)
+{
+    NoStats stats;
+    return minPathWith(distanceMatrix, scratch, stats);
+}
+
+// distanceMatrix can be a std::vector<std::vector<double>> or a DistanceMatrix of doubles or floats
+template <typename Matrix>
+std::pair<double, std::vector<int>> minPath(const Matrix& distanceMatrix)
+{
+    GreedyScratch scratch;
+    double pathWeight = minPathWith(distanceMatrix, scratch);
+    return { pathWeight, scratch.path };
+}
+
+// minPath filling in stats as it goes
+template <typename Matrix>
+std::pair<double, std::vector<int>> minPath(const Matrix& distanceMatrix, SolverStats& stats)
+{
+    GreedyScratch scratch;
+    double pathWeight = minPathWith(distanceMatrix, scratch, stats);
+    return { pathWeight, scratch.path };
+}
+
+// minPath stepping through candidate lists built for distanceMatrix. Same path, same error values
+template <typename Matrix>
+std::pair<double, std::vector<int>> minPath(const Matrix& distanceMatrix, const CandidateLists& candidates)
+{
+    int numNodes = static_cast<int>(distanceMatrix.size());
+    if (numNodes % 2 != 0) return { -1.0, {} };
+    if (numNodes == 0) return { -2.0, {} };
+
+    GreedyScratch scratch;
+    double pathWeight = greedyFromPair(distanceMatrix, 0, scratch, &candidates);
+    return { pathWeight, scratch.path };
+}
+
+// minPath always starts from pair {0,1}, so how good its answer is comes down to how the nodes happen to be
+// numbered. multiStartMinPath runs the same greedy construction from every pair (or a random sample of them) across
+// a thread pool and keeps the lightest path. Pair {0,1} is always one of the starts, so the result is never worse
+// than minPath. Each thread keeps its own GreedyScratch, so nothing is allocated per start once the buffers have
+// grown, and ties go to the lowest numbered starting pair so the answer doesn't depend on the thread count.
+struct MultiStartOptions
+{
+    // Threads to run starts on (including the calling thread). 0 means one per hardware thread
+    unsigned m_numThreads = 0;
+
+    // How many starting pairs to try. 0 (or anything past the number of pairs) means all of them
+    int m_maxStarts = 0;
+
+    // Seed for choosing which pairs to start from when only trying some of them
+    unsigned m_iSeed = 0;
+
+    // Candidate lists for the matrix (see buildCandidateLists). Every start steps through them instead of scanning
+    // rows, which gives the same paths a lot quicker on big instances
+    const CandidateLists* m_pCandidates = nullptr;
+
+    // Checked before every start. Once it asks to stop the starts left are skipped (apart from pair {0,1}, so there is
+    // always a path) and the best path so far comes back
+    const SolveProgress* m_pProgress = nullptr;
+};
+
+template <typename Matrix>
+std::pair<double, std::vector<int>> multiStartMinPath(const Matrix& distanceMatrix, const MultiStartOptions& options = {})
+{
+    int numNodes = static_cast<int>(distanceMatrix.size());
+
+    // Same error values as minPath
+    if (numNodes % 2 != 0) return { -1.0, { } };
+    if (numNodes == 0) return { -2.0, { } };
+
+    int numPairs = numNodes / 2;
+    std::vector<int> startPairs(numPairs);
+    for (int i = 0; i < numPairs; i++)
+    {
+        startPairs[i] = i;
+    }
+    if (options.m_maxStarts > 0 && options.m_maxStarts < numPairs)
+    {
+        std::mt19937 rng(options.m_iSeed);
+        std::shuffle(startPairs.begin() + 1, startPairs.end(), rng);
+        startPairs.resize(options.m_maxStarts);
+    }
+
+    struct WorkerBest
+    {
+        GreedyScratch scratch;
+        double weight = std::numeric_limits<double>::infinity();
+        int startPair = -1;
+        std::vector<int> path;
+    };
+
+    ThreadPool pool(options.m_numThreads);
+    std::vector<WorkerBest> workers(pool.size());
+    pool.parallelFor(startPairs.size(), 1, [&](std::size_t begin, std::size_t end, unsigned worker)
+    {
+        WorkerBest& best = workers[worker];
+        for (std::size_t i = begin; i < end; i++)
         {
-            if (!visited[node] || !visited[mapNodePairs[node]])
+            if (i > 0 && options.m_pProgress && options.m_pProgress->stopRequested()) break;
+
+            int startPair = startPairs[i];
+            double weight = greedyFromPair(distanceMatrix, startPair, best.scratch, options.m_pCandidates);
+            if (weight < best.weight || (weight == best.weight && startPair < best.startPair))
             {
-                pq2.push({ distanceMatrix[curNode][node], {node, curNode} });
+                best.weight = weight;
+                best.startPair = startPair;
+                best.path = best.scratch.path;
             }
         }
+    });
+
+    const WorkerBest* pBest = nullptr;
+    for (const WorkerBest& worker : workers)
+    {
+        if (worker.startPair < 0) continue;
+        if (!pBest || worker.weight < pBest->weight || (worker.weight == pBest->weight && worker.startPair < pBest->startPair))
+        {
+            pBest = &worker;
+        }
     }
 
-    return { pathWeight, vMinPath };
+    return { pBest->weight, pBest->path };
 }
 
 // OPTIMAL MIN ALG STARTS HERE
 
-// I used two classes/structs for this nethod. Depending on the context of where/how small classes like this
-// might be used, you could either make a simple struct where everything is public or a more standard class
-// that properly utilizes encapsulation with private data and accessors. I've just shown both ways.
+// The first version of this method pushed (bitmask, node, path) triples onto a FIFO queue, using one bit per node.
+// That meant 2^numNodes masks and the same state being expanded again every time a cheaper order reached it.
+// Since every valid path visits exactly one node out of every pair, we only need to know which *pairs* have been
+// visited and which node the path is sitting on. That gives 2^(numNodes/2) * numNodes states and a plain
+// Held-Karp style dynamic program where each state is computed exactly once.
+//
+// I build the paths back to front: dCost[iMask][iHead] is the cheapest path that starts at iHead and visits exactly
+// one node from every pair in iMask (iHead's own pair included). To compute it we step from iHead to some node of a
+// pair still in iMask once iHead's pair is removed, which only ever reads states with one fewer pair set. Processing
+// the masks in popcount order (layer by layer) means every state we read is already final.
+// Storing the head rather than the tail means we can walk the stored "next node" links forwards from the best head
+// and, by always keeping the lowest numbered node on a tie, get the lexicographically smallest optimal path.
 
-struct NodePath
+// Number of ways to pick k of n things, i.e. how many masks live in a layer
+inline std::uint64_t binomial(int n, int k)
 {
-    NodePath(int iCurNode, int iBitMask, double weight, int numVisited, const std::vector<int> & vPath = {}) :
-        m_iCurNode{ iCurNode }, m_iBitMask{ iBitMask }, m_dWeight{ weight }, m_numVisited{ numVisited }, m_vPath{vPath}
+    if (k < 0 || k > n) return 0;
+    k = std::min(k, n - k);
+    std::uint64_t iResult = 1;
+    for (int i = 1; i <= k; i++)
     {
-        m_vPath.push_back(iCurNode);
+        iResult = iResult * static_cast<std::uint64_t>(n - k + i) / static_cast<std::uint64_t>(i);
     }
+    return iResult;
+}
 
-    int m_iCurNode;
-    int m_iBitMask;
-    double m_dWeight;
-    int m_numVisited;
-    std::vector<int> m_vPath;
-};
+// The iRank-th mask (counting from 0) that forEachMaskInLayer would visit. Lets each thread jump straight to the
+// start of its own block of a layer
+inline std::uint64_t nthMaskInLayer(int iNumPairs, int iNumBits, std::uint64_t iRank)
+{
+    std::uint64_t iMask = 0;
+    int iBit = iNumPairs - 1;
+    for (int iRemaining = iNumBits; iRemaining > 0; iRemaining--)
+    {
+        while (binomial(iBit, iRemaining) > iRank) iBit--;
+        iMask |= std::uint64_t{ 1 } << iBit;
+        iRank -= binomial(iBit, iRemaining);
+        iBit--;
+    }
+    return iMask;
+}
 
-class VisitedPathWeights
+inline std::uint64_t nextMaskInLayer(std::uint64_t iMask)
 {
-public:
-    VisitedPathWeights(int numNodes) : m_dPathWeight{ 0.0 }
+    std::uint64_t iLowBit = iMask & (~iMask + 1);
+    std::uint64_t iRipple = iMask + iLowBit;
+    return (((iRipple ^ iMask) >> 2) / iLowBit) | iRipple;
+}
+
+// Visit all masks with exactly iNumBits set (out of iNumPairs bits) in increasing order (Gosper's hack)
+template <typename Func>
+void forEachMaskInLayer(int iNumPairs, int iNumBits, Func func)
+{
+    if (iNumBits == 0)
+    {
+        func(std::uint64_t{ 0 });
+        return;
+    }
+
+    const std::uint64_t iLimit = std::uint64_t{ 1 } << iNumPairs;
+    std::uint64_t iMask = (std::uint64_t{ 1 } << iNumBits) - 1;
+    while (iMask < iLimit)
+    {
+        func(iMask);
+        iMask = nextMaskInLayer(iMask);
+    }
+}
+
+// The most the exact solvers' tables may add up to (256 TB). No machine we run on has anywhere near that, and below it
+// every table size and index works out in 64 bits without wrapping round, so an instance that needs more is turned
+// away with -3.0 before anything is allocated
+constexpr double kMaxExactTableBytes = 281474976710656.0;
+
+// All of the DP state lives in a few flat arrays (structure of arrays) that are allocated once per solve:
+// - m_vCost holds the best weight of every (iMask, iHead) state. Each mask gets a row of m_iStride weights, which is
+//   numNodes rounded up to a whole cache line, and the padding is left at infinity so it never wins a min.
+// - m_vNext holds the next node on that best path in a single byte per state (kNoNext when there isn't one).
+// - m_pDist points at the distance matrix padded the same way, so a row of distances lines up with a row of costs.
+//   A full DistanceMatrix is already laid out like that and is used in place, anything else is copied into m_vDist.
+// Everything is found with index arithmetic instead of chasing per-mask objects and vectors of flags.
+// T is the weight type (double or float) the whole solve runs in.
+template <typename T>
+struct PairDpTables
+{
+    static constexpr std::uint8_t kNoNext = 0xFF;
+
+    template <typename Matrix>
+    void reset(const Matrix& distanceMatrix)
     {
-        for (int i = 0; i < numNodes; ++i)
+        resetStates(static_cast<int>(distanceMatrix.size()));
+
+        m_vDist.assign(m_numNodes * m_iStride, T{});
+        for (int i = 0; i < m_numNodes; i++)
+        {
+            for (int j = 0; j < m_numNodes; j++)
+            {
+                m_vDist[i * m_iStride + j] = distanceMatrix[i][j];
+            }
+        }
+        m_pDist = m_vDist.data();
+    }
+
+    void reset(const DistanceMatrix<T>& distanceMatrix)
+    {
+        if (distanceMatrix.layout() != MatrixLayout::Full)
         {
-            m_vVis.push_back(false);
+            reset<DistanceMatrix<T>>(distanceMatrix);
+            return;
         }
+
+        resetStates(static_cast<int>(distanceMatrix.size()));
+        m_vDist.clear();
+        m_pDist = distanceMatrix.rowData(0);
+    }
+
+    // Bytes a numNodes solve allocates, in floating point since it is meant for sizes that don't fit in 64 bits too
+    static double memoryBytes(int numNodes)
+    {
+        double dStride = static_cast<double>(DistanceMatrix<T>::paddedStride(numNodes));
+        return std::ldexp(1.0, numNodes / 2) * (dStride * sizeof(T) + numNodes) + numNodes * dStride * sizeof(T);
     }
 
-    double getPathWeight() { return m_dPathWeight; }
-    bool isNodeVisited(int node) { return m_vVis[node]; }
+    // False if the tables of a numNodes solve would go over kMaxExactTableBytes (about 76 nodes in double and 78 in
+    // float), which also keeps the pair masks well inside 64 bits
+    static bool fits(int numNodes) { return memoryBytes(numNodes) <= kMaxExactTableBytes; }
 
-    void setPathWeight(double dWeight) { m_dPathWeight = dWeight; }
-    void setNodeVisited(int iNode, bool bIsVisit) { m_vVis[iNode] = bIsVisit; }
+    T* costRow(std::uint64_t iMask) { return m_vCost.data() + iMask * m_iStride; }
+    const T* distRow(int iNode) const { return m_pDist + iNode * m_iStride; }
+    std::uint8_t& next(std::uint64_t iMask, int iNode) { return m_vNext[iMask * m_numNodes + iNode]; }
+
+    int m_numNodes = 0;
+    int m_iNumPairs = 0;
+    std::size_t m_iStride = 0;
+    AlignedVector<T> m_vCost;
+    std::vector<std::uint8_t> m_vNext;
+    AlignedVector<T> m_vDist;
+    const T* m_pDist = nullptr;
 
 private:
-    std::vector<bool> m_vVis;
-    double m_dPathWeight;
+    void resetStates(int numNodes)
+    {
+        m_numNodes = numNodes;
+        m_iNumPairs = m_numNodes / 2;
+        m_iStride = DistanceMatrix<T>::paddedStride(m_numNodes);
+
+        std::size_t iNumMasks = std::size_t{ 1 } << m_iNumPairs;
+        m_vCost.assign(iNumMasks * m_iStride, std::numeric_limits<T>::infinity());
+        m_vNext.assign(iNumMasks * m_numNodes, kNoNext);
+    }
 };
 
-// The main idea behind the optimal min method is to use a bitmask
-// to keep track of all possible paths and then use some logic to
-// not backtrack on nodes or visit more than one node in a node pair.
-// We also track the weight of the paths as we go.
+// Every state in a layer only reads states from the layer below it, so all the masks of one layer can be worked on
+// at the same time. Each thread takes a block of masks, writes only the rows of its own masks and we wait for the
+// whole layer to finish before starting the next one. No locks are needed on the states themselves.
+struct ExactSolverOptions
+{
+    // Threads used to sweep each layer (including the calling thread). 0 means one per hardware thread
+    unsigned m_numThreads = 1;
+
+    // Widest SIMD kernel the inner loop may use. It is still capped at what the CPU supports
+    SimdLevel m_maxSimdLevel = SimdLevel::Avx512;
+
+    // Checked between layers. If it asks to stop, the solve gives up and returns -4.0 with no path
+    const SolveProgress* m_pProgress = nullptr;
+};
 
-std::pair<double, std::vector<int>> optimalMin(const std::vector<std::vector<double>>& distanceMatrix)
+inline bool stopRequested(const ExactSolverOptions& options)
 {
-    int numNodes = static_cast<int>(distanceMatrix.size());
+    return options.m_pProgress && options.m_pProgress->stopRequested();
+}
 
-    if (numNodes % 2 != 0) return { -2.0, {} };
+// The best min-plus kernel the CPU has, capped at the widest one the options allow
+template <typename T>
+MinPlusRowFn<T> exactSolverKernel(const ExactSolverOptions& options)
+{
+    return options.m_maxSimdLevel < detectSimdLevel() ? minPlusRowKernel<T>(options.m_maxSimdLevel) : minPlusRow<T>();
+}
+
+// Fill in the cost and next node of one (iMask, iHead) state. The min over the whole row is done by one of the
+// SimdKernels.h kernels; nodes of pairs that aren't in the rest of the mask (iHead's pair included) and the row
+// padding have an infinite cost so they can never win it
+template <typename T>
+inline void relaxState(PairDpTables<T>& tables, std::uint64_t iMask, int iHead, MinPlusRowFn<T> pfnMinPlusRow)
+{
+    std::uint64_t iRestMask = iMask & ~(std::uint64_t{ 1 } << (iHead / 2));
+    RowMin best = pfnMinPlusRow(tables.distRow(iHead), tables.costRow(iRestMask), tables.m_iStride);
+
+    tables.costRow(iMask)[iHead] = static_cast<T>(best.m_dValue);
+    tables.next(iMask, iHead) = best.m_iIndex < 0 ? PairDpTables<T>::kNoNext : static_cast<std::uint8_t>(best.m_iIndex);
+}
+
+// Fill in every head in iMask
+template <typename T, typename Stats>
+void relaxMask(PairDpTables<T>& tables, std::uint64_t iMask, MinPlusRowFn<T> pfnMinPlusRow, Stats& stats)
+{
+    const int numNodes = tables.m_numNodes;
+    int numHeads = 0;
+    for (int iHead = 0; iHead < numNodes; iHead++)
+    {
+        if (!(iMask & (std::uint64_t{ 1 } << (iHead / 2)))) continue;
 
-    // Vec to store all possible bitmask combinations. Store each one as a "VisitedPathWeight" so that
-    // for each potential bitmask path, we can track the smallest weight used to reach it (since the
-    // same bitmask can be hit by following nodes in different orders)
-    int numTotalPaths = (1 << numNodes) - 1;
-    std::vector<VisitedPathWeights> visited(numTotalPaths + 1, numNodes);
+        relaxState(tables, iMask, iHead, pfnMinPlusRow);
+        if constexpr (Stats::kEnabled) numHeads++;
+    }
+
+    // Every head can step to the 2 * (pairs - 1) nodes of the rest of the mask. The kernel runs over the others too
+    // but they can never win
+    if constexpr (Stats::kEnabled)
+    {
+        std::uint64_t iHeads = numHeads;
+        stats.m_iStatesExpanded += iHeads;
+        stats.m_iTransitionsEvaluated += iHeads * (iHeads - 2);
+        stats.m_iPrunedSamePair += iHeads * 2;
+        stats.m_iPrunedPairVisited += iHeads * (numNodes - iHeads);
+    }
+}
+
+// Append the best path of state (iMask, iStart) to vPath by following the next links, dropping each visited pair from
+// the mask as we go
+template <typename T>
+void readPathFrom(PairDpTables<T>& tables, std::uint64_t iMask, int iStart, std::vector<int>& vPath)
+{
+    for (int iNode = iStart; iNode != PairDpTables<T>::kNoNext; )
+    {
+        vPath.push_back(iNode);
+        int iNextNode = tables.next(iMask, iNode);
+        iMask &= ~(std::uint64_t{ 1 } << (iNode / 2));
+        iNode = iNextNode;
+    }
+}
+
+// Once every layer is filled in: the best path starts at whichever head is cheapest once every pair has been visited.
+// Returns its weight (-1 if there is none) and leaves the path in vMinPath
+template <typename T>
+double readBestPath(PairDpTables<T>& tables, std::vector<int>& vMinPath)
+{
+    vMinPath.clear();
 
-    // As previously, a map to track our node pairs
-    std::unordered_map<int, int> mapNodePairs;
-    for (int i = 0; i < numNodes; i += 2)
+    std::uint64_t iFullMask = (std::uint64_t{ 1 } << tables.m_iNumPairs) - 1;
+    const T* pFullCost = tables.costRow(iFullMask);
+    double dMinWeight = std::numeric_limits<double>::infinity();
+    int iStart = -1;
+    for (int iHead = 0; iHead < tables.m_numNodes; iHead++)
     {
-        mapNodePairs[i] = i + 1;
-        mapNodePairs[i + 1] = i;
+        if (pFullCost[iHead] < dMinWeight)
+        {
+            dMinWeight = pFullCost[iHead];
+            iStart = iHead;
+        }
     }
 
-    // Since we have to check all possible paths, I don't believe using a priority queue gives any benefit
-    // A standard FIFO queue allows for faster insertion.
-    // Store a NodePath which allows us to access the current node at the end of our path, its bitmask,
-    // the weight of said path, how many nodes we've visited, and full path itself in vector format
-    // (We could access some of this info from the stored vector but the stored vector was added later on
-    // and also it's simplier to access it from a stored variable
-    std::queue<NodePath> queue;
+    if (iStart < 0) return -1.0;
+
+    readPathFrom(tables, iFullMask, iStart, vMinPath);
+    return dMinWeight;
+}
+
+// The body of optimalMin. The tables and the path are passed in so a caller solving lots of instances (see
+// solveBatch) can keep reusing their memory instead of allocating it all again for every solve. Returns the weight
+// and leaves the path in vMinPath
+template <typename Matrix, typename Stats>
+double optimalMinWith(const Matrix& distanceMatrix, const ExactSolverOptions& options, PairDpTables<MatrixWeight<Matrix>>& tables, std::vector<int>& vMinPath,
+    Stats& stats)
+{
+    using Weight = MatrixWeight<Matrix>;
+
+    int numNodes = static_cast<int>(distanceMatrix.size());
+    vMinPath.clear();
+
+    if (numNodes % 2 != 0) return -2.0;
+
+    // Same as before, an empty matrix has no path and we return the default min weight
+    if (numNodes == 0) return -1.0;
+
+    // Tables that big can't be allocated (and their sizes wouldn't even fit in 64 bits a little further on). Same
+    // error value as the other exact solvers
+    if (!PairDpTables<Weight>::fits(numNodes)) return -3.0;
+
+    std::chrono::steady_clock::time_point phaseStart;
+    if constexpr (Stats::kEnabled) phaseStart = std::chrono::steady_clock::now();
 
-    // Add all nodes to our queue as each could start the best path
-    for (int i = 0; i < numNodes; i++)
+    // Setting up the tables is a big part of the time, so don't start on it if we've already been asked to stop
+    if (stopRequested(options)) return -4.0;
+
+    // Pairs are {0,1} {2,3} ... so node / 2 is the pair index and node ^ 1 is the other node in the pair
+    tables.reset(distanceMatrix);
+    int iNumPairs = tables.m_iNumPairs;
+
+    // Single pair masks are paths of one node with no weight
+    for (int iNode = 0; iNode < numNodes; iNode++)
     {
-        int initialMask = 1 << i;
-        queue.push({ i, initialMask, 0.0, 1 });
-        visited[initialMask].setNodeVisited(i, true);
-        visited[initialMask].setPathWeight(0.0);
+        tables.costRow(std::uint64_t{ 1 } << (iNode / 2))[iNode] = 0.0;
     }
 
-    // Assuming no negatives by using a negative weight as my default for min weight tracking
-    double dMinWeight = -1;
-    std::vector<int> vMinPath = {};
-    while (!queue.empty())
+    if constexpr (Stats::kEnabled)
     {
-        auto curNodePath = queue.front();
-        queue.pop();
+        stats.m_iStatesExpanded += numNodes;
+        for (int iLayer = 1; iLayer <= iNumPairs; iLayer++)
+        {
+            stats.m_iPeakLayerStates = std::max<std::uint64_t>(stats.m_iPeakLayerStates, binomial(iNumPairs, iLayer) * 2 * iLayer);
+        }
+        stats.m_iBytesAllocated += tables.m_vCost.size() * sizeof(Weight) + tables.m_vNext.size() + tables.m_vDist.size() * sizeof(Weight);
+        stats.m_dSetupMs += millisecondsSince(phaseStart);
+        phaseStart = std::chrono::steady_clock::now();
+    }
+
+    MinPlusRowFn<Weight> pfnMinPlusRow = exactSolverKernel<Weight>(options);
 
-        int iCurNode = curNodePath.m_iCurNode;
-        int iCurMask = curNodePath.m_iBitMask;
-        double dWeight = curNodePath.m_dWeight;
-        int iCurNumVisited = curNodePath.m_numVisited;
+    if (options.m_numThreads == 1)
+    {
+        for (int iLayer = 2; iLayer <= iNumPairs; iLayer++)
+        {
+            if (stopRequested(options)) return -4.0;
+            forEachMaskInLayer(iNumPairs, iLayer, [&](std::uint64_t iMask) { relaxMask(tables, iMask, pfnMinPlusRow, stats); });
+        }
+    }
+    else
+    {
+        // Blocks of masks are small enough to keep every thread busy on the narrow layers at either end
+        const std::size_t iMasksPerBlock = 64;
+        ThreadPool pool(options.m_numThreads);
 
-        if (iCurNumVisited == numNodes / 2)
+        // Each thread counts into its own stats so the counters don't bounce between cores
+        std::vector<Stats> vWorkerStats(Stats::kEnabled ? pool.size() : 0);
+        for (int iLayer = 2; iLayer <= iNumPairs; iLayer++)
         {
-            if (dMinWeight < 0.0 || dWeight < dMinWeight)
+            if (stopRequested(options)) return -4.0;
+            pool.parallelFor(binomial(iNumPairs, iLayer), iMasksPerBlock, [&](std::size_t iBegin, std::size_t iEnd, unsigned iWorker)
             {
-                dMinWeight = dWeight;
-                vMinPath = curNodePath.m_vPath;
-            }
+                Stats* pWorkerStats = &stats;
+                if constexpr (Stats::kEnabled) pWorkerStats = &vWorkerStats[iWorker];
+
+                std::uint64_t iMask = nthMaskInLayer(iNumPairs, iLayer, iBegin);
+                for (std::size_t iRank = iBegin; iRank < iEnd; iRank++)
+                {
+                    relaxMask(tables, iMask, pfnMinPlusRow, *pWorkerStats);
+                    iMask = nextMaskInLayer(iMask);
+                }
+            });
+        }
+        for (const Stats& workerStats : vWorkerStats)
+        {
+            stats.addCounts(workerStats);
         }
+    }
+
+    if constexpr (Stats::kEnabled)
+    {
+        stats.m_dSearchMs += millisecondsSince(phaseStart);
+        phaseStart = std::chrono::steady_clock::now();
+    }
+
+    double dMinWeight = readBestPath(tables, vMinPath);
+
+    if constexpr (Stats::kEnabled) stats.m_dReconstructMs += millisecondsSince(phaseStart);
+    return dMinWeight;
+}
+
+template <typename Matrix>
+double optimalMinWith(const Matrix& distanceMatrix, const ExactSolverOptions& options, PairDpTables<MatrixWeight<Matrix>>& tables, std::vector<int>& vMinPath)
+{
+    NoStats stats;
+    return optimalMinWith(distanceMatrix, options, tables, vMinPath, stats);
+}
+
+// SMALL FIXED SIZES START HERE
+
+// Most of the instances we get have 4 to 10 nodes, and for those setting up the tables (and the threads and kernels
+// that go with them) costs far more than the search itself. optimalMin<N> is the same DP on an N x N std::array with
+// everything worked out at compile time: which states there are, the order they have to be done in and which nodes
+// each one can step to. The transitions are then expanded into straight line code (no loops, no mask tests), nothing
+// touches the heap and the whole thing can run in a constexpr context. Ties break the same way as in optimalMin so
+// the two give exactly the same paths.
+
+// One (mask, head) state of two or more pairs and the nodes it can step to, lowest first
+template <std::size_t N>
+struct FixedSizeState
+{
+    std::size_t m_iMask = 0;
+    std::size_t m_iRestMask = 0;
+    std::size_t m_iHead = 0;
+    std::size_t m_numNext = 0;
+    std::array<std::size_t, N> m_aNext{};
+};
+
+// Every mask of l pairs has 2l heads and 2l * C(k, l) summed over all l is k * 2^k. The N heads of single pair
+// masks don't need working out
+template <std::size_t N>
+constexpr std::size_t kNumFixedSizeStates = N / 2 * (std::size_t{ 1 } << (N / 2)) - N;
+
+// The states in increasing mask order, which puts every subset of a mask (and so everything a state reads) first
+template <std::size_t N>
+constexpr std::array<FixedSizeState<N>, kNumFixedSizeStates<N>> makeFixedSizeStates()
+{
+    std::array<FixedSizeState<N>, kNumFixedSizeStates<N>> aStates{};
+    std::size_t iState = 0;
+    for (std::size_t iMask = 1; iMask < (std::size_t{ 1 } << (N / 2)); iMask++)
+    {
+        if ((iMask & (iMask - 1)) == 0) continue;
 
-        for (int node = 0; node < numNodes; node++)
+        for (std::size_t iHead = 0; iHead < N; iHead++)
         {
-            // The logic below took a lot of trial and error to work out:
-            // - If the node we are looping over is already in the path, we ignore it. I'm using std::find for this over a stored path
-            //   but there might be a way to do this using the bitmask and visited array. (I couldn't figure out how but it would save
-            //   a few seconds (the path array is size numNodes/2 at most so its not too bad)
-            // - If on our current path (checked using bitmask), we see that nodes pair has been visited, we ignore it. This
-            //   for instance stops a path of 0 -> 2 -> 1 from happening (0 -> 2 has bitmask 5 and the 0th node will be visited already)
-            // - Compute the new mask and new weight that this mask (path) will have
-            // - If the new mask (path) has already exisited/been visited where the next element on the path is node, ignore it
-            //   unless (OR) we have visited this path before but this "new" way of reaching this path (i.e. nodes in a different
-            //   order) has a lower cost.
-            // - All above satisied: we update the new path visited vecor, set its best weight, update num nodes visited and
-            //   add it to the queue
-            if (std::find(curNodePath.m_vPath.begin(), curNodePath.m_vPath.end(), node) != std::end(curNodePath.m_vPath)) continue;
-            if (visited[iCurMask].isNodeVisited(mapNodePairs[node])) continue;
+            if (!(iMask & (std::size_t{ 1 } << (iHead / 2)))) continue;
 
-            int iNewMask = iCurMask | (1 << node);
-            double dNewWeight = dWeight + distanceMatrix[iCurNode][node];
-            if (!visited[iNewMask].isNodeVisited(node) || dNewWeight < visited[iNewMask].getPathWeight())
+            FixedSizeState<N>& state = aStates[iState++];
+            state.m_iMask = iMask;
+            state.m_iRestMask = iMask & ~(std::size_t{ 1 } << (iHead / 2));
+            state.m_iHead = iHead;
+            for (std::size_t iNext = 0; iNext < N; iNext++)
             {
-                visited[iNewMask].setNodeVisited(node, true);
-                visited[iNewMask].setPathWeight(dNewWeight);
-                int newNumVisited = iCurNumVisited + 1;
-                queue.push({ node, iNewMask, dNewWeight, newNumVisited, curNodePath.m_vPath });
+                if (state.m_iRestMask & (std::size_t{ 1 } << (iNext / 2))) state.m_aNext[state.m_numNext++] = iNext;
             }
         }
     }
+    return aStates;
+}
 
-    return { dMinWeight, vMinPath };
+template <std::size_t N>
+constexpr std::array<FixedSizeState<N>, kNumFixedSizeStates<N>> kFixedSizeStates = makeFixedSizeStates<N>();
+
+// Past a few dozen states the compilers stop inlining the expanded transitions on their own and the calls end up
+// costing more than the transitions do
+#if defined(_MSC_VER)
+#define VERGE_FORCE_INLINE __forceinline
+#else
+#define VERGE_FORCE_INLINE inline __attribute__((always_inline))
+#endif
+
+// A select rather than a branch, the compares are as good as random
+template <typename T>
+VERGE_FORCE_INLINE constexpr void considerFixedSizeNext(T candidate, std::size_t iNode, T& best, int& iBestNext)
+{
+    bool bBetter = candidate < best;
+    best = bBetter ? candidate : best;
+    iBestNext = bBetter ? static_cast<int>(iNode) : iBestNext;
+}
+
+template <std::size_t N, std::size_t iState, typename T, std::size_t... iNext>
+VERGE_FORCE_INLINE constexpr void relaxFixedSizeState(const std::array<std::array<T, N>, N>& distanceMatrix, T* pCost, int* pNext, std::index_sequence<iNext...>)
+{
+    constexpr FixedSizeState<N> state = kFixedSizeStates<N>[iState];
+    T best = std::numeric_limits<T>::infinity();
+    int iBestNext = -1;
+    (considerFixedSizeNext(distanceMatrix[state.m_iHead][state.m_aNext[iNext]] + pCost[state.m_iRestMask * N + state.m_aNext[iNext]], state.m_aNext[iNext],
+        best, iBestNext), ...);
+
+    pCost[state.m_iMask * N + state.m_iHead] = best;
+    pNext[state.m_iMask * N + state.m_iHead] = iBestNext;
+}
+
+template <std::size_t N, typename T, std::size_t... iState>
+constexpr void relaxFixedSizeStates([[maybe_unused]] const std::array<std::array<T, N>, N>& distanceMatrix, [[maybe_unused]] T* pCost, [[maybe_unused]] int* pNext,
+    std::index_sequence<iState...>)
+{
+    (relaxFixedSizeState<N, iState>(distanceMatrix, pCost, pNext, std::make_index_sequence<kFixedSizeStates<N>[iState].m_numNext>{}), ...);
+}
+
+// Returns the weight and the path (one node per pair), or -1 and a path of -1s if there isn't one (-2 for odd N,
+// like optimalMin)
+template <std::size_t N, typename T>
+constexpr std::pair<double, std::array<int, N / 2>> optimalMin(const std::array<std::array<T, N>, N>& distanceMatrix)
+{
+    if constexpr (N % 2 != 0)
+    {
+        return { -2.0, {} };
+    }
+    else if constexpr (N == 0)
+    {
+        return { -1.0, {} };
+    }
+    else
+    {
+        constexpr std::size_t kFullMask = (std::size_t{ 1 } << (N / 2)) - 1;
+
+        // Only the states of nodes inside their mask are ever written or read. Single pair masks are paths of one
+        // node with no weight
+        std::array<T, (kFullMask + 1) * N> aCost{};
+        std::array<int, (kFullMask + 1) * N> aNext{};
+        for (std::size_t iNode = 0; iNode < N; iNode++)
+        {
+            aNext[(std::size_t{ 1 } << (iNode / 2)) * N + iNode] = -1;
+        }
+
+        relaxFixedSizeStates(distanceMatrix, aCost.data(), aNext.data(), std::make_index_sequence<kNumFixedSizeStates<N>>{});
+
+        double dMinWeight = std::numeric_limits<double>::infinity();
+        int iStart = -1;
+        for (std::size_t iHead = 0; iHead < N; iHead++)
+        {
+            if (aCost[kFullMask * N + iHead] < dMinWeight)
+            {
+                dMinWeight = aCost[kFullMask * N + iHead];
+                iStart = static_cast<int>(iHead);
+            }
+        }
+
+        std::array<int, N / 2> aPath{};
+        for (std::size_t i = 0; i < N / 2; i++) aPath[i] = -1;
+        if (iStart < 0) return { -1.0, aPath };
+
+        std::size_t iMask = kFullMask;
+        std::size_t iLength = 0;
+        for (int iNode = iStart; iNode >= 0; )
+        {
+            aPath[iLength++] = iNode;
+            int iNextNode = aNext[iMask * N + iNode];
+            iMask &= ~(std::size_t{ 1 } << (iNode / 2));
+            iNode = iNextNode;
+        }
+        return { dMinWeight, aPath };
+    }
+}
+
+// The largest instance optimalMin hands to optimalMin<N>. Past this the tables stop fitting comfortably on the stack
+constexpr std::size_t kMaxFixedSizeNodes = 10;
+
+// Copy a small matrix of any kind into a std::array and solve it with optimalMin<N>
+template <std::size_t N, typename Matrix>
+std::pair<double, std::vector<int>> optimalMinFixedSize(const Matrix& distanceMatrix)
+{
+    std::array<std::array<MatrixWeight<Matrix>, N>, N> aMatrix{};
+    for (std::size_t i = 0; i < N; i++)
+    {
+        for (std::size_t j = 0; j < N; j++)
+        {
+            aMatrix[i][j] = distanceMatrix[i][j];
+        }
+    }
+
+    auto result = optimalMin(aMatrix);
+    if (result.second[0] < 0) return { result.first, {} };
+    return { result.first, std::vector<int>(result.second.begin(), result.second.end()) };
+}
+
+// distanceMatrix can be a std::vector<std::vector<double>> or a DistanceMatrix. With a DistanceMatrix<float> the DP
+// tables and kernels run in float, which halves the memory and doubles the SIMD width, at float precision.
+// Instances of up to kMaxFixedSizeNodes nodes go to optimalMin<N>. Anything whose tables don't fit (see
+// PairDpTables::fits) gets -3.0 back
+template <typename Matrix>
+std::pair<double, std::vector<int>> optimalMin(const Matrix& distanceMatrix, const ExactSolverOptions& options)
+{
+    // optimalMin<N> doesn't look at the options, so an already stopped solve has to be caught here to give -4.0 back
+    // at every size
+    if (stopRequested(options)) return { -4.0, {} };
+
+    switch (distanceMatrix.size())
+    {
+    case 2: return optimalMinFixedSize<2>(distanceMatrix);
+    case 4: return optimalMinFixedSize<4>(distanceMatrix);
+    case 6: return optimalMinFixedSize<6>(distanceMatrix);
+    case 8: return optimalMinFixedSize<8>(distanceMatrix);
+    case 10: return optimalMinFixedSize<10>(distanceMatrix);
+    default: break;
+    }
+    static_assert(kMaxFixedSizeNodes == 10, "Update the cases above to match");
+
+    PairDpTables<MatrixWeight<Matrix>> tables;
+    std::vector<int> vMinPath;
+    double dMinWeight = optimalMinWith(distanceMatrix, options, tables, vMinPath);
+    return { dMinWeight, vMinPath };
+}
+
+template <typename Matrix>
+std::pair<double, std::vector<int>> optimalMin(const Matrix& distanceMatrix)
+{
+    return optimalMin(distanceMatrix, ExactSolverOptions{});
+}
+
+// optimalMin filling in stats as it goes
+template <typename Matrix>
+std::pair<double, std::vector<int>> optimalMin(const Matrix& distanceMatrix, const ExactSolverOptions& options, SolverStats& stats)
+{
+    PairDpTables<MatrixWeight<Matrix>> tables;
+    std::vector<int> vMinPath;
+    double dMinWeight = optimalMinWith(distanceMatrix, options, tables, vMinPath, stats);
+    return { dMinWeight, vMinPath };
+}
+
+// INCREMENTAL RE-SOLVE STARTS HERE
+
+// One changed entry of the distance matrix
+template <typename T>
+struct DistanceChange
+{
+    int m_iFrom;
+    int m_iTo;
+    T m_weight;
+};
+
+// Make room at iBit (everything from iBit up moves up one place) and set it
+inline std::uint64_t insertBit(std::uint64_t iMask, int iBit)
+{
+    std::uint64_t iLow = iMask & ((std::uint64_t{ 1 } << iBit) - 1);
+    return ((iMask - iLow) << 1) | (std::uint64_t{ 1 } << iBit) | iLow;
+}
+
+// The distances we get are updated in place as edge costs drift, usually only a few entries at a time, and solving
+// from scratch every time throws away almost all of the DP. This keeps the tables of the last solve around and only
+// redoes the states a set of changes can reach.
+// A state (iMask, iHead) only reads the distances out of iHead and the costs of the rest of its mask, so changing
+// d[u][v] can only touch it directly when iHead is u and v's pair is in the rest of the mask. Of those we redo the
+// ones whose best path steps to v (their cost moves with the change) and the ones where stepping to v now ties or
+// beats their best (it might take over). Every other one keeps its cost and next node exactly as they were.
+// Whenever a redone state comes out with a different cost, the states one layer up that read it (its mask plus one
+// more pair, heading from that pair) get redone too. Going through the layers bottom up like the full solve does
+// means every state is redone after everything it reads, so the result is exactly what optimalMin would return for
+// the changed matrix, path included. States are redone on the calling thread; full solves use the options.
+template <typename T = double>
+class IncrementalExactSolver
+{
+public:
+    explicit IncrementalExactSolver(const ExactSolverOptions& options = {}) : m_options(options) {}
+
+    // The tables point into m_matrix, so the solver can't be copied
+    IncrementalExactSolver(const IncrementalExactSolver&) = delete;
+    IncrementalExactSolver& operator=(const IncrementalExactSolver&) = delete;
+
+    // A full solve, with the same results as optimalMin. The matrix is copied so that resolve can change it
+    template <typename Matrix>
+    std::pair<double, std::vector<int>> solve(const Matrix& distanceMatrix)
+    {
+        std::size_t numNodes = distanceMatrix.size();
+        m_matrix = DistanceMatrix<T>(numNodes);
+        for (std::size_t i = 0; i < numNodes; i++)
+        {
+            for (std::size_t j = 0; j < numNodes; j++)
+            {
+                m_matrix.set(i, j, static_cast<T>(distanceMatrix[i][j]));
+            }
+        }
+
+        m_dMinWeight = optimalMinWith(m_matrix, m_options, m_tables, m_vMinPath);
+        // Odd (-2.0), too big (-3.0) and stopped (-4.0) solves leave no tables or half built ones, so there is nothing
+        // to resolve from. Neither is there for an empty matrix, whose -1.0 is the same as a matrix with no path
+        m_bSolved = numNodes > 0 && m_dMinWeight != -2.0 && m_dMinWeight != -3.0 && m_dMinWeight != -4.0;
+        m_vMaskChanged.assign(m_bSolved ? std::size_t{ 1 } << m_tables.m_iNumPairs : 0, 0);
+        m_iStatesRelaxed = 0;
+        return { m_dMinWeight, m_vMinPath };
+    }
+
+    // Change the entries (nodes have to be in range) and bring the solution up to date. Changes to the diagonal or
+    // within a pair go into the matrix but no path ever uses them. Until there has been a good solve this just hands
+    // back the last result
+    std::pair<double, std::vector<int>> resolve(const std::vector<DistanceChange<T>>& vChanges)
+    {
+        m_iStatesRelaxed = 0;
+        if (!m_bSolved) return { m_dMinWeight, m_vMinPath };
+
+        // Every change goes in before anything is redone so each state is redone against all of them at once
+        std::vector<DistanceChange<T>> vCrossPair;
+        for (const DistanceChange<T>& change : vChanges)
+        {
+            m_matrix.set(change.m_iFrom, change.m_iTo, change.m_weight);
+            if (change.m_iFrom / 2 != change.m_iTo / 2) vCrossPair.push_back(change);
+        }
+
+        const int iNumPairs = m_tables.m_iNumPairs;
+
+        // Each change has a look at every mask holding both of its pairs, a quarter of the table. Once there are more
+        // changes than nodes (say a whole row was rewritten) that alone costs about as much as solving from scratch,
+        // and most of the states end up being redone anyway
+        if (vCrossPair.size() > static_cast<std::size_t>(m_tables.m_numNodes))
+        {
+            m_dMinWeight = optimalMinWith(m_matrix, m_options, m_tables, m_vMinPath);
+            if (m_dMinWeight == -4.0)
+            {
+                m_bSolved = false;
+                return { m_dMinWeight, m_vMinPath };
+            }
+            for (int iLayer = 2; iLayer <= iNumPairs; iLayer++)
+            {
+                m_iStatesRelaxed += binomial(iNumPairs, iLayer) * 2 * iLayer;
+            }
+            return { m_dMinWeight, m_vMinPath };
+        }
+
+        const MinPlusRowFn<T> pfnMinPlusRow = exactSolverKernel<T>(m_options);
+
+        // Masks of the layer below / this layer where some head's cost changed
+        std::vector<std::uint64_t> vChangedBelow;
+        std::vector<std::uint64_t> vChangedHere;
+
+        auto redoState = [&](std::uint64_t iMask, int iHead)
+        {
+            T oldCost = m_tables.costRow(iMask)[iHead];
+            relaxState(m_tables, iMask, iHead, pfnMinPlusRow);
+            m_iStatesRelaxed++;
+            if (m_tables.costRow(iMask)[iHead] != oldCost && !m_vMaskChanged[iMask])
+            {
+                m_vMaskChanged[iMask] = 1;
+                vChangedHere.push_back(iMask);
+            }
+        };
+
+        for (int iLayer = 2; iLayer <= iNumPairs && (!vCrossPair.empty() || !vChangedBelow.empty()); iLayer++)
+        {
+            // States reading a cost that changed in the layer below
+            for (std::uint64_t iRestMask : vChangedBelow)
+            {
+                for (int iPair = 0; iPair < iNumPairs; iPair++)
+                {
+                    std::uint64_t iPairBit = std::uint64_t{ 1 } << iPair;
+                    if (iRestMask & iPairBit) continue;
+
+                    redoState(iRestMask | iPairBit, 2 * iPair);
+                    redoState(iRestMask | iPairBit, 2 * iPair + 1);
+                }
+            }
+
+            // States reading a changed distance. Their masks are the ones in this layer holding both pairs
+            for (const DistanceChange<T>& change : vCrossPair)
+            {
+                const int iFrom = change.m_iFrom;
+                const int iTo = change.m_iTo;
+                const T* pDist = m_tables.distRow(iFrom);
+                const std::uint64_t iFromBit = std::uint64_t{ 1 } << (iFrom / 2);
+                forEachMaskInLayer(iNumPairs - 2, iLayer - 2, [&](std::uint64_t iOthers)
+                {
+                    std::uint64_t iMask = insertBit(insertBit(iOthers, std::min(iFrom, iTo) / 2), std::max(iFrom, iTo) / 2);
+                    T candidate = pDist[iTo] + m_tables.costRow(iMask & ~iFromBit)[iTo];
+                    if (m_tables.next(iMask, iFrom) == iTo || candidate <= m_tables.costRow(iMask)[iFrom])
+                    {
+                        redoState(iMask, iFrom);
+                    }
+                });
+            }
+
+            for (std::uint64_t iMask : vChangedBelow) m_vMaskChanged[iMask] = 0;
+            std::swap(vChangedBelow, vChangedHere);
+            vChangedHere.clear();
+        }
+        for (std::uint64_t iMask : vChangedBelow) m_vMaskChanged[iMask] = 0;
+
+        m_dMinWeight = readBestPath(m_tables, m_vMinPath);
+        return { m_dMinWeight, m_vMinPath };
+    }
+
+    // The matrix as it stands after the last solve or resolve
+    const DistanceMatrix<T>& matrix() const { return m_matrix; }
+
+    // How many states the last resolve redid. A full solve does every head of every mask with at least two pairs
+    std::uint64_t statesRelaxed() const { return m_iStatesRelaxed; }
+
+private:
+    ExactSolverOptions m_options;
+    DistanceMatrix<T> m_matrix;
+    PairDpTables<T> m_tables;
+    std::vector<int> m_vMinPath;
+    double m_dMinWeight = -1.0;
+    bool m_bSolved = false;
+
+    // One flag per mask so a mask only goes on the changed list once
+    std::vector<std::uint8_t> m_vMaskChanged;
+    std::uint64_t m_iStatesRelaxed = 0;
+};
+
+// MULTI QUERY SOLVING STARTS HERE
+
+// We often ask the same matrix several questions: the best path starting in a given pair, ending in one, or keeping
+// off a given node. The DP already has most of the answers once it is built, so this keeps its tables around and
+// answers each question from them in O(numNodes) instead of solving again:
+// - The back to front tables (optimalMin's) have the best path starting at every node in their full mask row, so
+//   "starting in pair p" is the cheaper of the two nodes of p.
+// - Ending in a pair needs the same thing the other way round. Running the same DP on the transposed matrix gives
+//   the best path ending at every node (read backwards), so that is built the first time it is needed.
+// - A path keeps off node v exactly when it goes through v's other node u. The best path through u is the best
+//   path ending at u over some mask M holding u's pair joined to the best path starting at u over the rest of the
+//   pairs (plus u's pair). Going over every mask for every node costs about as much as one more layer sweep, so it
+//   is done once, along with building the transposed tables, and the best M of each node is kept.
+// Ties go the way the DP breaks them: starting in a pair gives exactly optimalMin's path among those starting there.
+template <typename T = double>
+class MultiQuerySolver
+{
+public:
+    explicit MultiQuerySolver(const ExactSolverOptions& options = {}) : m_options(options) {}
+
+    // The tables point into the matrices, so the solver can't be copied
+    MultiQuerySolver(const MultiQuerySolver&) = delete;
+    MultiQuerySolver& operator=(const MultiQuerySolver&) = delete;
+
+    // Builds the back to front tables, with the same results as optimalMin. The matrix is copied. If there are no
+    // tables to answer from (-3.0 for an instance too big for them, say) every query hands back this result
+    template <typename Matrix>
+    std::pair<double, std::vector<int>> solve(const Matrix& distanceMatrix)
+    {
+        std::size_t numNodes = distanceMatrix.size();
+        m_matrix = DistanceMatrix<T>(numNodes);
+        m_transposed = DistanceMatrix<T>(numNodes);
+        for (std::size_t i = 0; i < numNodes; i++)
+        {
+            for (std::size_t j = 0; j < numNodes; j++)
+            {
+                m_matrix.set(i, j, static_cast<T>(distanceMatrix[i][j]));
+                m_transposed.set(j, i, static_cast<T>(distanceMatrix[i][j]));
+            }
+        }
+
+        m_dMinWeight = optimalMinWith(m_matrix, m_options, m_tables, m_vMinPath);
+        m_bSolved = m_dMinWeight >= 0.0 && !m_vMinPath.empty();
+        m_bReverseBuilt = false;
+        return { m_dMinWeight, m_vMinPath };
+    }
+
+    std::pair<double, std::vector<int>> bestPath() const { return { m_dMinWeight, m_vMinPath }; }
+
+    // The best path whose first node is in iPair. -3.0 for a pair that isn't there. Until there has been a good solve
+    // these all hand back its result
+    std::pair<double, std::vector<int>> bestStartingIn(int iPair)
+    {
+        if (!m_bSolved) return bestPath();
+        if (iPair < 0 || iPair >= m_tables.m_iNumPairs) return { -3.0, {} };
+
+        int iStart = bestOfPair(m_tables, iPair);
+        std::vector<int> vPath;
+        readPathFrom(m_tables, fullMask(), iStart, vPath);
+        return { m_tables.costRow(fullMask())[iStart], vPath };
+    }
+
+    // The best path whose last node is in iPair. -4.0 if options.m_pProgress stopped the reverse tables being built
+    std::pair<double, std::vector<int>> bestEndingIn(int iPair)
+    {
+        if (!m_bSolved) return bestPath();
+        if (iPair < 0 || iPair >= m_tables.m_iNumPairs) return { -3.0, {} };
+        if (!buildReverse()) return { -4.0, {} };
+
+        int iEnd = bestOfPair(m_reverse, iPair);
+        std::vector<int> vPath;
+        readPathFrom(m_reverse, fullMask(), iEnd, vPath);
+        std::reverse(vPath.begin(), vPath.end());
+        return { m_reverse.costRow(fullMask())[iEnd], vPath };
+    }
+
+    // The best path that doesn't go through iNode, i.e. goes through the other node of its pair. -4.0 like bestEndingIn
+    std::pair<double, std::vector<int>> bestAvoiding(int iNode)
+    {
+        if (!m_bSolved) return bestPath();
+        if (iNode < 0 || iNode >= m_tables.m_numNodes) return { -3.0, {} };
+        if (!buildReverse()) return { -4.0, {} };
+
+        const int iVia = iNode ^ 1;
+        const std::uint64_t iFrontMask = m_vViaMask[iVia];
+        const std::uint64_t iBackMask = (fullMask() & ~iFrontMask) | (std::uint64_t{ 1 } << (iVia / 2));
+
+        // The front half read backwards from iVia, then the back half from iVia on
+        std::vector<int> vPath;
+        readPathFrom(m_reverse, iFrontMask, iVia, vPath);
+        std::reverse(vPath.begin(), vPath.end());
+        vPath.pop_back();
+        readPathFrom(m_tables, iBackMask, iVia, vPath);
+        return { m_vViaWeight[iVia], vPath };
+    }
+
+    const DistanceMatrix<T>& matrix() const { return m_matrix; }
+
+private:
+    // Only means anything once there has been a good solve. Until then the tables can be stale or never built, and
+    // m_iNumPairs can be anything
+    std::uint64_t fullMask() const { return m_bSolved ? (std::uint64_t{ 1 } << m_tables.m_iNumPairs) - 1 : 0; }
+
+    // The node of iPair with the cheaper full mask path, the lower one on a tie
+    int bestOfPair(PairDpTables<T>& tables, int iPair) const
+    {
+        const T* pFullCost = tables.costRow(fullMask());
+        return pFullCost[2 * iPair + 1] < pFullCost[2 * iPair] ? 2 * iPair + 1 : 2 * iPair;
+    }
+
+    // False if the progress asked the DP to stop, in which case the next query that needs them tries again
+    bool buildReverse()
+    {
+        if (m_bReverseBuilt) return true;
+
+        // Only called after a good solve, and the transposed matrix is the same size, so this can only fail by
+        // being stopped
+        std::vector<int> vPath;
+        if (optimalMinWith(m_transposed, m_options, m_reverse, vPath) == -4.0) return false;
+        m_bReverseBuilt = true;
+
+        // Every (M, u) with u's pair in M splits a path through u into the part ending at u over M and the part
+        // starting at u over the rest plus u's pair. Lowest M wins a tie
+        const int numNodes = m_tables.m_numNodes;
+        const std::uint64_t iFullMask = fullMask();
+        m_vViaWeight.assign(numNodes, std::numeric_limits<double>::infinity());
+        m_vViaMask.assign(numNodes, 0);
+        for (std::uint64_t iMask = 1; iMask <= iFullMask; iMask++)
+        {
+            const T* pFrontCost = m_reverse.costRow(iMask);
+            for (std::uint64_t iBits = iMask; iBits; iBits &= iBits - 1)
+            {
+                int iPair = countTrailingZeros(iBits);
+                const T* pBackCost = m_tables.costRow((iFullMask & ~iMask) | (std::uint64_t{ 1 } << iPair));
+                for (int iNode = 2 * iPair; iNode < 2 * iPair + 2; iNode++)
+                {
+                    T weight = pFrontCost[iNode] + pBackCost[iNode];
+                    if (weight < m_vViaWeight[iNode])
+                    {
+                        m_vViaWeight[iNode] = weight;
+                        m_vViaMask[iNode] = iMask;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    ExactSolverOptions m_options;
+    DistanceMatrix<T> m_matrix;
+    PairDpTables<T> m_tables;
+    std::vector<int> m_vMinPath;
+    double m_dMinWeight = -1.0;
+    bool m_bSolved = false;
+
+    // Built by the first query that needs them
+    bool m_bReverseBuilt = false;
+    DistanceMatrix<T> m_transposed;
+    PairDpTables<T> m_reverse;
+    std::vector<double> m_vViaWeight;
+    std::vector<std::uint64_t> m_vViaMask;
+};
+
+// TOP K PATHS STARTS HERE
+
+// Routing fallbacks need the next best paths as well as the best one. Solving again with edges banned costs a whole
+// exponential solve per path, so instead this is optimalMin's DP with every (iMask, iHead) state keeping its k
+// lightest paths (labels) in order of weight rather than just the lightest one.
+// - A label steps from iHead to a next node and carries on with one of that node's labels in the rest of the mask.
+//   Every next node's labels are already in order, so the k best candidates come out of a k-way merge. The merge
+//   keeps a row holding the best label not taken yet of every next node and takes the min of distances + row with
+//   the same SimdKernels.h kernel optimalMin uses, k times over, moving the winner's entry on to its next label each
+//   time. For the k we get (a handful) that beats a heap: it is k passes over one or two cache lines with no branches,
+//   and the first pass is exactly optimalMin's.
+// - Each label stores its next node and which of that node's labels it carries on with, so the paths are read off by
+//   following those links like readBestPath does.
+// - The weights are laid out like PairDpTables, with a padded row per (iMask, label) instead of per iMask, so the
+//   row a merge starts from is the rest of the mask's row of best labels.
+// Two labels of a state differ in their next node or in the label they carry on with, so all of the paths are
+// different. Equal weights are ordered by next node and then label, which makes the first path exactly optimalMin's.
+// Memory is k times optimalMin's, plus 2 bytes per label for the links.
+template <typename T>
+struct TopKTables
+{
+    struct Link
+    {
+        std::uint8_t m_iNext;
+        std::uint8_t m_iRank;
+    };
+    static constexpr std::uint8_t kNoNext = 0xFF;
+
+    template <typename Matrix>
+    void reset(const Matrix& distanceMatrix, std::size_t iK)
+    {
+        m_numNodes = static_cast<int>(distanceMatrix.size());
+        m_iK = iK;
+        m_iStride = DistanceMatrix<T>::paddedStride(m_numNodes);
+
+        m_vDist.assign(m_numNodes * m_iStride, T{});
+        for (int i = 0; i < m_numNodes; i++)
+        {
+            for (int j = 0; j < m_numNodes; j++)
+            {
+                m_vDist[i * m_iStride + j] = distanceMatrix[i][j];
+            }
+        }
+
+        std::size_t iNumMasks = std::size_t{ 1 } << (m_numNodes / 2);
+        m_vCost.assign(iNumMasks * m_iK * m_iStride, std::numeric_limits<T>::infinity());
+        m_vLink.assign(iNumMasks * m_numNodes * m_iK, { kNoNext, 0 });
+    }
+
+    // Bytes a numNodes solve keeping iK labels allocates, in floating point like PairDpTables::memoryBytes
+    static double memoryBytes(int numNodes, std::size_t iK)
+    {
+        double dStride = static_cast<double>(DistanceMatrix<T>::paddedStride(numNodes));
+        return std::ldexp(1.0, numNodes / 2) * static_cast<double>(iK) * (dStride * sizeof(T) + numNodes * sizeof(Link)) + numNodes * dStride * sizeof(T);
+    }
+
+    // The iRank-th best weight of every head of iMask
+    T* costRow(std::uint64_t iMask, std::size_t iRank) { return m_vCost.data() + (iMask * m_iK + iRank) * m_iStride; }
+    const T* distRow(int iNode) const { return m_vDist.data() + iNode * m_iStride; }
+    Link* links(std::uint64_t iMask, int iNode) { return m_vLink.data() + (iMask * m_numNodes + iNode) * m_iK; }
+
+    int m_numNodes = 0;
+    std::size_t m_iK = 0;
+    std::size_t m_iStride = 0;
+    AlignedVector<T> m_vCost;
+    std::vector<Link> m_vLink;
+    AlignedVector<T> m_vDist;
+};
+
+// Labels are stored in a byte, so that is as many as a state can keep
+constexpr int kMaxTopK = 255;
+
+// What a thread merges with: the best label not taken yet of each next node (a padded row, infinite once a node has
+// none left) and which label that is
+template <typename T>
+struct TopKScratch
+{
+    AlignedVector<T> m_vRow;
+    std::vector<std::uint8_t> m_vRank;
+};
+
+template <typename T>
+void topKRelaxState(TopKTables<T>& tables, std::uint64_t iMask, int iHead, MinPlusRowFn<T> pfnMinPlusRow, TopKScratch<T>& scratch)
+{
+    const std::uint64_t iRestMask = iMask & ~(std::uint64_t{ 1 } << (iHead / 2));
+    const T* pDist = tables.distRow(iHead);
+    typename TopKTables<T>::Link* pLinks = tables.links(iMask, iHead);
+
+    // A single label is just optimalMin's state, straight off the rest of the mask's row
+    if (tables.m_iK == 1)
+    {
+        RowMin best = pfnMinPlusRow(pDist, tables.costRow(iRestMask, 0), tables.m_iStride);
+        if (best.m_iIndex < 0) return;
+        tables.costRow(iMask, 0)[iHead] = static_cast<T>(best.m_dValue);
+        pLinks[0] = { static_cast<std::uint8_t>(best.m_iIndex), 0 };
+        return;
+    }
+
+    T* pRow = scratch.m_vRow.data();
+    std::copy(tables.costRow(iRestMask, 0), tables.costRow(iRestMask, 0) + tables.m_iStride, pRow);
+    std::fill(scratch.m_vRank.begin(), scratch.m_vRank.end(), std::uint8_t{ 0 });
+    for (std::size_t iRank = 0; iRank < tables.m_iK; iRank++)
+    {
+        // Labels a state doesn't have are infinite, so once the min is there are no more paths
+        RowMin best = pfnMinPlusRow(pDist, pRow, tables.m_iStride);
+        if (best.m_iIndex < 0) return;
+
+        std::uint8_t& iNextRank = scratch.m_vRank[best.m_iIndex];
+        tables.costRow(iMask, iRank)[iHead] = static_cast<T>(best.m_dValue);
+        pLinks[iRank] = { static_cast<std::uint8_t>(best.m_iIndex), iNextRank };
+
+        iNextRank++;
+        pRow[best.m_iIndex] = iNextRank < tables.m_iK ? tables.costRow(iRestMask, iNextRank)[best.m_iIndex] : std::numeric_limits<T>::infinity();
+    }
+}
+
+// The k lightest paths, lightest first (the first is optimalMin's), or fewer if the instance doesn't have k. Same
+// error values as optimalMin as a single result, -3.0 for a k outside 1 to kMaxTopK or when the tables for that k
+// would go over kMaxExactTableBytes (so the bigger k is, the smaller the instances it takes) and -4.0 if
+// options.m_pProgress asks it to stop
+template <typename Matrix>
+std::vector<std::pair<double, std::vector<int>>> optimalTopK(const Matrix& distanceMatrix, int k, const ExactSolverOptions& options = {})
+{
+    using Weight = MatrixWeight<Matrix>;
+    using Result = std::vector<std::pair<double, std::vector<int>>>;
+
+    int numNodes = static_cast<int>(distanceMatrix.size());
+    if (numNodes % 2 != 0) return Result{ { -2.0, {} } };
+    if (numNodes == 0) return Result{ { -1.0, {} } };
+    if (k < 1 || k > kMaxTopK) return Result{ { -3.0, {} } };
+    if (TopKTables<Weight>::memoryBytes(numNodes, static_cast<std::size_t>(k)) > kMaxExactTableBytes) return Result{ { -3.0, {} } };
+
+    const int iNumPairs = numNodes / 2;
+    TopKTables<Weight> tables;
+    tables.reset(distanceMatrix, static_cast<std::size_t>(k));
+
+    // Single pair masks are paths of one node with no weight, and only one of them
+    for (int iNode = 0; iNode < numNodes; iNode++)
+    {
+        tables.costRow(std::uint64_t{ 1 } << (iNode / 2), 0)[iNode] = Weight{};
+    }
+
+    MinPlusRowFn<Weight> pfnMinPlusRow = exactSolverKernel<Weight>(options);
+    ThreadPool pool(options.m_numThreads);
+    std::vector<TopKScratch<Weight>> vScratch(pool.size());
+    for (TopKScratch<Weight>& scratch : vScratch)
+    {
+        scratch.m_vRow.resize(tables.m_iStride);
+        scratch.m_vRank.resize(tables.m_iStride);
+    }
+
+    for (int iLayer = 2; iLayer <= iNumPairs; iLayer++)
+    {
+        if (stopRequested(options)) return Result{ { -4.0, {} } };
+        pool.parallelFor(binomial(iNumPairs, iLayer), 64, [&](std::size_t iBegin, std::size_t iEnd, unsigned iWorker)
+        {
+            std::uint64_t iMask = nthMaskInLayer(iNumPairs, iLayer, iBegin);
+            for (std::size_t iRank = iBegin; iRank < iEnd; iRank++)
+            {
+                for (std::uint64_t iBits = iMask; iBits; iBits &= iBits - 1)
+                {
+                    int iPair = countTrailingZeros(iBits);
+                    topKRelaxState(tables, iMask, 2 * iPair, pfnMinPlusRow, vScratch[iWorker]);
+                    topKRelaxState(tables, iMask, 2 * iPair + 1, pfnMinPlusRow, vScratch[iWorker]);
+                }
+                iMask = nextMaskInLayer(iMask);
+            }
+        });
+    }
+
+    // The same merge once more over the labels of every start node of the full mask, with no edge in front of them
+    const std::uint64_t iFullMask = (std::uint64_t{ 1 } << iNumPairs) - 1;
+    TopKScratch<Weight>& scratch = vScratch[0];
+    AlignedVector<Weight> vNoDist(tables.m_iStride, Weight{});
+    std::copy(tables.costRow(iFullMask, 0), tables.costRow(iFullMask, 0) + tables.m_iStride, scratch.m_vRow.begin());
+    std::fill(scratch.m_vRank.begin(), scratch.m_vRank.end(), std::uint8_t{ 0 });
+
+    Result vPaths;
+    while (static_cast<int>(vPaths.size()) < k)
+    {
+        RowMin best = pfnMinPlusRow(vNoDist.data(), scratch.m_vRow.data(), tables.m_iStride);
+        if (best.m_iIndex < 0) break;
+
+        std::size_t iStartRank = scratch.m_vRank[best.m_iIndex]++;
+        scratch.m_vRow[best.m_iIndex] = iStartRank + 1 < tables.m_iK ? tables.costRow(iFullMask, iStartRank + 1)[best.m_iIndex]
+            : std::numeric_limits<Weight>::infinity();
+
+        // Follow the links down, dropping each visited pair from the mask as we go
+        std::vector<int> vPath;
+        std::uint64_t iMask = iFullMask;
+        int iNode = best.m_iIndex;
+        std::size_t iRank = iStartRank;
+        while (true)
+        {
+            vPath.push_back(iNode);
+            typename TopKTables<Weight>::Link link = tables.links(iMask, iNode)[iRank];
+            if (link.m_iNext == TopKTables<Weight>::kNoNext) break;
+            iMask &= ~(std::uint64_t{ 1 } << (iNode / 2));
+            iNode = link.m_iNext;
+            iRank = link.m_iRank;
+        }
+        vPaths.push_back({ static_cast<Weight>(best.m_dValue), vPath });
+    }
+    return vPaths;
+}
+
+// MEET IN THE MIDDLE STARTS HERE
+
+// What actually stops optimalMin is memory: it keeps a row of costs and next links for every one of the 2^pairs masks.
+// This method splits the path in the middle instead. A forward table holds the best path ending at each node after
+// visiting half of the pairs and a backward table (the one optimalMin builds) the best path starting at each node and
+// visiting the other half. The best path is the best join of the two across the one edge between them.
+// - Both tables are built a layer (masks with the same number of pairs) at a time and a layer is dropped as soon as
+//   the one above it is done. Nothing above the middle is ever built. The two middle layers aren't stored either,
+//   each row of them is worked out from the layer below just before it is joined.
+// - So a layer is stored on its own, rows are found by the rank of their mask within the layer (colex, the order
+//   forEachMaskInLayer goes in) instead of by the mask itself.
+// - There are no next links. Once the best join is known, each half is solved again the same way with its ends fixed
+//   to get its path. A half has half the pairs, so that costs next to nothing next to the first pass.
+// The layers around the middle are the biggest ones, C(k, k/2) ~ 2^k / sqrt(k) masks, and nothing exact gets around
+// holding them. Peak memory is about three of those layers, so what it saves is a constant factor and not a square
+// root (about half of what optimalMin peaks at for 18 to 22 pairs), and the work is about the same.
+// The forward half adds weights up from the front of the path where optimalMin adds them up from the back, so with
+// weights that aren't whole numbers the two can differ in the last bits and may pick different paths out of a tie.
+template <typename Matrix>
+class MeetInTheMiddleSearch
+{
+public:
+    using Weight = MatrixWeight<Matrix>;
+
+    MeetInTheMiddleSearch(const Matrix& distanceMatrix, const ExactSolverOptions& options) :
+        m_distanceMatrix{ distanceMatrix }, m_iNumPairs{ static_cast<int>(distanceMatrix.size()) / 2 }, m_pfnMinPlusRow{ exactSolverKernel<Weight>(options) },
+        m_options{ options }
+    {
+        m_vBinomial.resize((m_iNumPairs + 1) * (m_iNumPairs + 1));
+        for (int n = 0; n <= m_iNumPairs; n++)
+        {
+            for (int k = 0; k <= m_iNumPairs; k++)
+            {
+                m_vBinomial[n * (m_iNumPairs + 1) + k] = binomial(n, k);
+            }
+        }
+
+        if (options.m_numThreads != 1) m_pPool = std::make_unique<ThreadPool>(options.m_numThreads);
+    }
+
+    // Peak bytes of a numNodes solve: the three layers held at once while the back half is built (see solveSegment)
+    // and the segment's two copies of the distances
+    static double peakBytes(int numNodes)
+    {
+        auto layerRows = [&](int iLayer)
+        {
+            double dRows = 1.0;
+            for (int i = 1; i <= iLayer; i++) dRows = dRows * (numNodes / 2 - iLayer + i) / i;
+            return iLayer < 1 ? 0.0 : dRows;
+        };
+        const int iFrontPairs = numNodes / 4;
+        const int iBackPairs = numNodes / 2 - iFrontPairs;
+        double dRows = layerRows(iFrontPairs - 1) + layerRows(iBackPairs - 2) + layerRows(iBackPairs - 1);
+        return (dRows + 2.0 * numNodes) * DistanceMatrix<Weight>::paddedStride(numNodes) * sizeof(Weight);
+    }
+
+    std::pair<double, std::vector<int>> run()
+    {
+        std::vector<int> vPairs(m_iNumPairs);
+        for (int iPair = 0; iPair < m_iNumPairs; iPair++) vPairs[iPair] = iPair;
+
+        std::vector<int> vMinPath;
+        m_bStopped = false;
+        double dMinWeight = solveSegment(vPairs, -1, -1, vMinPath);
+        if (m_bStopped) return { -4.0, {} };
+        if (vMinPath.empty()) return { -1.0, {} };
+        return { dMinWeight, vMinPath };
+    }
+
+private:
+    // A run of the path through some of the pairs, with its first and/or last node fixed (-1 when it is free). Nodes
+    // are numbered within the segment, 2 per pair like everywhere else, and m_vNodes maps them back to the matrix
+    struct Segment
+    {
+        int m_iNumPairs = 0;
+        std::size_t m_iStride = 0;
+        std::vector<int> m_vNodes;
+        int m_iStart = -1;
+        int m_iEnd = -1;
+
+        // The segment's distances padded like PairDpTables does it, and the same transposed so the forward table can
+        // read the edges into a node as a row
+        AlignedVector<Weight> m_vDist;
+        AlignedVector<Weight> m_vDistInto;
+
+        const Weight* distRow(int iNode) const { return m_vDist.data() + iNode * m_iStride; }
+        const Weight* distIntoRow(int iNode) const { return m_vDistInto.data() + iNode * m_iStride; }
+    };
+
+    std::size_t rankInLayer(std::uint64_t iMask) const
+    {
+        std::size_t iRank = 0;
+        for (int i = 1; iMask; i++)
+        {
+            iRank += static_cast<std::size_t>(m_vBinomial[countTrailingZeros(iMask) * (m_iNumPairs + 1) + i]);
+            iMask &= iMask - 1;
+        }
+        return iRank;
+    }
+
+    // The best weight of a path through exactly the pairs of iMask for each of its nodes, as the last node of the path
+    // (bForward) or the first. vBelow is the layer below. Nodes outside the mask are left at infinity
+    void fillRow(const Segment& segment, bool bForward, std::uint64_t iMask, const AlignedVector<Weight>& vBelow, Weight* pRow) const
+    {
+        std::fill(pRow, pRow + segment.m_iStride, std::numeric_limits<Weight>::infinity());
+
+        // Single pair masks are paths of one node with no weight. If the segment's path has to start (or end) at a
+        // node, no other node can be the first (last) one
+        const int iFixed = bForward ? segment.m_iStart : segment.m_iEnd;
+        if ((iMask & (iMask - 1)) == 0)
+        {
+            int iPair = countTrailingZeros(iMask);
+            for (int iNode = 2 * iPair; iNode < 2 * iPair + 2; iNode++)
+            {
+                if (iFixed < 0 || iFixed == iNode) pRow[iNode] = Weight{};
+            }
+            return;
+        }
+
+        for (std::uint64_t iBits = iMask; iBits; iBits &= iBits - 1)
+        {
+            int iPair = countTrailingZeros(iBits);
+            std::uint64_t iRestMask = iMask & ~(std::uint64_t{ 1 } << iPair);
+            const Weight* pRest = vBelow.data() + rankInLayer(iRestMask) * segment.m_iStride;
+            for (int iNode = 2 * iPair; iNode < 2 * iPair + 2; iNode++)
+            {
+                const Weight* pDist = bForward ? segment.distIntoRow(iNode) : segment.distRow(iNode);
+                pRow[iNode] = static_cast<Weight>(m_pfnMinPlusRow(pDist, pRest, segment.m_iStride).m_dValue);
+            }
+        }
+    }
+
+    // Build layer iLayer of one of the tables out of the layer below it
+    void fillLayer(const Segment& segment, bool bForward, int iLayer, const AlignedVector<Weight>& vBelow, AlignedVector<Weight>& vLayer, ThreadPool* pPool) const
+    {
+        // Whatever vLayer held is dead, so let it go before allocating rather than after
+        const std::size_t iNumMasks = binomial(segment.m_iNumPairs, iLayer);
+        vLayer = AlignedVector<Weight>();
+        vLayer.resize(iNumMasks * segment.m_iStride);
+        forEachRank(iNumMasks, segment.m_iNumPairs, iLayer, pPool, [&](std::size_t iRank, std::uint64_t iMask, unsigned)
+        {
+            fillRow(segment, bForward, iMask, vBelow, vLayer.data() + iRank * segment.m_iStride);
+        });
+    }
+
+    // func(rank, mask, worker) for every mask in a layer, spread over the pool in blocks like optimalMin does
+    template <typename Func>
+    static void forEachRank(std::size_t iNumMasks, int iNumPairs, int iLayer, ThreadPool* pPool, Func func)
+    {
+        auto block = [&](std::size_t iBegin, std::size_t iEnd, unsigned iWorker)
+        {
+            std::uint64_t iMask = nthMaskInLayer(iNumPairs, iLayer, iBegin);
+            for (std::size_t iRank = iBegin; iRank < iEnd; iRank++)
+            {
+                func(iRank, iMask, iWorker);
+                iMask = nextMaskInLayer(iMask);
+            }
+        };
+
+        if (pPool) pPool->parallelFor(iNumMasks, 64, block);
+        else block(0, iNumMasks, 0);
+    }
+
+    // Checked before every layer. Once it has asked to stop everything just unwinds
+    bool stopped()
+    {
+        m_bStopped = m_bStopped || stopRequested(m_options);
+        return m_bStopped;
+    }
+
+    // Solve the segment through vPairs (pairs of the whole matrix, in increasing order) that starts at iStart and
+    // ends at iEnd (nodes of the whole matrix, -1 when free). Appends its path to vPath and returns its weight
+    double solveSegment(const std::vector<int>& vPairs, int iStart, int iEnd, std::vector<int>& vPath)
+    {
+        const int iNumPairs = static_cast<int>(vPairs.size());
+        if (stopped()) return std::numeric_limits<double>::infinity();
+
+        // One pair is a single node, whichever of them the fixed ends allow
+        if (iNumPairs == 1)
+        {
+            int iNode = iStart >= 0 ? iStart : iEnd >= 0 ? iEnd : 2 * vPairs[0];
+            if (iEnd >= 0 && iEnd != iNode) return std::numeric_limits<double>::infinity();
+            vPath.push_back(iNode);
+            return 0.0;
+        }
+
+        Segment segment;
+        segment.m_iNumPairs = iNumPairs;
+        segment.m_iStride = DistanceMatrix<Weight>::paddedStride(2 * iNumPairs);
+        for (int iPair : vPairs)
+        {
+            segment.m_vNodes.push_back(2 * iPair);
+            segment.m_vNodes.push_back(2 * iPair + 1);
+        }
+        segment.m_vDist.assign(2 * iNumPairs * segment.m_iStride, Weight{});
+        segment.m_vDistInto.assign(2 * iNumPairs * segment.m_iStride, Weight{});
+        for (int i = 0; i < 2 * iNumPairs; i++)
+        {
+            if (segment.m_vNodes[i] == iStart) segment.m_iStart = i;
+            if (segment.m_vNodes[i] == iEnd) segment.m_iEnd = i;
+            for (int j = 0; j < 2 * iNumPairs; j++)
+            {
+                Weight weight = m_distanceMatrix[segment.m_vNodes[i]][segment.m_vNodes[j]];
+                segment.m_vDist[i * segment.m_iStride + j] = weight;
+                segment.m_vDistInto[j * segment.m_iStride + i] = weight;
+            }
+        }
+
+        // Only the top level is worth spreading over threads, the halves below it are tiny next to it
+        ThreadPool* pPool = iNumPairs == m_iNumPairs ? m_pPool.get() : nullptr;
+
+        // The first half of the path visits iFrontPairs pairs and the second half the rest. Build both tables up to
+        // the layer just below the one they meet at
+        const int iFrontPairs = iNumPairs / 2;
+        const int iBackPairs = iNumPairs - iFrontPairs;
+        AlignedVector<Weight> vForward;
+        AlignedVector<Weight> vBackward;
+        AlignedVector<Weight> vLayer;
+        for (int iLayer = 1; iLayer < iFrontPairs; iLayer++)
+        {
+            if (stopped()) return std::numeric_limits<double>::infinity();
+            fillLayer(segment, true, iLayer, vForward, vLayer, pPool);
+            std::swap(vForward, vLayer);
+        }
+        for (int iLayer = 1; iLayer < iBackPairs; iLayer++)
+        {
+            if (stopped()) return std::numeric_limits<double>::infinity();
+            fillLayer(segment, false, iLayer, vBackward, vLayer, pPool);
+            std::swap(vBackward, vLayer);
+        }
+        vLayer = AlignedVector<Weight>();
+        if (stopped()) return std::numeric_limits<double>::infinity();
+
+        // Every front mask meets the back mask made of the pairs it doesn't have. For each node x starting the back
+        // half the kernel finds the best node m to end the front half on (the edge m -> x included). Ties go to the
+        // lowest front mask rank, then the lowest x, then the lowest m, so the thread count doesn't change the path
+        struct Join
+        {
+            Weight m_weight = std::numeric_limits<Weight>::infinity();
+            std::size_t m_iRank = 0;
+            std::uint64_t m_iFrontMask = 0;
+            int m_iLast = -1;
+            int m_iFirst = -1;
+        };
+        const unsigned numWorkers = pPool ? pPool->size() : 1;
+        std::vector<Join> vBest(numWorkers);
+        AlignedVector<Weight> vRows(2 * numWorkers * segment.m_iStride);
+        const std::uint64_t iAllPairs = ~std::uint64_t{ 0 } >> (64 - iNumPairs);
+
+        forEachRank(binomial(iNumPairs, iFrontPairs), iNumPairs, iFrontPairs, pPool, [&](std::size_t iRank, std::uint64_t iFrontMask, unsigned iWorker)
+        {
+            Weight* pFront = vRows.data() + 2 * iWorker * segment.m_iStride;
+            Weight* pBack = pFront + segment.m_iStride;
+            fillRow(segment, true, iFrontMask, vForward, pFront);
+            fillRow(segment, false, iAllPairs & ~iFrontMask, vBackward, pBack);
+
+            Join& best = vBest[iWorker];
+            for (int iFirst = 0; iFirst < 2 * iNumPairs; iFirst++)
+            {
+                if (iFrontMask & (std::uint64_t{ 1 } << (iFirst / 2))) continue;
+
+                RowMin front = m_pfnMinPlusRow(segment.distIntoRow(iFirst), pFront, segment.m_iStride);
+                Weight weight = static_cast<Weight>(front.m_dValue) + pBack[iFirst];
+                if (front.m_iIndex >= 0 && weight < best.m_weight)
+                {
+                    best = { weight, iRank, iFrontMask, front.m_iIndex, iFirst };
+                }
+            }
+        });
+
+        Join best;
+        for (const Join& join : vBest)
+        {
+            if (join.m_iLast < 0) continue;
+            if (best.m_iLast < 0 || join.m_weight < best.m_weight || (join.m_weight == best.m_weight && join.m_iRank < best.m_iRank)) best = join;
+        }
+        if (best.m_iLast < 0) return std::numeric_limits<double>::infinity();
+
+        // Free the tables before going down into the halves
+        vForward = AlignedVector<Weight>();
+        vBackward = AlignedVector<Weight>();
+
+        std::vector<int> vFrontPairs;
+        std::vector<int> vBackPairs;
+        for (int iPair = 0; iPair < iNumPairs; iPair++)
+        {
+            (best.m_iFrontMask & (std::uint64_t{ 1 } << iPair) ? vFrontPairs : vBackPairs).push_back(vPairs[iPair]);
+        }
+        solveSegment(vFrontPairs, iStart, segment.m_vNodes[best.m_iLast], vPath);
+        solveSegment(vBackPairs, segment.m_vNodes[best.m_iFirst], iEnd, vPath);
+        return best.m_weight;
+    }
+
+    const Matrix& m_distanceMatrix;
+    int m_iNumPairs;
+    MinPlusRowFn<Weight> m_pfnMinPlusRow;
+    ExactSolverOptions m_options;
+    std::vector<std::uint64_t> m_vBinomial;
+    std::unique_ptr<ThreadPool> m_pPool;
+    bool m_bStopped = false;
+};
+
+// Same results and error values as optimalMin (see above for how the weights can differ in the last bits), including
+// -4.0 if options.m_pProgress asks it to stop. Pair masks are 64 bits, so this handles up to 128 nodes if there is the
+// memory for it. Anything bigger gets -3.0 back
+template <typename Matrix>
+std::pair<double, std::vector<int>> meetInTheMiddleMin(const Matrix& distanceMatrix, const ExactSolverOptions& options = {})
+{
+    int numNodes = static_cast<int>(distanceMatrix.size());
+    if (numNodes % 2 != 0) return { -2.0, {} };
+    if (numNodes == 0) return { -1.0, {} };
+    if (numNodes > 128) return { -3.0, {} };
+
+    MeetInTheMiddleSearch<Matrix> search(distanceMatrix, options);
+    return search.run();
+}
+
+// OUT OF CORE SOLVING STARTS HERE
+
+// optimalMin only ever reads the layer (masks with the same number of pairs) just below the one it is filling in, but
+// it holds all 2^pairs rows of costs and next links until the end so it can walk the path back out. OutOfCoreSearch
+// runs exactly the same DP but only keeps what a layer needs in memory:
+// - The costs of the layer being filled in and the one below it, with rows found by the rank of their mask within
+//   the layer (colex, like MeetInTheMiddleSearch). Every older layer's costs are dropped as soon as they are read.
+// - The next links, which are what the path is read back out of, go to a scratch file a layer at a time. A layer is
+//   written in one sequential stream on a second thread while the next layer is being filled in.
+// - Once the last layer is done the file is memory mapped (see MappedFile.h) and the path is read out of it, one
+//   lookup per layer, so only the handful of pages on the path are ever read back.
+// Memory peaks at the two widest neighbouring layers, C(k, k/2) ~ 2^k / sqrt(k) rows each, and the next links (a byte
+// per state, a lot less than the costs) go to disk. The kernel, the order things are added up in and the tie breaks
+// are all optimalMin's, so it gives exactly the same weight and path.
+struct OutOfCoreOptions
+{
+    // Where the scratch file goes. Empty means the system's temporary directory. It should be on a fast local disk
+    std::filesystem::path m_scratchDir;
+};
+
+template <typename Matrix>
+class OutOfCoreSearch
+{
+public:
+    using Weight = MatrixWeight<Matrix>;
+    static constexpr std::uint8_t kNoNext = 0xFF;
+
+    OutOfCoreSearch(const Matrix& distanceMatrix, const ExactSolverOptions& options, const OutOfCoreOptions& outOfCoreOptions) :
+        m_numNodes{ static_cast<int>(distanceMatrix.size()) }, m_iNumPairs{ m_numNodes / 2 }, m_iStride{ DistanceMatrix<Weight>::paddedStride(m_numNodes) },
+        m_pfnMinPlusRow{ exactSolverKernel<Weight>(options) }, m_options{ options }
+    {
+        m_vDist.assign(m_numNodes * m_iStride, Weight{});
+        for (int i = 0; i < m_numNodes; i++)
+        {
+            for (int j = 0; j < m_numNodes; j++)
+            {
+                m_vDist[i * m_iStride + j] = distanceMatrix[i][j];
+            }
+        }
+
+        m_vBinomial.resize((m_iNumPairs + 1) * (m_iNumPairs + 1));
+        for (int n = 0; n <= m_iNumPairs; n++)
+        {
+            for (int k = 0; k <= m_iNumPairs; k++)
+            {
+                m_vBinomial[n * (m_iNumPairs + 1) + k] = binomial(n, k);
+            }
+        }
+
+        std::error_code error;
+        std::filesystem::path dir = outOfCoreOptions.m_scratchDir.empty() ? std::filesystem::temp_directory_path(error) : outOfCoreOptions.m_scratchDir;
+        std::random_device random;
+        m_scratchPath = dir / ("vergeproject-" + std::to_string((std::uint64_t{ random() } << 32) | random()) + ".next");
+
+        if (options.m_numThreads != 1) m_pPool = std::make_unique<ThreadPool>(options.m_numThreads);
+    }
+
+    ~OutOfCoreSearch()
+    {
+        if (m_pendingWrite.valid()) m_pendingWrite.wait();
+        m_scratch.close();
+        m_nextLinks.close();
+        std::error_code error;
+        std::filesystem::remove(m_scratchPath, error);
+    }
+
+    OutOfCoreSearch(const OutOfCoreSearch&) = delete;
+    OutOfCoreSearch& operator=(const OutOfCoreSearch&) = delete;
+
+    // Peak bytes in memory for a numNodes solve: the costs and next links of the two widest neighbouring layers, and
+    // the padded copy of the distances. The layer sizes are worked out in floating point too, binomial's 64 bits run
+    // out in the middle layers of big instances
+    static double memoryBytes(int numNodes)
+    {
+        const int iNumPairs = numNodes / 2;
+        double dStride = static_cast<double>(DistanceMatrix<Weight>::paddedStride(numNodes));
+        double dPeak = 0.0;
+        double dBelow = iNumPairs;
+        for (int iLayer = 2; iLayer <= iNumPairs; iLayer++)
+        {
+            double dLayer = dBelow * (iNumPairs - iLayer + 1) / iLayer;
+            dPeak = std::max(dPeak, (dBelow + dLayer) * (dStride * sizeof(Weight) + numNodes));
+            dBelow = dLayer;
+        }
+        return dPeak + numNodes * dStride * sizeof(Weight);
+    }
+
+    // Size the scratch file grows to: a byte per state of every layer but the first
+    static double diskBytes(int numNodes)
+    {
+        return (std::ldexp(1.0, numNodes / 2) - 1.0 - numNodes / 2) * numNodes;
+    }
+
+    // Same results and error values as optimalMin, plus -5.0 if the scratch file couldn't be written or read back
+    std::pair<double, std::vector<int>> run()
+    {
+        if (stopRequested(m_options)) return { -4.0, {} };
+
+        m_scratch.open(m_scratchPath, std::ios::binary | std::ios::trunc);
+        if (!m_scratch) return { -5.0, {} };
+
+        // Single pair masks are paths of one node with no weight. Their next links are all kNoNext, so they aren't
+        // written out
+        AlignedVector<Weight> vBelow(m_iNumPairs * m_iStride, std::numeric_limits<Weight>::infinity());
+        for (int iNode = 0; iNode < m_numNodes; iNode++)
+        {
+            vBelow[(iNode / 2) * m_iStride + iNode] = Weight{};
+        }
+
+        AlignedVector<Weight> vLayer;
+        std::vector<std::uint8_t> vNext;
+        m_vLayerOffset.assign(m_iNumPairs + 1, 0);
+        std::uint64_t iOffset = 0;
+        for (int iLayer = 2; iLayer <= m_iNumPairs; iLayer++)
+        {
+            if (stopRequested(m_options)) return { -4.0, {} };
+
+            // Whatever these held is dead, so let it go before allocating rather than after
+            const std::size_t iNumMasks = binomial(m_iNumPairs, iLayer);
+            vLayer = AlignedVector<Weight>();
+            vLayer.resize(iNumMasks * m_iStride);
+            vNext.resize(iNumMasks * m_numNodes);
+            forEachRank(iNumMasks, iLayer, [&](std::size_t iRank, std::uint64_t iMask)
+            {
+                fillRow(iMask, vBelow, vLayer.data() + iRank * m_iStride, vNext.data() + iRank * m_numNodes);
+            });
+            std::swap(vBelow, vLayer);
+
+            // The layer before this one has to be on disk before its buffer is reused
+            if (!finishWrite()) return { -5.0, {} };
+            m_vLayerOffset[iLayer] = iOffset;
+            iOffset += vNext.size();
+            std::swap(vNext, m_vWriting);
+            m_pendingWrite = std::async(std::launch::async, [this]()
+            {
+                m_scratch.write(reinterpret_cast<const char*>(m_vWriting.data()), static_cast<std::streamsize>(m_vWriting.size()));
+                return static_cast<bool>(m_scratch);
+            });
+        }
+        if (!finishWrite()) return { -5.0, {} };
+        m_vWriting = std::vector<std::uint8_t>();
+        m_scratch.close();
+        if (!m_scratch) return { -5.0, {} };
+
+        // Only the full mask is left. The best path starts at whichever head is cheapest
+        const Weight* pFullCost = vBelow.data();
+        double dMinWeight = std::numeric_limits<double>::infinity();
+        int iStart = -1;
+        for (int iHead = 0; iHead < m_numNodes; iHead++)
+        {
+            if (pFullCost[iHead] < dMinWeight)
+            {
+                dMinWeight = pFullCost[iHead];
+                iStart = iHead;
+            }
+        }
+        if (iStart < 0) return { -1.0, {} };
+        vBelow = AlignedVector<Weight>();
+
+        if (m_iNumPairs > 1 && !m_nextLinks.open(m_scratchPath.string())) return { -5.0, {} };
+
+        std::vector<int> vMinPath;
+        std::uint64_t iMask = (std::uint64_t{ 1 } << m_iNumPairs) - 1;
+        for (int iLayer = m_iNumPairs, iNode = iStart; ; iLayer--)
+        {
+            vMinPath.push_back(iNode);
+            if (iLayer == 1) break;
+
+            int iNextNode = m_nextLinks.data()[m_vLayerOffset[iLayer] + rankInLayer(iMask) * m_numNodes + iNode];
+            iMask &= ~(std::uint64_t{ 1 } << (iNode / 2));
+            iNode = iNextNode;
+        }
+        return { dMinWeight, vMinPath };
+    }
+
+private:
+    std::size_t rankInLayer(std::uint64_t iMask) const
+    {
+        std::size_t iRank = 0;
+        for (int i = 1; iMask; i++)
+        {
+            iRank += static_cast<std::size_t>(m_vBinomial[countTrailingZeros(iMask) * (m_iNumPairs + 1) + i]);
+            iMask &= iMask - 1;
+        }
+        return iRank;
+    }
+
+    // optimalMin's relaxMask for one mask, reading the layer below by rank. Nodes outside the mask are left at
+    // infinity, so they can never win a min in the layer above
+    void fillRow(std::uint64_t iMask, const AlignedVector<Weight>& vBelow, Weight* pRow, std::uint8_t* pNext) const
+    {
+        std::fill(pRow, pRow + m_iStride, std::numeric_limits<Weight>::infinity());
+        std::fill(pNext, pNext + m_numNodes, kNoNext);
+        for (std::uint64_t iBits = iMask; iBits; iBits &= iBits - 1)
+        {
+            int iPair = countTrailingZeros(iBits);
+            const Weight* pRest = vBelow.data() + rankInLayer(iMask & ~(std::uint64_t{ 1 } << iPair)) * m_iStride;
+            for (int iHead = 2 * iPair; iHead < 2 * iPair + 2; iHead++)
+            {
+                RowMin best = m_pfnMinPlusRow(m_vDist.data() + iHead * m_iStride, pRest, m_iStride);
+                pRow[iHead] = static_cast<Weight>(best.m_dValue);
+                pNext[iHead] = best.m_iIndex < 0 ? kNoNext : static_cast<std::uint8_t>(best.m_iIndex);
+            }
+        }
+    }
+
+    // func(rank, mask) for every mask in a layer, spread over the pool in blocks like optimalMin does
+    template <typename Func>
+    void forEachRank(std::size_t iNumMasks, int iLayer, Func func)
+    {
+        auto block = [&](std::size_t iBegin, std::size_t iEnd, unsigned)
+        {
+            std::uint64_t iMask = nthMaskInLayer(m_iNumPairs, iLayer, iBegin);
+            for (std::size_t iRank = iBegin; iRank < iEnd; iRank++)
+            {
+                func(iRank, iMask);
+                iMask = nextMaskInLayer(iMask);
+            }
+        };
+
+        if (m_pPool) m_pPool->parallelFor(iNumMasks, 64, block);
+        else block(0, iNumMasks, 0);
+    }
+
+    // Wait for the layer being written, if there is one. False if the write failed
+    bool finishWrite()
+    {
+        return !m_pendingWrite.valid() || m_pendingWrite.get();
+    }
+
+    int m_numNodes;
+    int m_iNumPairs;
+    std::size_t m_iStride;
+    MinPlusRowFn<Weight> m_pfnMinPlusRow;
+    ExactSolverOptions m_options;
+    AlignedVector<Weight> m_vDist;
+    std::vector<std::uint64_t> m_vBinomial;
+    std::unique_ptr<ThreadPool> m_pPool;
+
+    // Where each layer's next links start in the scratch file, and the one being written out
+    std::filesystem::path m_scratchPath;
+    std::ofstream m_scratch;
+    std::vector<std::uint64_t> m_vLayerOffset;
+    std::vector<std::uint8_t> m_vWriting;
+    std::future<bool> m_pendingWrite;
+    MappedFile m_nextLinks;
+};
+
+// Same results and error values as optimalMin, including -4.0 if options.m_pProgress asks it to stop, plus -5.0 if
+// the scratch file couldn't be written or read back. Needs about OutOfCoreSearch::memoryBytes of memory and diskBytes
+// of space in the scratch directory, and gives -3.0 straight away if either is over kMaxExactTableBytes (about 80
+// nodes in double), before any layer is allocated
+template <typename Matrix>
+std::pair<double, std::vector<int>> outOfCoreMin(const Matrix& distanceMatrix, const ExactSolverOptions& options = {}, const OutOfCoreOptions& outOfCoreOptions = {})
+{
+    int numNodes = static_cast<int>(distanceMatrix.size());
+    if (numNodes % 2 != 0) return { -2.0, {} };
+    if (numNodes == 0) return { -1.0, {} };
+    if (OutOfCoreSearch<Matrix>::memoryBytes(numNodes) > kMaxExactTableBytes || OutOfCoreSearch<Matrix>::diskBytes(numNodes) > kMaxExactTableBytes)
+    {
+        return { -3.0, {} };
+    }
+
+    OutOfCoreSearch<Matrix> search(distanceMatrix, options, outOfCoreOptions);
+    return search.run();
+}
+
+// BRANCH AND BOUND ALG STARTS HERE
+
+// optimalMin has to fill in every (pair mask, node) state, which stops being possible somewhere in the 40s.
+// This method walks paths depth first instead and throws away any partial path that can't beat the best full path
+// found so far (the incumbent), so for most instances it only ever looks at a small part of the search space.
+// - The incumbent starts out as the greedy minPath result, so we can prune from the very first step.
+// - A partial path is pruned when its weight plus a lower bound on the rest of the path can't beat the incumbent.
+//   We use the bigger of two bounds that are both cheap to work out:
+//   * For every pair not visited yet, the cheapest edge that can still go into it (from the node we are on or from a
+//     node of another remaining pair). Every remaining pair has to be entered exactly once.
+//   * The minimum spanning tree over the remaining pairs plus the node we are on. The rest of the path connects all
+//     of them, so it is a spanning tree of them too.
+// - Next nodes are tried cheapest edge first, which finds good incumbents early.
+// - A fixed size table remembers the lightest weight we have reached each (pair mask, node) state with. Arriving at
+//   the same state again with a heavier path can't lead anywhere better, so that branch is dropped. The table just
+//   overwrites on a collision, so memory stays fixed no matter how big the instance is.
+// - Ties are broken towards the lexicographically smaller path and full paths are weighed by adding up their edges
+//   from the back, the same way optimalMin does, so we return exactly the same path as optimalMin. The tie break
+//   also lets us drop a partial path that can only tie with the incumbent if it already sorts after it.
+template <typename Matrix>
+class BranchAndBoundSearch
+{
+public:
+    BranchAndBoundSearch(const Matrix& distanceMatrix) :
+        m_distanceMatrix{ distanceMatrix }, m_numNodes{ static_cast<int>(distanceMatrix.size()) }, m_iNumPairs{ m_numNodes / 2 }
+    {
+        const double dInf = std::numeric_limits<double>::infinity();
+
+        // For every pair, the cheapest way into it from each node of another pair, sorted by weight
+        m_vIntoPair.resize(m_iNumPairs);
+        for (int iPair = 0; iPair < m_iNumPairs; iPair++)
+        {
+            for (int iFrom = 0; iFrom < m_numNodes; iFrom++)
+            {
+                if (iFrom / 2 == iPair) continue;
+                double dWeight = std::min(m_distanceMatrix[iFrom][2 * iPair], m_distanceMatrix[iFrom][2 * iPair + 1]);
+                m_vIntoPair[iPair].push_back({ dWeight, iFrom });
+            }
+            std::sort(m_vIntoPair[iPair].begin(), m_vIntoPair[iPair].end());
+        }
+
+        // Cheapest edge in either direction between any node of one pair and any node of another
+        m_vPairDist.assign(m_iNumPairs * m_iNumPairs, dInf);
+        for (int iFrom = 0; iFrom < m_numNodes; iFrom++)
+        {
+            for (int iTo = 0; iTo < m_numNodes; iTo++)
+            {
+                if (iFrom / 2 == iTo / 2) continue;
+                double& dPairDist = m_vPairDist[(iFrom / 2) * m_iNumPairs + iTo / 2];
+                dPairDist = std::min<double>({ dPairDist, m_distanceMatrix[iFrom][iTo], m_distanceMatrix[iTo][iFrom] });
+            }
+        }
+
+        // No point having more slots than there are states
+        m_iSeenTableSize = kMaxSeenTableSize;
+        if (m_iNumPairs < 20)
+        {
+            m_iSeenTableSize = std::min(m_iSeenTableSize, std::size_t{ 1 } << (m_iNumPairs + 6));
+        }
+        m_vSeen.assign(m_iSeenTableSize, SeenState{ 0, -1, 0.0 });
+
+        m_vPath.reserve(m_iNumPairs);
+        m_vChildren.resize(m_iNumPairs);
+        m_vTreeKey.resize(m_iNumPairs);
+        m_vTreePairs.resize(m_iNumPairs);
+    }
+
+    // Stops at the deadline (or when pProgress asks it to) if it gets there first, in which case the result is just
+    // the best path found so far (see finished()). Every better path found is offered to pProgress
+    std::pair<double, std::vector<int>> run(const std::pair<double, std::vector<int>>& incumbent,
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max(), SolveProgress* pProgress = nullptr)
+    {
+        m_vBestPath = incumbent.second;
+        m_dBestWeight = pathWeight(m_vBestPath);
+        m_deadline = deadline;
+        m_pProgress = pProgress;
+        m_bTimedOut = false;
+
+        for (int iStart = 0; iStart < m_numNodes && !m_bTimedOut; iStart++)
+        {
+            m_vPath.assign(1, iStart);
+            search(iStart, std::uint64_t{ 1 } << (iStart / 2), 0.0);
+        }
+
+        return { m_dBestWeight, m_vBestPath };
+    }
+
+    // True if the last run searched everything, i.e. its result is proven optimal
+    bool finished() const { return !m_bTimedOut; }
+
+    // About how much memory the search allocates for a numNodes instance. The table of seen states is most of it
+    static std::size_t memoryBytes(int numNodes)
+    {
+        std::size_t iNumPairs = numNodes / 2;
+        std::size_t iSeenTableSize = iNumPairs < 20 ? std::min(kMaxSeenTableSize, std::size_t{ 1 } << (iNumPairs + 6)) : kMaxSeenTableSize;
+        return iSeenTableSize * sizeof(SeenState) + 2 * numNodes * numNodes * sizeof(std::pair<double, int>) + iNumPairs * iNumPairs * sizeof(double);
+    }
+
+private:
+    // Adds the edges up from the end of the path backwards like optimalMin, so equal paths get equal weights
+    double pathWeight(const std::vector<int>& vPath) const
+    {
+        double dWeight = 0.0;
+        for (std::size_t i = vPath.size(); i-- > 1; )
+        {
+            dWeight = m_distanceMatrix[vPath[i - 1]][vPath[i]] + dWeight;
+        }
+        return dWeight;
+    }
+
+    // Sum of the cheapest usable edge into every pair not in iPairMask
+    double intoPairsBound(int iCurNode, std::uint64_t iPairMask) const
+    {
+        double dBound = 0.0;
+        for (int iPair = 0; iPair < m_iNumPairs; iPair++)
+        {
+            if (iPairMask & (std::uint64_t{ 1 } << iPair)) continue;
+
+            for (const auto& edge : m_vIntoPair[iPair])
+            {
+                if (edge.second == iCurNode || !(iPairMask & (std::uint64_t{ 1 } << (edge.second / 2))))
+                {
+                    dBound += edge.first;
+                    break;
+                }
+            }
+        }
+        return dBound;
+    }
+
+    // Prim's algorithm over the pairs not in iPairMask, with iCurNode as the root
+    double spanningTreeBound(int iCurNode, std::uint64_t iPairMask)
+    {
+        int numLeft = 0;
+        const auto& vRow = m_distanceMatrix[iCurNode];
+        for (int iPair = 0; iPair < m_iNumPairs; iPair++)
+        {
+            if (iPairMask & (std::uint64_t{ 1 } << iPair)) continue;
+            m_vTreePairs[numLeft] = iPair;
+            m_vTreeKey[numLeft] = std::min(vRow[2 * iPair], vRow[2 * iPair + 1]);
+            numLeft++;
+        }
+
+        double dBound = 0.0;
+        while (numLeft > 0)
+        {
+            int iClosest = 0;
+            for (int i = 1; i < numLeft; i++)
+            {
+                if (m_vTreeKey[i] < m_vTreeKey[iClosest]) iClosest = i;
+            }
+
+            dBound += m_vTreeKey[iClosest];
+            int iAdded = m_vTreePairs[iClosest];
+            numLeft--;
+            m_vTreePairs[iClosest] = m_vTreePairs[numLeft];
+            m_vTreeKey[iClosest] = m_vTreeKey[numLeft];
+
+            const double* pAddedDist = &m_vPairDist[iAdded * m_iNumPairs];
+            for (int i = 0; i < numLeft; i++)
+            {
+                m_vTreeKey[i] = std::min(m_vTreeKey[i], pAddedDist[m_vTreePairs[i]]);
+            }
+        }
+        return dBound;
+    }
+
+    // Is the partial path in m_vPath lexicographically before/after the same length start of the incumbent?
+    bool pathStartsBeforeBest() const
+    {
+        return std::lexicographical_compare(m_vPath.begin(), m_vPath.end(), m_vBestPath.begin(),
+            m_vBestPath.begin() + std::min(m_vPath.size(), m_vBestPath.size()));
+    }
+
+    bool pathStartsAfterBest() const
+    {
+        return std::lexicographical_compare(m_vBestPath.begin(), m_vBestPath.begin() + std::min(m_vPath.size(), m_vBestPath.size()),
+            m_vPath.begin(), m_vPath.end());
+    }
+
+    // False if we've already been at this state with a lighter path. Otherwise records this visit
+    bool firstLightestVisit(int iCurNode, std::uint64_t iPairMask, double dWeight)
+    {
+        std::uint64_t iHash = (iPairMask * 0x9E3779B97F4A7C15ull) ^ (static_cast<std::uint64_t>(iCurNode) * 0xC2B2AE3D27D4EB4Full);
+        SeenState& seen = m_vSeen[(iHash >> 32) & (m_iSeenTableSize - 1)];
+        if (seen.m_iNode == iCurNode && seen.m_iPairMask == iPairMask)
+        {
+            // Only drop paths that are heavier by more than rounding, a tie could still be lexicographically smaller
+            if (dWeight - seen.m_dWeight > 1e-12 * dWeight) return false;
+            if (dWeight >= seen.m_dWeight) return true;
+        }
+        seen = SeenState{ iPairMask, iCurNode, dWeight };
+        return true;
+    }
+
+    void search(int iCurNode, std::uint64_t iPairMask, double dWeight)
+    {
+        // Reading the clock on every call would cost more than the call does
+        if (m_bTimedOut) return;
+        if (++m_iCallsSinceClockCheck == kCallsPerClockCheck)
+        {
+            m_iCallsSinceClockCheck = 0;
+            if (std::chrono::steady_clock::now() >= m_deadline || (m_pProgress && m_pProgress->stopRequested()))
+            {
+                m_bTimedOut = true;
+                return;
+            }
+        }
+
+        int iDepth = static_cast<int>(m_vPath.size());
+        if (iDepth == m_iNumPairs)
+        {
+            double dPathWeight = pathWeight(m_vPath);
+            if (dPathWeight < m_dBestWeight || (dPathWeight == m_dBestWeight && pathStartsBeforeBest()))
+            {
+                m_dBestWeight = dPathWeight;
+                m_vBestPath = m_vPath;
+                if (m_pProgress) m_pProgress->offer(m_dBestWeight, m_vBestPath);
+            }
+            return;
+        }
+
+        // The bound is shaved down a little so that rounding in the sums can't prune the optimal path
+        double dRemaining = std::max(intoPairsBound(iCurNode, iPairMask), spanningTreeBound(iCurNode, iPairMask));
+        double dBound = (dWeight + dRemaining) * (1.0 - 1e-12);
+        if (dBound > m_dBestWeight) return;
+        if (dBound == m_dBestWeight && pathStartsAfterBest()) return;
+        if (!firstLightestVisit(iCurNode, iPairMask, dWeight)) return;
+
+        // Children are ordered by edge weight, then node number
+        std::vector<std::pair<double, int>>& vChildren = m_vChildren[iDepth];
+        vChildren.clear();
+        const auto& vRow = m_distanceMatrix[iCurNode];
+        for (int iNode = 0; iNode < m_numNodes; iNode++)
+        {
+            if (iPairMask & (std::uint64_t{ 1 } << (iNode / 2))) continue;
+            vChildren.push_back({ vRow[iNode], iNode });
+        }
+        std::sort(vChildren.begin(), vChildren.end());
+
+        for (const auto& child : vChildren)
+        {
+            m_vPath.push_back(child.second);
+            search(child.second, iPairMask | (std::uint64_t{ 1 } << (child.second / 2)), dWeight + child.first);
+            m_vPath.pop_back();
+        }
+    }
+
+    struct SeenState
+    {
+        std::uint64_t m_iPairMask;
+        int m_iNode;
+        double m_dWeight;
+    };
+    static constexpr std::size_t kMaxSeenTableSize = std::size_t{ 1 } << 20;
+    static constexpr int kCallsPerClockCheck = 4096;
+
+    const Matrix& m_distanceMatrix;
+    int m_numNodes;
+    int m_iNumPairs;
+    std::vector<std::vector<std::pair<double, int>>> m_vIntoPair;
+    std::vector<SeenState> m_vSeen;
+    std::size_t m_iSeenTableSize;
+    std::vector<double> m_vPairDist;
+
+    std::vector<int> m_vPath;
+    std::vector<std::vector<std::pair<double, int>>> m_vChildren;
+    std::vector<double> m_vTreeKey;
+    std::vector<int> m_vTreePairs;
+    double m_dBestWeight = 0.0;
+    std::vector<int> m_vBestPath;
+
+    std::chrono::steady_clock::time_point m_deadline = std::chrono::steady_clock::time_point::max();
+    SolveProgress* m_pProgress = nullptr;
+    int m_iCallsSinceClockCheck = 0;
+    bool m_bTimedOut = false;
+};
+
+// Pair masks are 64 bits here, so this handles up to 128 nodes (if the bounds are good enough to let it finish).
+// Anything bigger gets -3.0 back
+template <typename Matrix>
+std::pair<double, std::vector<int>> branchAndBoundMin(const Matrix& distanceMatrix)
+{
+    int numNodes = static_cast<int>(distanceMatrix.size());
+
+    // Same error values as optimalMin
+    if (numNodes % 2 != 0) return { -2.0, {} };
+    if (numNodes == 0) return { -1.0, {} };
+    if (numNodes > 128) return { -3.0, {} };
+
+    BranchAndBoundSearch<Matrix> search(distanceMatrix);
+    return search.run(minPath(distanceMatrix));
+}
+
+// LOCAL SEARCH STARTS HERE
+
+// minPath is fast but greedy, and optimalMin/branchAndBoundMin can't cope with thousands of nodes. improvePath sits in
+// between: it takes any valid path (normally the minPath result) and keeps applying small changes that make it
+// lighter until none of them help any more (a local optimum) or it runs out of time. The moves are:
+// - Pair swap: visit the other node of a pair instead, e.g. (0, 4, 2) -> (0, 5, 2)
+// - 2-opt: reverse a stretch of the path, e.g. (0, 4, 2, 6) -> (0, 6, 2, 4)
+// - Or-opt: move a run of 1 to 3 nodes (either way round) somewhere else in the path, e.g. (0, 4, 2, 6) -> (2, 0, 4, 6)
+// Each move only changes a handful of edges so we can tell whether it helps in O(1) without rebuilding the path.
+// Reversing a stretch flips the direction of every edge inside it, so 2-opt is only O(1) (and only used) when the
+// matrix is symmetric, which it is for the problems we get. Or-opt runs are short enough to flip on any matrix.
+// A full pass of 2-opt or Or-opt tries every position against every other one, which is O(n^2). Given candidate
+// lists (see CandidateLists) they only try the moves that bring in an edge to a candidate of a node next to the
+// change, and keep track of where every node is in the path to find them. That makes a pass O(n k), at the cost of
+// missing the odd improving move between nodes that aren't near each other.
+template <typename Matrix>
+class LocalSearch
+{
+public:
+    LocalSearch(const Matrix& distanceMatrix, std::vector<int> path, const CandidateLists* pCandidates = nullptr) :
+        m_distanceMatrix{ distanceMatrix }, m_vPath{ std::move(path) }, m_pCandidates{ pCandidates }
+    {
+        int numNodes = static_cast<int>(m_distanceMatrix.size());
+        m_bSymmetric = true;
+        for (int i = 0; i < numNodes && m_bSymmetric; i++)
+        {
+            for (int j = i + 1; j < numNodes; j++)
+            {
+                if (m_distanceMatrix[i][j] != m_distanceMatrix[j][i])
+                {
+                    m_bSymmetric = false;
+                    break;
+                }
+            }
+        }
+
+        if (m_pCandidates)
+        {
+            m_vPosition.assign(numNodes, -1);
+            updatePositions(0, static_cast<int>(m_vPath.size()));
+        }
+    }
+
+    // Keep making passes over all the moves until one finds nothing, we go past the deadline or pProgress asks us to
+    // stop (both are checked as often as each other)
+    void run(std::chrono::steady_clock::time_point deadline, const SolveProgress* pProgress = nullptr)
+    {
+        m_deadline = deadline;
+        m_pProgress = pProgress;
+        bool improved = true;
+        while (improved && !timeUp())
+        {
+            improved = false;
+            improved |= pairSwapPass();
+            if (m_bSymmetric) improved |= twoOptPass();
+            improved |= orOptPass();
+        }
+    }
+
+    const std::vector<int>& getPath() const { return m_vPath; }
+
+private:
+    // Positions outside the path give node -1, and edges to or from -1 weigh nothing. This lets the moves at either
+    // end of the path use the same delta formulas as the ones in the middle
+    int nodeAt(int pos) const { return (pos < 0 || pos >= static_cast<int>(m_vPath.size())) ? -1 : m_vPath[pos]; }
+    double edge(int from, int to) const { return (from < 0 || to < 0) ? 0.0 : m_distanceMatrix[from][to]; }
+
+    // Anything smaller than this is rounding noise and accepting it could make us go round in circles
+    static bool improves(double delta) { return delta < -1e-12; }
+
+    bool timeUp() const { return std::chrono::steady_clock::now() >= m_deadline || (m_pProgress && m_pProgress->stopRequested()); }
+
+    bool pairSwapPass()
+    {
+        bool improved = false;
+        for (int pos = 0; pos < static_cast<int>(m_vPath.size()); pos++)
+        {
+            int prev = nodeAt(pos - 1);
+            int cur = m_vPath[pos];
+            int next = nodeAt(pos + 1);
+            int other = cur ^ 1;
+
+            double delta = edge(prev, other) + edge(other, next) - edge(prev, cur) - edge(cur, next);
+            if (improves(delta))
+            {
+                replaceNode(pos, other);
+                improved = true;
+            }
+        }
+        return improved;
+    }
+
+    // Reverse m_vPath[i..j] if that makes the path lighter
+    bool tryTwoOpt(int i, int j)
+    {
+        // Reversing the whole path changes nothing on a symmetric matrix
+        if (i == 0 && j == static_cast<int>(m_vPath.size()) - 1) return false;
+
+        int before = nodeAt(i - 1);
+        int after = nodeAt(j + 1);
+        double delta = edge(before, m_vPath[j]) + edge(m_vPath[i], after) - edge(before, m_vPath[i]) - edge(m_vPath[j], after);
+        if (!improves(delta)) return false;
+
+        std::reverse(m_vPath.begin() + i, m_vPath.begin() + j + 1);
+        updatePositions(i, j + 1);
+        return true;
+    }
+
+    bool twoOptPass()
+    {
+        int size = static_cast<int>(m_vPath.size());
+        bool improved = false;
+        for (int i = 0; i < size; i++)
+        {
+            if (timeUp()) break;
+
+            if (!m_pCandidates)
+            {
+                for (int j = i + 1; j < size; j++)
+                {
+                    improved |= tryTwoOpt(i, j);
+                }
+                continue;
+            }
+
+            // The new edges are (before, m_vPath[j]) and (m_vPath[i], m_vPath[j + 1]), so look for m_vPath[j]
+            // among the candidates of the node before the stretch and m_vPath[j + 1] among those of its first node
+            if (i > 0)
+            {
+                for (int candidate : m_pCandidates->neighbours(m_vPath[i - 1]))
+                {
+                    int j = m_vPosition[candidate];
+                    if (j > i && tryTwoOpt(i, j))
+                    {
+                        improved = true;
+                        break;
+                    }
+                }
+            }
+            for (int candidate : m_pCandidates->neighbours(m_vPath[i]))
+            {
+                int j = m_vPosition[candidate] - 1;
+                if (j > i && tryTwoOpt(i, j))
+                {
+                    improved = true;
+                    break;
+                }
+            }
+        }
+        return improved;
+    }
+
+    // Move m_vPath[i..i+length-1] in between positions gap and gap + 1, possibly flipped round, if that makes the
+    // path lighter. removeDelta is what taking the run out saves and flipDelta what flipping it costs on the inside
+    bool tryMoveRun(int i, int length, int gap, double removeDelta, double flipDelta)
+    {
+        // Gaps touching the run would put it back where it came from
+        if (gap >= i - 1 && gap < i + length) return false;
+
+        int first = m_vPath[i];
+        int last = m_vPath[i + length - 1];
+        int left = nodeAt(gap);
+        int right = nodeAt(gap + 1);
+        double insertDelta = edge(left, first) + edge(last, right) - edge(left, right);
+        double insertFlippedDelta = edge(left, last) + edge(first, right) - edge(left, right) + flipDelta;
+
+        bool flip = insertFlippedDelta < insertDelta;
+        if (improves(removeDelta + (flip ? insertFlippedDelta : insertDelta)))
+        {
+            moveRun(i, length, gap, flip);
+            return true;
+        }
+
+        // A single node can also come back as the other node of its pair (an Or-opt and a pair swap in one)
+        if (length == 1)
+        {
+            int other = first ^ 1;
+            double insertOtherDelta = edge(left, other) + edge(other, right) - edge(left, right);
+            if (improves(removeDelta + insertOtherDelta))
+            {
+                replaceNode(i, other);
+                moveRun(i, length, gap, false);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool orOptPass()
+    {
+        int size = static_cast<int>(m_vPath.size());
+        bool improved = false;
+        for (int length = 1; length <= 3; length++)
+        {
+            for (int i = 0; i + length <= size; i++)
+            {
+                if (timeUp()) return improved;
+
+                int first = m_vPath[i];
+                int last = m_vPath[i + length - 1];
+                int before = nodeAt(i - 1);
+                int after = nodeAt(i + length);
+                double removeDelta = edge(before, after) - edge(before, first) - edge(last, after);
+
+                // What flipping the run round costs on the inside
+                double flipDelta = 0.0;
+                for (int k = i; k + 1 < i + length; k++)
+                {
+                    flipDelta += edge(m_vPath[k + 1], m_vPath[k]) - edge(m_vPath[k], m_vPath[k + 1]);
+                }
+
+                if (!m_pCandidates)
+                {
+                    for (int gap = -1; gap < size; gap++)
+                    {
+                        if (tryMoveRun(i, length, gap, removeDelta, flipDelta))
+                        {
+                            improved = true;
+                            break;
+                        }
+                    }
+                    continue;
+                }
+
+                // Either end of the path, or next to a candidate of either end of the run (or of the other node of
+                // a single node's pair)
+                bool moved = tryMoveRun(i, length, -1, removeDelta, flipDelta) || tryMoveRun(i, length, size - 1, removeDelta, flipDelta);
+                const int ends[3] = { first, last, length == 1 ? first ^ 1 : -1 };
+                for (int end = 0; end < 3 && !moved && ends[end] >= 0; end++)
+                {
+                    for (int candidate : m_pCandidates->neighbours(ends[end]))
+                    {
+                        int pos = m_vPosition[candidate];
+                        if (pos < 0) continue;
+                        moved = tryMoveRun(i, length, pos - 1, removeDelta, flipDelta) || tryMoveRun(i, length, pos, removeDelta, flipDelta);
+                        if (moved) break;
+                    }
+                }
+                improved |= moved;
+            }
+        }
+        return improved;
+    }
+
+    void moveRun(int i, int length, int gap, bool flip)
+    {
+        std::vector<int> run(m_vPath.begin() + i, m_vPath.begin() + i + length);
+        if (flip) std::reverse(run.begin(), run.end());
+
+        m_vPath.erase(m_vPath.begin() + i, m_vPath.begin() + i + length);
+        int insertAt = gap < i ? gap + 1 : gap + 1 - length;
+        m_vPath.insert(m_vPath.begin() + insertAt, run.begin(), run.end());
+        updatePositions(std::min(i, insertAt), std::max(i, insertAt) + length);
+    }
+
+    // Put node at pos in place of the node there (the other node of its pair)
+    void replaceNode(int pos, int node)
+    {
+        if (m_pCandidates) m_vPosition[m_vPath[pos]] = -1;
+        m_vPath[pos] = node;
+        updatePositions(pos, pos + 1);
+    }
+
+    // Only kept up to date when there are candidate lists to look up
+    void updatePositions(int begin, int end)
+    {
+        if (!m_pCandidates) return;
+        for (int pos = begin; pos < end; pos++)
+        {
+            m_vPosition[m_vPath[pos]] = pos;
+        }
+    }
+
+    const Matrix& m_distanceMatrix;
+    std::vector<int> m_vPath;
+    bool m_bSymmetric;
+    const CandidateLists* m_pCandidates;
+    std::vector<int> m_vPosition; // Where each node is in the path, -1 if it isn't
+    std::chrono::steady_clock::time_point m_deadline;
+    const SolveProgress* m_pProgress = nullptr;
+};
+
+// Improve a valid path (e.g. from minPath) with local search. Error results are passed straight back. pCandidates
+// narrows the moves down to candidate neighbours, for instances too big for full passes. If pProgress asks to stop,
+// the path as it stands is returned, like running out of time
+template <typename Matrix>
+std::pair<double, std::vector<int>> improvePath(const Matrix& distanceMatrix, const std::pair<double, std::vector<int>>& start,
+    std::chrono::milliseconds timeBudget = std::chrono::milliseconds::max(), const CandidateLists* pCandidates = nullptr,
+    const SolveProgress* pProgress = nullptr)
+{
+    if (start.first < 0.0 || start.second.empty()) return start;
+
+    auto now = std::chrono::steady_clock::now();
+    auto deadline = timeBudget >= std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::time_point::max() - now)
+        ? std::chrono::steady_clock::time_point::max() : now + timeBudget;
+
+    LocalSearch<Matrix> search(distanceMatrix, start.second, pCandidates);
+    search.run(deadline, pProgress);
+
+    const std::vector<int>& path = search.getPath();
+    double pathWeight = 0;
+    for (std::size_t i = 1; i < path.size(); i++)
+    {
+        pathWeight += distanceMatrix[path[i - 1]][path[i]];
+    }
+    return { pathWeight, path };
+}
+
+// SPARSE EXACT SEARCH STARTS HERE
+
+// optimalMin fills in every (pair mask, head) state whether it could be on the best path or not, and branch and
+// bound only remembers the states it has seen in a fixed size table that forgets them. SparseExactSearch is
+// optimalMin's back to front DP again, but it only keeps the states that could still be part of a path lighter than
+// one we already have (the incumbent):
+// - Layer 1 is every node on its own. A state of the next layer is made by stepping back from a state's head to a
+//   node of a pair it hasn't visited yet, which becomes the new head.
+// - A new state is dropped if its weight plus a lower bound on the part of the path still to come (everything before
+//   its head) is more than the incumbent. The bounds are branch and bound's two turned around, since here the path
+//   grows towards its start:
+//   * Every pair not visited yet has exactly one edge out of it, to another pair not visited yet or to the head.
+//   * Those pairs plus the head are joined up by the rest of the path, so it is a spanning tree of them.
+// - The states of a layer live in a StateHashTable (see StateHashTable.h), so the memory used goes with the number
+//   of states kept and not with 2^(numNodes/2). Pair masks are 64 bits up to 128 nodes and 128 bits up to 256.
+// - A state only needs the layer before it, so only the layer being read and the one being made are kept in tables.
+//   Instead of a next link that has to be looked up in the older layers, every state kept gets an entry in a
+//   PathArena (see PathArena.h): its head and the arena entry of the state it stepped back from. The states share
+//   their tails, so each one costs 8 bytes of path however long it is, and the best path is walked out of the arena
+//   once at the end.
+// Every state on an optimal path passes the bounds, and ties are broken the same way (lowest next node, then lowest
+// start), so when the search finishes it returns exactly the same path as optimalMin.
+// How well this does is down to the bounds: on instances with a lot of structure only a tiny part of the states is
+// ever kept, on uniformly random ones it ends up keeping most of them and is better left to optimalMin.
+struct SparseSearchOptions
+{
+    // The search gives up once it has kept this many states over all the layers (8 bytes each in the arena, plus
+    // about 60 each while they are in one of the two layers held in tables)
+    std::size_t m_iMaxStates = std::size_t{ 1 } << 24;
+};
+
+template <typename Matrix, typename Mask>
+class SparseExactSearch
+{
+public:
+    using Weight = MatrixWeight<Matrix>;
+
+    SparseExactSearch(const Matrix& distanceMatrix, const SparseSearchOptions& options = {}) :
+        m_distanceMatrix{ distanceMatrix }, m_options{ options }, m_numNodes{ static_cast<int>(distanceMatrix.size()) }, m_iNumPairs{ m_numNodes / 2 }
+    {
+        const double dInf = std::numeric_limits<double>::infinity();
+
+        // For every pair, the cheapest way out of it to each node of another pair, sorted by weight
+        m_vOutOfPair.resize(m_iNumPairs);
+        for (int iPair = 0; iPair < m_iNumPairs; iPair++)
+        {
+            for (int iTo = 0; iTo < m_numNodes; iTo++)
+            {
+                if (iTo / 2 == iPair) continue;
+                double dWeight = std::min<double>(m_distanceMatrix[2 * iPair][iTo], m_distanceMatrix[2 * iPair + 1][iTo]);
+                m_vOutOfPair[iPair].push_back({ dWeight, iTo });
+            }
+            std::sort(m_vOutOfPair[iPair].begin(), m_vOutOfPair[iPair].end());
+        }
+
+        // Cheapest edge in either direction between any node of one pair and any node of another
+        m_vPairDist.assign(m_iNumPairs * m_iNumPairs, dInf);
+        for (int iFrom = 0; iFrom < m_numNodes; iFrom++)
+        {
+            for (int iTo = 0; iTo < m_numNodes; iTo++)
+            {
+                if (iFrom / 2 == iTo / 2) continue;
+                double& dPairDist = m_vPairDist[(iFrom / 2) * m_iNumPairs + iTo / 2];
+                dPairDist = std::min<double>({ dPairDist, m_distanceMatrix[iFrom][iTo], m_distanceMatrix[iTo][iFrom] });
+            }
+        }
+
+        m_vTreeKey.resize(m_iNumPairs);
+        m_vTreePairs.resize(m_iNumPairs);
+
+        // Bounds are shaved down by more than the rounding in a sum of numNodes weights can add up to, so that it
+        // can't drop a state of the optimal path. Float weights round a lot sooner than doubles
+        m_dShave = 1.0 - 4.0 * m_numNodes * std::numeric_limits<Weight>::epsilon();
+    }
+
+    // incumbent has to be a valid path. Returns the optimal path, or the incumbent if the search gave up (see
+    // finished())
+    std::pair<double, std::vector<int>> run(const std::pair<double, std::vector<int>>& incumbent)
+    {
+        m_dBestWeight = pathWeight(incumbent.second);
+        m_arena.clear();
+        m_iStatesKept = 0;
+        m_iPeakBytes = 0;
+        m_bGaveUp = false;
+
+        m_layer = StateHashTable<Mask, SparseState>();
+        for (int iNode = 0; iNode < m_numNodes; iNode++)
+        {
+            Mask mask = withPair(Mask{}, iNode / 2);
+            if (canBeatIncumbent(mask, iNode, 0.0)) keep(m_layer, mask, iNode, Weight{}, PathArena::kNone);
+        }
+
+        for (int iLayer = 1; iLayer < m_iNumPairs && !m_bGaveUp; iLayer++)
+        {
+            StateHashTable<Mask, SparseState> nextLayer;
+            m_layer.forEach([&](const Mask& mask, int iHead, const SparseState& state)
+            {
+                for (int iNode = 0; iNode < m_numNodes && !m_bGaveUp; iNode++)
+                {
+                    if (hasPair(mask, iNode / 2)) continue;
+
+                    // Added up the same way as optimalMin's kernels, so the weights come out exactly the same
+                    Weight weight = m_distanceMatrix[iNode][iHead] + state.m_weight;
+                    if (weight * m_dShave > m_dBestWeight) continue;
+
+                    Mask nextMask = withPair(mask, iNode / 2);
+                    if (SparseState* pSeen = nextLayer.find(nextMask, iNode))
+                    {
+                        // Only the tail of the path changes, the state keeps its arena entry
+                        if (weight < pSeen->m_weight || (weight == pSeen->m_weight && iHead < m_arena.node(m_arena.rest(pSeen->m_iPath))))
+                        {
+                            pSeen->m_weight = weight;
+                            m_arena.setRest(pSeen->m_iPath, state.m_iPath);
+                        }
+                        continue;
+                    }
+                    if (canBeatIncumbent(nextMask, iNode, weight)) keep(nextLayer, nextMask, iNode, weight, state.m_iPath);
+                }
+            });
+            m_iPeakBytes = std::max(m_iPeakBytes, m_layer.memoryBytes() + nextLayer.memoryBytes() + m_arena.memoryBytes());
+            m_layer = std::move(nextLayer);
+        }
+
+        if (m_bGaveUp) return incumbent;
+        return readPath();
+    }
+
+    // False if the last run hit SparseSearchOptions::m_iMaxStates, in which case it just returned the incumbent
+    bool finished() const { return !m_bGaveUp; }
+
+    std::size_t statesKept() const { return m_iStatesKept; }
+
+    // Most memory the last run had in use at once: two layers of states and the arena
+    std::size_t memoryBytes() const { return std::max(m_iPeakBytes, m_layer.memoryBytes() + m_arena.memoryBytes()); }
+
+private:
+    struct SparseState
+    {
+        Weight m_weight;
+        PathArena::Index m_iPath; // The path from this state's head to the end
+    };
+
+    // iRest is the arena entry of the state iNode stepped back from
+    void keep(StateHashTable<Mask, SparseState>& layer, const Mask& mask, int iNode, Weight weight, PathArena::Index iRest)
+    {
+        layer.tryEmplace(mask, iNode, SparseState{ weight, m_arena.add(iNode, iRest) });
+        if (++m_iStatesKept > std::min(m_options.m_iMaxStates, PathArena::kMaxSize - 1)) m_bGaveUp = true;
+    }
+
+    // Adds the edges up from the end of the path backwards like optimalMin
+    Weight pathWeight(const std::vector<int>& vPath) const
+    {
+        Weight weight{};
+        for (std::size_t i = vPath.size(); i-- > 1; )
+        {
+            weight = m_distanceMatrix[vPath[i - 1]][vPath[i]] + weight;
+        }
+        return weight;
+    }
+
+    bool canBeatIncumbent(const Mask& mask, int iHead, double dWeight)
+    {
+        if ((dWeight + outOfPairsBound(mask, iHead)) * m_dShave > m_dBestWeight) return false;
+        return (dWeight + spanningTreeBound(mask, iHead)) * m_dShave <= m_dBestWeight;
+    }
+
+    // Sum of the cheapest usable edge out of every pair not in mask
+    double outOfPairsBound(const Mask& mask, int iHead) const
+    {
+        double dBound = 0.0;
+        for (int iPair = 0; iPair < m_iNumPairs; iPair++)
+        {
+            if (hasPair(mask, iPair)) continue;
+
+            for (const auto& edge : m_vOutOfPair[iPair])
+            {
+                if (edge.second == iHead || !hasPair(mask, edge.second / 2))
+                {
+                    dBound += edge.first;
+                    break;
+                }
+            }
+        }
+        return dBound;
+    }
+
+    // Prim's algorithm over the pairs not in mask, with iHead as the root
+    double spanningTreeBound(const Mask& mask, int iHead)
+    {
+        int numLeft = 0;
+        for (int iPair = 0; iPair < m_iNumPairs; iPair++)
+        {
+            if (hasPair(mask, iPair)) continue;
+            m_vTreePairs[numLeft] = iPair;
+            m_vTreeKey[numLeft] = std::min<double>(m_distanceMatrix[2 * iPair][iHead], m_distanceMatrix[2 * iPair + 1][iHead]);
+            numLeft++;
+        }
+
+        double dBound = 0.0;
+        while (numLeft > 0)
+        {
+            int iClosest = 0;
+            for (int i = 1; i < numLeft; i++)
+            {
+                if (m_vTreeKey[i] < m_vTreeKey[iClosest]) iClosest = i;
+            }
+
+            dBound += m_vTreeKey[iClosest];
+            int iAdded = m_vTreePairs[iClosest];
+            numLeft--;
+            m_vTreePairs[iClosest] = m_vTreePairs[numLeft];
+            m_vTreeKey[iClosest] = m_vTreeKey[numLeft];
+
+            const double* pAddedDist = &m_vPairDist[iAdded * m_iNumPairs];
+            for (int i = 0; i < numLeft; i++)
+            {
+                m_vTreeKey[i] = std::min(m_vTreeKey[i], pAddedDist[m_vTreePairs[i]]);
+            }
+        }
+        return dBound;
+    }
+
+    // The cheapest state of the last layer (lowest head on a tie), walked out of the arena
+    std::pair<double, std::vector<int>> readPath() const
+    {
+        int iStart = -1;
+        Weight bestWeight{};
+        PathArena::Index iBestPath = PathArena::kNone;
+        m_layer.forEach([&](const Mask&, int iHead, const SparseState& state)
+        {
+            if (iStart < 0 || state.m_weight < bestWeight || (state.m_weight == bestWeight && iHead < iStart))
+            {
+                iStart = iHead;
+                bestWeight = state.m_weight;
+                iBestPath = state.m_iPath;
+            }
+        });
+
+        // The incumbent's own states always pass the bounds, so this can only happen if the weights aren't numbers
+        if (iStart < 0) return { -1.0, {} };
+        return { bestWeight, m_arena.path(iBestPath) };
+    }
+
+    const Matrix& m_distanceMatrix;
+    SparseSearchOptions m_options;
+    int m_numNodes;
+    int m_iNumPairs;
+    std::vector<std::vector<std::pair<double, int>>> m_vOutOfPair;
+    std::vector<double> m_vPairDist;
+    std::vector<double> m_vTreeKey;
+    std::vector<int> m_vTreePairs;
+    double m_dShave;
+
+    double m_dBestWeight = 0.0;
+    StateHashTable<Mask, SparseState> m_layer;
+    PathArena m_arena;
+    std::size_t m_iStatesKept = 0;
+    std::size_t m_iPeakBytes = 0;
+    bool m_bGaveUp = false;
+};
+
+// Exact up to 256 nodes, as long as the bounds leave few enough states to keep. The incumbent comes from
+// improvePath(minPath). Same error values as optimalMin, plus -3.0 over 256 nodes and -4.0 if the search kept more
+// than options.m_iMaxStates states and gave up
+template <typename Matrix>
+std::pair<double, std::vector<int>> sparseExactMin(const Matrix& distanceMatrix, const SparseSearchOptions& options = {})
+{
+    int numNodes = static_cast<int>(distanceMatrix.size());
+    if (numNodes % 2 != 0) return { -2.0, {} };
+    if (numNodes == 0) return { -1.0, {} };
+    if (numNodes > 2 * kMaxMaskPairs<PairMask128>) return { -3.0, {} };
+
+    auto incumbent = improvePath(distanceMatrix, minPath(distanceMatrix));
+    if (numNodes <= 2 * kMaxMaskPairs<std::uint64_t>)
+    {
+        SparseExactSearch<Matrix, std::uint64_t> search(distanceMatrix, options);
+        auto best = search.run(incumbent);
+        return search.finished() ? best : std::pair<double, std::vector<int>>{ -4.0, {} };
+    }
+
+    SparseExactSearch<Matrix, PairMask128> search(distanceMatrix, options);
+    auto best = search.run(incumbent);
+    return search.finished() ? best : std::pair<double, std::vector<int>>{ -4.0, {} };
+}
+
+// SOLVER SELECTION STARTS HERE
+
+// Which of the solvers a solve() call ran
+enum class SolveEngine
+{
+    None,              // The instance was odd or empty, the weight says which (same values as optimalMin)
+    Optimal,           // optimalMin
+    MeetInTheMiddle,   // meetInTheMiddleMin
+    BranchAndBound,    // branch and bound, starting from the heuristic's path
+    Heuristic,         // multiStartMinPath followed by improvePath
+};
+
+inline const char* solveEngineName(SolveEngine engine)
+{
+    switch (engine)
+    {
+    case SolveEngine::Optimal: return "optimal";
+    case SolveEngine::MeetInTheMiddle: return "mitm";
+    case SolveEngine::BranchAndBound: return "bnb";
+    case SolveEngine::Heuristic: return "heuristic";
+    default: return "none";
+    }
+}
+
+struct SolveOptions
+{
+    // The most the solver may allocate (the matrix itself not included)
+    std::size_t m_iMemoryBudget = std::size_t{ 1 } << 30;
+
+    // How long the call may take. An exact solver is only picked if it should finish within this, and branch and bound
+    // and the local search stop when it runs out. With no limit branch and bound runs until it has proved its answer
+    std::chrono::milliseconds m_timeBudget = std::chrono::milliseconds::max();
+
+    // Threads (including the calling thread). 0 means one per hardware thread
+    unsigned m_numThreads = 1;
+
+    // Gets every better path as it is found and can stop the solve early (see solveAsync)
+    SolveProgress* m_pProgress = nullptr;
+};
+
+struct SolveResult
+{
+    double m_dWeight = -1.0;
+    std::vector<int> m_vPath;
+    SolveEngine m_engine = SolveEngine::None;
+    bool m_bProvenOptimal = false;
+};
+
+// Every (pair mask, head) state of the exact solvers is one kernel pass over a padded row of weights. Depending on the
+// SIMD level and how much of the tables fit in cache we see 0.6 to 2.5 ns per weight, so take the slow end
+constexpr double kExactNsPerWeight = 2.5;
+
+inline double exactSolveMs(int numNodes, unsigned numThreads)
+{
+    double dStates = (numNodes / 2) * std::ldexp(1.0, numNodes / 2);
+    return dStates * DistanceMatrix<double>::paddedStride(numNodes) * kExactNsPerWeight / 1e6 / numThreads;
+}
+
+// The heuristic runs greedy from this many start pairs at most, which keeps it at a few times the cost of one
+// minPath on even the biggest instances
+constexpr int kHeuristicStarts = 16;
+
+// Any path visits every pair, so it joins them all up and weighs at least as much as a minimum spanning tree over the
+// pairs (with the cheapest edge between two pairs, either way, as their distance). O(numNodes^2) like minPath
+template <typename Matrix>
+double pathLowerBound(const Matrix& distanceMatrix)
+{
+    int iNumPairs = static_cast<int>(distanceMatrix.size()) / 2;
+    auto pairDist = [&](int iFrom, int iTo)
+    {
+        double dDist = std::numeric_limits<double>::infinity();
+        for (int i = 2 * iFrom; i < 2 * iFrom + 2; i++)
+        {
+            for (int j = 2 * iTo; j < 2 * iTo + 2; j++)
+            {
+                dDist = std::min<double>({ dDist, distanceMatrix[i][j], distanceMatrix[j][i] });
+            }
+        }
+        return dDist;
+    };
+
+    // Prim's algorithm from pair 0
+    std::vector<int> vTreePairs;
+    std::vector<double> vTreeKey;
+    for (int iPair = 1; iPair < iNumPairs; iPair++)
+    {
+        vTreePairs.push_back(iPair);
+        vTreeKey.push_back(pairDist(0, iPair));
+    }
+
+    double dBound = 0.0;
+    while (!vTreePairs.empty())
+    {
+        std::size_t iClosest = std::min_element(vTreeKey.begin(), vTreeKey.end()) - vTreeKey.begin();
+        dBound += vTreeKey[iClosest];
+        int iAdded = vTreePairs[iClosest];
+        vTreePairs[iClosest] = vTreePairs.back();
+        vTreeKey[iClosest] = vTreeKey.back();
+        vTreePairs.pop_back();
+        vTreeKey.pop_back();
+
+        for (std::size_t i = 0; i < vTreePairs.size(); i++)
+        {
+            vTreeKey[i] = std::min(vTreeKey[i], pairDist(iAdded, vTreePairs[i]));
+        }
+    }
+    return dBound;
+}
+
+// One call for any instance that never allocates more than the budget or goes (much) past the deadline:
+// - optimalMin if its tables fit and it should finish in time, which covers all the small instances,
+// - else meetInTheMiddleMin if that fits, at about half the memory,
+// - else (up to 128 nodes, the limit of the 64 bit pair masks) branch and bound until the deadline, starting from the
+//   heuristic's path. If it gets through the whole search its answer is proven optimal, if not it is the best found,
+// - else just the heuristic.
+// The result says which one ran and whether the weight is proven optimal.
+// With options.m_pProgress it starts by offering it the minPath result and pathLowerBound, so there is an answer
+// straight away, and offers it every better path after that. If it asks to stop, the best path so far comes back at
+// the next check (a layer of the exact solvers, a few thousand branch and bound calls, or the end of the heuristic).
+template <typename Matrix>
+SolveResult solve(const Matrix& distanceMatrix, const SolveOptions& options = {})
+{
+    using Weight = MatrixWeight<Matrix>;
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = options.m_timeBudget >= std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::time_point::max() - start)
+        ? std::chrono::steady_clock::time_point::max() : start + options.m_timeBudget;
+
+    SolveResult result;
+    int numNodes = static_cast<int>(distanceMatrix.size());
+    if (numNodes % 2 != 0 || numNodes == 0)
+    {
+        result.m_dWeight = numNodes % 2 != 0 ? -2.0 : -1.0;
+        return result;
+    }
+
+    SolveProgress* pProgress = options.m_pProgress;
+    auto finish = [&](const std::pair<double, std::vector<int>>& solution, SolveEngine engine, bool bProvenOptimal)
+    {
+        result.m_dWeight = solution.first;
+        result.m_vPath = solution.second;
+        result.m_engine = engine;
+        result.m_bProvenOptimal = bProvenOptimal;
+        if (pProgress)
+        {
+            pProgress->offer(result.m_dWeight, result.m_vPath);
+            if (bProvenOptimal) pProgress->raiseLowerBound(result.m_dWeight);
+        }
+        return result;
+    };
+
+    // Stopped early: hand back the best path so far, which the greedy start below makes sure there is
+    std::pair<double, std::vector<int>> greedy;
+    auto stopped = [&]()
+    {
+        auto incumbent = pProgress->incumbent();
+        return finish(incumbent.second.empty() ? greedy : incumbent, SolveEngine::Heuristic, false);
+    };
+    if (pProgress)
+    {
+        greedy = minPath(distanceMatrix);
+        pProgress->offer(greedy.first, greedy.second);
+        pProgress->raiseLowerBound(pathLowerBound(distanceMatrix));
+        if (pProgress->stopRequested()) return stopped();
+    }
+
+    const double dMemoryBudget = static_cast<double>(options.m_iMemoryBudget);
+    if (numNodes <= 128)
+    {
+        unsigned numThreads = options.m_numThreads ? options.m_numThreads : std::max(1u, std::thread::hardware_concurrency());
+        bool bInTime = deadline == std::chrono::steady_clock::time_point::max()
+            || exactSolveMs(numNodes, numThreads) <= std::chrono::duration<double, std::milli>(options.m_timeBudget).count();
+
+        ExactSolverOptions exactOptions;
+        exactOptions.m_numThreads = options.m_numThreads;
+        exactOptions.m_pProgress = pProgress;
+
+        if (bInTime && PairDpTables<Weight>::memoryBytes(numNodes) <= dMemoryBudget)
+        {
+            auto optimal = optimalMin(distanceMatrix, exactOptions);
+            if (optimal.first == -4.0) return stopped();
+            return finish(optimal, SolveEngine::Optimal, true);
+        }
+        if (bInTime && MeetInTheMiddleSearch<Matrix>::peakBytes(numNodes) <= dMemoryBudget)
+        {
+            auto optimal = meetInTheMiddleMin(distanceMatrix, exactOptions);
+            if (optimal.first == -4.0) return stopped();
+            return finish(optimal, SolveEngine::MeetInTheMiddle, true);
+        }
+    }
+
+    // On big instances the greedy starts and local search passes all go through candidate lists, which keeps them
+    // close to linear in the number of nodes
+    CandidateLists candidates;
+    const CandidateLists* pCandidates = nullptr;
+    if (numNodes >= kCandidateListMinNodes)
+    {
+        candidates = buildCandidateLists(distanceMatrix, kDefaultCandidates, options.m_numThreads);
+        pCandidates = &candidates;
+    }
+
+    MultiStartOptions multiStartOptions;
+    multiStartOptions.m_numThreads = options.m_numThreads;
+    multiStartOptions.m_maxStarts = kHeuristicStarts;
+    multiStartOptions.m_pCandidates = pCandidates;
+    multiStartOptions.m_pProgress = pProgress;
+    auto now = std::chrono::steady_clock::now();
+    auto timeLeft = deadline == std::chrono::steady_clock::time_point::max() ? std::chrono::milliseconds::max()
+        : std::chrono::duration_cast<std::chrono::milliseconds>(std::max(deadline - now, std::chrono::steady_clock::duration::zero()));
+    auto heuristic = improvePath(distanceMatrix, multiStartMinPath(distanceMatrix, multiStartOptions), timeLeft, pCandidates, pProgress);
+    if (pProgress)
+    {
+        pProgress->offer(heuristic.first, heuristic.second);
+        if (pProgress->stopRequested()) return stopped();
+    }
+
+    if (numNodes <= 128 && static_cast<double>(BranchAndBoundSearch<Matrix>::memoryBytes(numNodes)) <= dMemoryBudget
+        && std::chrono::steady_clock::now() < deadline)
+    {
+        BranchAndBoundSearch<Matrix> search(distanceMatrix);
+        auto best = search.run(heuristic, deadline, pProgress);
+        return finish(best, SolveEngine::BranchAndBound, search.finished());
+    }
+
+    return finish(heuristic, SolveEngine::Heuristic, false);
+}
+
+// ASYNC SOLVING STARTS HERE
+
+// A request handler can't sit in solve() for as long as the instance needs, it has to answer within its own deadline.
+// solveAsync runs solve() on a thread of its own and hands back a SolveHandle straight away. While it runs the handle
+// gives the best path so far (there is one almost at once, see solve()) and a lower bound on the optimal weight, so
+// the caller can answer with whatever is there when it has to, or stop the solve early with cancel(). Or just wait for
+// the result. options.m_timeBudget still applies, and onImproved is called (on the solve's thread) for every better
+// path. The handle owns the thread: destroying it cancels the solve and waits for it to stop.
+class SolveHandle
+{
+public:
+    SolveHandle(std::shared_ptr<SolveProgress> pProgress, std::future<SolveResult> result) :
+        m_pProgress{ std::move(pProgress) }, m_result{ std::move(result) }
+    {
+    }
+
+    SolveHandle(SolveHandle&&) = default;
+    SolveHandle& operator=(SolveHandle&&) = delete;
+
+    ~SolveHandle()
+    {
+        if (m_result.valid())
+        {
+            m_pProgress->cancel();
+            m_result.wait();
+        }
+    }
+
+    // The solve stops at its next check and returns the best path it has (not proven optimal)
+    void cancel() { m_pProgress->cancel(); }
+
+    bool ready() const { return m_result.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+
+    // True if the result is ready
+    template <typename Rep, typename Period>
+    bool waitFor(std::chrono::duration<Rep, Period> timeout) const { return m_result.wait_for(timeout) == std::future_status::ready; }
+
+    // Waits for the result. Can only be called once
+    SolveResult get() { return m_result.get(); }
+
+    // The best path so far, { -1.0, {} } until there is one
+    std::pair<double, std::vector<int>> incumbent() const { return m_pProgress->incumbent(); }
+
+    // -infinity until there is one, the optimal weight once it is proven
+    double lowerBound() const { return m_pProgress->lowerBound(); }
+
+private:
+    std::shared_ptr<SolveProgress> m_pProgress;
+    std::future<SolveResult> m_result;
+};
+
+// The matrix is taken by value so it can't go away under the solve. Pass a DistanceMatrix view (see
+// DistanceMatrix::view) to share the weights without copying them
+template <typename Matrix>
+SolveHandle solveAsync(Matrix distanceMatrix, const SolveOptions& options = {}, SolveProgress::Callback onImproved = {})
+{
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = options.m_timeBudget >= std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::time_point::max() - start)
+        ? std::chrono::steady_clock::time_point::max() : start + options.m_timeBudget;
+    auto pProgress = std::make_shared<SolveProgress>(deadline, std::move(onImproved));
+
+    SolveOptions solveOptions = options;
+    solveOptions.m_pProgress = pProgress.get();
+    std::future<SolveResult> result = std::async(std::launch::async, [pProgress, solveOptions, distanceMatrix = std::move(distanceMatrix)]
+    {
+        return solve(distanceMatrix, solveOptions);
+    });
+    return SolveHandle(std::move(pProgress), std::move(result));
+}
+
+// BATCH SOLVING STARTS HERE
+
+// For lots of small independent instances the cost of a single solve is mostly setting it up: starting threads,
+// allocating the DP tables and the path. solveBatch solves a whole array of matrices at once instead:
+// - One thread pool for the whole batch. Instances are handed out with ThreadPool::stealingFor, so each thread works
+//   through its own share without touching shared state and only steals from another thread once it runs dry. That
+//   keeps every core busy even when some instances are much bigger than others.
+// - Each thread keeps its own GreedyScratch/PairDpTables for the whole batch. They only ever grow, so once they are
+//   big enough for the largest instance nothing else is allocated for the tables.
+// - Results go into an array the caller owns. Each result's path is assigned in place, so handing in the same
+//   results array again for the next batch reuses its memory too.
+// Each instance is solved on a single thread, this is about instances per second and not how long one takes.
+enum class BatchMethod
+{
+    Greedy,
+    Optimal,
+};
+
+struct BatchOptions
+{
+    // Threads to solve on (including the calling thread). 0 means one per hardware thread
+    unsigned m_numThreads = 0;
+
+    BatchMethod m_method = BatchMethod::Optimal;
+
+    // Instances a thread takes at a time from its own share of the batch
+    std::size_t m_iGrain = 16;
+
+    // Widest SIMD kernel the optimal solves may use
+    SimdLevel m_maxSimdLevel = SimdLevel::Avx512;
+};
+
+// Solve pMatrices[0 .. count) into pResults[0 .. count) on the given pool. Each result is exactly what minPath or
+// optimalMin would return for that matrix, error values included
+template <typename Matrix>
+void solveBatch(ThreadPool& pool, const Matrix* pMatrices, std::size_t count, std::pair<double, std::vector<int>>* pResults,
+    const BatchOptions& options = {})
+{
+    struct alignas(64) WorkerScratch
+    {
+        GreedyScratch greedy;
+        PairDpTables<MatrixWeight<Matrix>> tables;
+    };
+    std::vector<WorkerScratch> workers(pool.size());
+
+    ExactSolverOptions exactOptions;
+    exactOptions.m_numThreads = 1;
+    exactOptions.m_maxSimdLevel = options.m_maxSimdLevel;
+
+    pool.stealingFor(count, options.m_iGrain, [&](std::size_t begin, std::size_t end, unsigned worker)
+    {
+        WorkerScratch& scratch = workers[worker];
+        for (std::size_t i = begin; i < end; i++)
+        {
+            std::pair<double, std::vector<int>>& result = pResults[i];
+            if (options.m_method == BatchMethod::Greedy)
+            {
+                result.first = minPathWith(pMatrices[i], scratch.greedy);
+                result.second.assign(scratch.greedy.path.begin(), scratch.greedy.path.end());
+            }
+            else
+            {
+                result.first = optimalMinWith(pMatrices[i], exactOptions, scratch.tables, result.second);
+            }
+        }
+    });
+}
+
+// Same as above with a pool of options.m_numThreads threads just for this batch
+template <typename Matrix>
+void solveBatch(const Matrix* pMatrices, std::size_t count, std::pair<double, std::vector<int>>* pResults, const BatchOptions& options = {})
+{
+    ThreadPool pool(options.m_numThreads);
+    solveBatch(pool, pMatrices, count, pResults, options);
+}
+
+// COMMAND LINE DRIVER STARTS HERE
+
+// A whole number command line value between iMin and iMax. Returns false (and leaves value alone) for anything else,
+// including trailing junk, out of range values and negative values for an unsigned T. Outside the #ifndef below so
+// the benchmark can parse its options the same way
+template <typename T>
+bool parseWholeNumber(const std::string& sText, T iMin, T iMax, T& value)
+{
+    static_assert(std::is_integral_v<T>, "Only for whole numbers");
+    try
+    {
+        std::size_t iUsed = 0;
+        if constexpr (std::is_signed_v<T>)
+        {
+            long long iValue = std::stoll(sText, &iUsed);
+            if (iUsed != sText.size() || iValue < iMin || iValue > iMax) return false;
+            value = static_cast<T>(iValue);
+        }
+        else
+        {
+            // stoull would happily wrap "-1" round to a huge number
+            if (sText.find('-') != std::string::npos) return false;
+            unsigned long long iValue = std::stoull(sText, &iUsed);
+            if (iUsed != sText.size() || iValue < iMin || iValue > iMax) return false;
+            value = static_cast<T>(iValue);
+        }
+        return true;
+    }
+    catch (const std::logic_error&)
+    {
+        // std::invalid_argument for no number at all, std::out_of_range for one too big for a long long
+        return false;
+    }
+}
+
+// The exact DP needs 2^(numNodes/2) * numNodes states, which is already gigabytes at this size. Meeting in the middle
+// needs about the same at one more pair. Out of core, the two middle layers at 52 nodes are about what the whole table
+// is at 48. Outside the #ifndef below so the benchmark caps its sizes the same way
+const std::size_t kMaxOptimalNodes = 48;
+const std::size_t kMaxMeetInTheMiddleNodes = 50;
+const std::size_t kMaxOutOfCoreNodes = 52;
+
+// Anything that wants the solvers without this main (the benchmark) defines VERGEPROJECT_NO_MAIN before including
+// this file
+#ifndef VERGEPROJECT_NO_MAIN
+
+// VergeProject [--solver NAME] [--threads N] [--memory MB] [--time MS] [--scratch DIR] [--stats] <instance file or directory>...
+//     Solves every instance in the given binary instance files (see InstanceFile.h) and every file in the given
+//     directories (in name order), printing one line per instance: "<file>:<index> <weight> <node> <node> ..."
+//     --solver auto picks a solver for each instance with solve(), within --memory and --time (per instance)
+//     --solver outofcore writes its next links to a scratch file in --scratch (the temporary directory by default)
+//     --stats also prints the SolverStats of every greedy or optimal solve to stderr, and which solver auto picked
+// VergeProject convert [--float] [--packed] <text file> <instance file>
+//     Appends the matrix in a text file (one row per line, weights split by spaces or commas) to an instance file
+//
+// Instance files are memory mapped and each instance goes to the solver as a DistanceMatrix view of the mapping, so
+// nothing is read or copied up front and even a 100k node matrix starts solving straight away.
+
+struct CommandLineOptions
+{
+    std::string m_sSolver = "greedy";
+    unsigned m_numThreads = 0;
+    bool m_bStats = false;
+
+    // Budgets for --solver auto. Its thread count comes from m_numThreads
+    SolveOptions m_solveOptions;
+
+    // Where --solver outofcore puts its scratch file
+    OutOfCoreOptions m_outOfCoreOptions;
+};
+
+// pStats is only filled in by the greedy and optimal solvers. pEngine gets the solver auto picked
+template <typename Matrix>
+std::pair<double, std::vector<int>> solveInstance(const CommandLineOptions& options, const Matrix& distanceMatrix, SolverStats* pStats, std::string* pEngine)
+{
+    const std::string& sSolver = options.m_sSolver;
+    if (sSolver == "auto")
+    {
+        SolveOptions solveOptions = options.m_solveOptions;
+        solveOptions.m_numThreads = options.m_numThreads;
+        SolveResult solved = solve(distanceMatrix, solveOptions);
+        *pEngine = std::string(solveEngineName(solved.m_engine)) + (solved.m_bProvenOptimal ? ", proven optimal" : ", not proven optimal");
+        return { solved.m_dWeight, solved.m_vPath };
+    }
+
+    if (sSolver == "greedy") return pStats ? minPath(distanceMatrix, *pStats) : minPath(distanceMatrix);
+    if (sSolver == "local") return improvePath(distanceMatrix, minPath(distanceMatrix));
+    if (sSolver == "bnb") return branchAndBoundMin(distanceMatrix);
+    if (sSolver == "sparse") return sparseExactMin(distanceMatrix);
+
+    ExactSolverOptions exactOptions;
+    exactOptions.m_numThreads = options.m_numThreads;
+    if (sSolver == "mitm") return meetInTheMiddleMin(distanceMatrix, exactOptions);
+    if (sSolver == "outofcore") return outOfCoreMin(distanceMatrix, exactOptions, options.m_outOfCoreOptions);
+
+    if (sSolver == "multistart")
+    {
+        MultiStartOptions multiStartOptions;
+        multiStartOptions.m_numThreads = options.m_numThreads;
+        return multiStartMinPath(distanceMatrix, multiStartOptions);
+    }
+
+    return pStats ? optimalMin(distanceMatrix, exactOptions, *pStats) : optimalMin(distanceMatrix, exactOptions);
+}
+
+void printStats(const std::string& sInstance, const SolverStats& stats)
+{
+    std::cerr << sInstance << " stats: states " << stats.m_iStatesExpanded << ", transitions " << stats.m_iTransitionsEvaluated
+        << ", pruned same pair " << stats.m_iPrunedSamePair << ", pruned pair visited " << stats.m_iPrunedPairVisited
+        << ", peak layer " << stats.m_iPeakLayerStates << ", allocated " << stats.m_iBytesAllocated << " bytes, setup "
+        << stats.m_dSetupMs << " ms, search " << stats.m_dSearchMs << " ms, reconstruct " << stats.m_dReconstructMs << " ms" << std::endl;
+}
+
+// Solve every instance in one file. Returns false if the file couldn't be read
+bool solveFile(const std::string& sPath, const CommandLineOptions& options, std::size_t& numSolved)
+{
+    MappedFile file;
+    if (!file.open(sPath))
+    {
+        std::cerr << sPath << ": can't open" << std::endl;
+        return false;
+    }
+
+    InstanceReader reader(file.data(), file.size());
+    InstanceView instance;
+    for (std::size_t iIndex = 0; reader.next(instance); iIndex++)
+    {
+        std::pair<double, std::vector<int>> result{ -1.0, {} };
+        std::string sEngine;
+        SolverStats stats;
+        SolverStats* pStats = options.m_bStats ? &stats : nullptr;
+        if ((options.m_sSolver == "optimal" && instance.m_numNodes > kMaxOptimalNodes)
+            || (options.m_sSolver == "mitm" && instance.m_numNodes > kMaxMeetInTheMiddleNodes)
+            || (options.m_sSolver == "outofcore" && instance.m_numNodes > kMaxOutOfCoreNodes))
+        {
+            std::cerr << sPath << ":" << iIndex << ": " << instance.m_numNodes << " nodes is too many for the " << options.m_sSolver << " solver" << std::endl;
+        }
+        else if (instance.m_weightType == WeightType::Float)
+        {
+            result = solveInstance(options, instance.matrix<float>(), pStats, &sEngine);
+        }
+        else
+        {
+            result = solveInstance(options, instance.matrix<double>(), pStats, &sEngine);
+        }
+        if (options.m_bStats) printStats(sPath + ":" + std::to_string(iIndex), stats);
+        if (options.m_bStats && !sEngine.empty()) std::cerr << sPath << ":" << iIndex << " solver: " << sEngine << std::endl;
+
+        std::cout << sPath << ":" << iIndex << " " << result.first;
+        for (int iNode : result.second)
+        {
+            std::cout << " " << iNode;
+        }
+        std::cout << "\n";
+        numSolved++;
+    }
+
+    if (!reader.error().empty())
+    {
+        std::cerr << sPath << ": " << reader.error() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Read a square matrix of weights from text and append it to an instance file
+template <typename T>
+bool convertTextMatrix(const std::string& sTextPath, const std::string& sInstancePath, MatrixLayout layout)
+{
+    std::ifstream in(sTextPath);
+    if (!in)
+    {
+        std::cerr << sTextPath << ": can't open" << std::endl;
+        return false;
+    }
+
+    std::vector<std::vector<double>> rows;
+    std::string sLine;
+    while (std::getline(in, sLine))
+    {
+        std::replace(sLine.begin(), sLine.end(), ',', ' ');
+        std::istringstream line(sLine);
+        std::vector<double> row;
+        for (double dWeight; line >> dWeight; )
+        {
+            row.push_back(dWeight);
+        }
+        if (!row.empty()) rows.push_back(row);
+    }
+
+    for (const std::vector<double>& row : rows)
+    {
+        if (row.size() != rows.size())
+        {
+            std::cerr << sTextPath << ": the matrix isn't square" << std::endl;
+            return false;
+        }
+    }
+
+    std::ofstream out(sInstancePath, std::ios::binary | std::ios::app);
+    if (!out || !writeInstance(out, DistanceMatrix<T>::fromRows(rows, layout)))
+    {
+        std::cerr << sInstancePath << ": can't write" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int printUsage()
+{
+    std::cerr << "usage: VergeProject [--solver auto|greedy|multistart|local|optimal|mitm|bnb|sparse|outofcore] [--threads N] [--memory MB] [--time MS]\n"
+        << "                   [--scratch DIR] [--stats]\n"
+        << "                   <instance file or directory>...\n"
+        << "       VergeProject convert [--float] [--packed] <text file> <instance file>" << std::endl;
+    return 2;
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> vArgs(argv + 1, argv + argc);
+
+    if (!vArgs.empty() && vArgs[0] == "convert")
+    {
+        bool bFloat = false;
+        MatrixLayout layout = MatrixLayout::Full;
+        std::vector<std::string> vPaths;
+        for (std::size_t i = 1; i < vArgs.size(); i++)
+        {
+            if (vArgs[i] == "--float") bFloat = true;
+            else if (vArgs[i] == "--packed") layout = MatrixLayout::PackedUpper;
+            else vPaths.push_back(vArgs[i]);
+        }
+        if (vPaths.size() != 2) return printUsage();
+
+        bool bOk = bFloat ? convertTextMatrix<float>(vPaths[0], vPaths[1], layout) : convertTextMatrix<double>(vPaths[0], vPaths[1], layout);
+        return bOk ? 0 : 1;
+    }
+
+    CommandLineOptions options;
+    std::vector<std::string> vInputs;
+    for (std::size_t i = 0; i < vArgs.size(); i++)
+    {
+        if (vArgs[i] == "--solver" && i + 1 < vArgs.size()) options.m_sSolver = vArgs[++i];
+        else if (vArgs[i] == "--threads" && i + 1 < vArgs.size())
+        {
+            if (!parseWholeNumber(vArgs[++i], 0u, std::numeric_limits<unsigned>::max(), options.m_numThreads)) return printUsage();
+        }
+        else if (vArgs[i] == "--memory" && i + 1 < vArgs.size())
+        {
+            // In MB, so it can't be more than fits in a size_t once shifted up to bytes
+            std::size_t iMegabytes = 0;
+            if (!parseWholeNumber(vArgs[++i], std::size_t{ 0 }, std::numeric_limits<std::size_t>::max() >> 20, iMegabytes)) return printUsage();
+            options.m_solveOptions.m_iMemoryBudget = iMegabytes << 20;
+        }
+        else if (vArgs[i] == "--time" && i + 1 < vArgs.size())
+        {
+            long long iMilliseconds = 0;
+            if (!parseWholeNumber<long long>(vArgs[++i], 0, std::chrono::milliseconds::max().count(), iMilliseconds)) return printUsage();
+            options.m_solveOptions.m_timeBudget = std::chrono::milliseconds(iMilliseconds);
+        }
+        else if (vArgs[i] == "--scratch" && i + 1 < vArgs.size()) options.m_outOfCoreOptions.m_scratchDir = vArgs[++i];
+        else if (vArgs[i] == "--stats") options.m_bStats = true;
+        else if (vArgs[i].rfind("--", 0) == 0) return printUsage();
+        else vInputs.push_back(vArgs[i]);
+    }
+
+    const std::vector<std::string> vSolvers{ "auto", "greedy", "multistart", "local", "optimal", "mitm", "bnb", "sparse", "outofcore" };
+    if (vInputs.empty() || std::find(vSolvers.begin(), vSolvers.end(), options.m_sSolver) == vSolvers.end()) return printUsage();
+
+    std::cout.precision(10);
+    auto start = std::chrono::steady_clock::now();
+    std::size_t numSolved = 0;
+    bool bOk = true;
+    for (const std::string& sInput : vInputs)
+    {
+        std::error_code error;
+        if (!std::filesystem::is_directory(sInput, error))
+        {
+            bOk &= solveFile(sInput, options, numSolved);
+            continue;
+        }
+
+        std::vector<std::string> vFiles;
+        for (const auto& entry : std::filesystem::directory_iterator(sInput, error))
+        {
+            if (entry.is_regular_file()) vFiles.push_back(entry.path().string());
+        }
+        std::sort(vFiles.begin(), vFiles.end());
+        for (const std::string& sFile : vFiles)
+        {
+            bOk &= solveFile(sFile, options, numSolved);
+        }
+    }
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << numSolved << " instances in " << elapsed.count() << " ms" << std::endl;
+    return bOk ? 0 : 1;
 }
 
-int main()
-{
-    std::vector<std::vector<double>> test0{
-        { 0.0, 1.5, 2.7, 1.2 },
-        { 1.5, 0.0, 4.6, 1.1 },
-        { 2.7, 4.6, 0.0, 1.0 },
-        { 1.2, 1.1, 1.0, 0.0 }, };
-
-    std::vector<std::vector<double>> test{
-        { 0.0, 8.1, 9.2, 7.7, 9.3, 2.3, 5.1, 10.2, 6.1, 7.0},
-        { 8.1, 0.0, 12.0, 0.9, 12.0, 9.5, 10.1, 12.8, 2.0, 1.0 },
-        { 9.2, 12.0, 0.0, 11.2, 0.7, 11.1, 8.1, 1.1, 10.5, 11.5 },
-        { 7.7, 0.9, 11.2, 0.0, 11.2, 9.2, 9.5, 12.0, 1.6, 1.1 },
-        { 9.3, 12.0, 0.7, 11.2, 0.0, 11.2, 8.5, 1.0, 10.6, 11.6 },
-        { 2.3, 9.5, 11.1, 9.2, 11.2, 0.0, 5.6, 12.1, 7.7, 8.5 },
-        { 5.1, 10.1, 8.1, 9.5, 8.5, 5.6, 0.0, 9.1, 8.3, 9.3 },
-        { 10.2, 12.8, 1.1, 12.0, 1.0, 12.1, 9.1, 0.0, 11.4, 12.4 },
-        { 6.1, 2.0, 10.5, 1.6, 10.6, 7.7, 8.3, 11.4, 0.0, 1.1 },
-        { 7.0, 1.0, 11.5, 1.1, 11.6, 8.5, 9.3, 12.4, 1.1, 0.0 } };
-
-    std::cout << minPath(test).first << std::endl;
-    std::cout << optimalMin(test).first << std::endl;
-}
\ No newline at end of file
+#endif // VERGEPROJECT_NO_MAIN